@@ -7,6 +7,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
@@ -61,9 +63,21 @@ struct browser_handle {
     struct list_head     *item;
     unsigned int         dirs,sfiles,afiles;
 
+    /* directory scan thread, results (sorted) */
+    pthread_t            thread;
+    int                  scanning, cancel;
+    int                  pipe[2];
+    XtInputId            input;
+    struct file_button   **scan;
+    unsigned int         nscan, iscan;
+    struct file_button   *lastdir_file;
+
     XtWorkProcId         wproc;
 };
 
+#define ADD_BATCH   256   /* widgets created per work proc call */
+#define STAT_BATCH   64   /* icons set per work proc call */
+
 /*----------------------------------------------------------------------*/
 
 static void dir_info(struct file_button *file)
@@ -96,6 +110,7 @@ browser_statfiles(XtPointer clientdata)
     XmString str;
     Pixmap pix;
     char *type;
+    int i;
 
     if (h->item == &h->files) {
 	/* done => read thumbnails now */
@@ -129,75 +144,75 @@ browser_statfiles(XtPointer clientdata)
 	return TRUE;
     }
 
-    /* handle file */
-    file = list_entry(h->item, struct file_button, window);
-    switch (file->st.st_mode & S_IFMT) {
-    case S_IFDIR:
-	type = "dir";
-	break;
-    case S_IFREG:
-	type = "file";
-	break;
-    default:
-	type = NULL;
-    }
-    if (type) {
-	pix = XmGetPixmap(XtScreen(h->container),type,0,0);
-	file_set_icon(file,pix,pix);
+    /* handle files */
+    for (i = 0; i < STAT_BATCH && h->item != &h->files; i++) {
+	file = list_entry(h->item, struct file_button, window);
+	switch (file->st.st_mode & S_IFMT) {
+	case S_IFDIR:
+	    type = "dir";
+	    break;
+	case S_IFREG:
+	    type = "file";
+	    break;
+	default:
+	    type = NULL;
+	}
+	if (type) {
+	    pix = XmGetPixmap(XtScreen(h->container),type,0,0);
+	    file_set_icon(file,pix,pix);
+	}
+	h->item = h->item->next;
     }
-
-    h->item = h->item->next;
     return FALSE;
 }
 
-static void list_add_sorted(struct browser_handle *h, struct file_button *add)
+/*----------------------------------------------------------------------*/
+/* directory scan thread: readdir, stat, sort -- no X11 calls here      */
+
+static int browser_cmp(const void *a, const void *b)
 {
-    struct file_button *file;
-    struct list_head *item;
+    struct file_button *const *aa = a;
+    struct file_button *const *bb = b;
 
-    list_for_each(item,&h->files) {
-	file = list_entry(item, struct file_button, window);
-	if (file_cmp_alpha(add,file) <= 0) {
-	    list_add_tail(&add->window,&file->window);
-	    return;
-	}
+    return file_cmp_alpha(*aa,*bb);
+}
+
+static void browser_freescan(struct browser_handle *h)
+{
+    unsigned int i;
+
+    for (i = h->iscan; i < h->nscan; i++) {
+	free(h->scan[i]->basename);
+	free(h->scan[i]->filename);
+	free(h->scan[i]);
     }
-    list_add_tail(&add->window,&h->files);
+    free(h->scan);
+    h->scan  = NULL;
+    h->nscan = 0;
+    h->iscan = 0;
 }
 
-static Boolean browser_readdir(XtPointer clientdata)
+static void* browser_scandir(void *arg)
 {
-    struct browser_handle *h = clientdata;
+    struct browser_handle *h = arg;
     struct file_button *file;
-    struct list_head *item;
     struct dirent *dirent;
-    WidgetList children;
-    struct file_button *lastdir = NULL;
-    Cardinal nchildren;
-    XmString str,elem;
+    unsigned int len, size = 0;
     DIR *dir;
-    unsigned int len;
 
-    /* status line */
-    str  = XmStringGenerate("scanning ", NULL, XmMULTIBYTE_TEXT, NULL);
-    elem = XmStringGenerate(h->dirname, NULL, XmMULTIBYTE_TEXT, NULL);
-    str  = XmStringConcatAndFree(str,elem);
-    elem = XmStringGenerate(" ...", NULL, XmMULTIBYTE_TEXT, NULL);
-    str  = XmStringConcatAndFree(str,elem);
-    XtVaSetValues(h->status,XmNlabelString,str,NULL);
-    XmStringFree(str);
-    ptr_busy();
+    h->dirs = 0;
+    h->sfiles = 0;
+    h->afiles = 0;
 
-    /* read + sort dir */
     dir = opendir(h->dirname);
     if (NULL == dir) {
 	fprintf(stderr,"opendir %s: %s\n",h->dirname,strerror(errno));
-	return -1;
+	goto done;
     }
-    h->dirs = 0;
-    h->sfiles = 0;
-    h->afiles = 0;
     while (NULL != (dirent = readdir(dir))) {
+	if (__atomic_load_n(&h->cancel, __ATOMIC_RELAXED))
+	    break;
+
 	/* skip dotfiles */
 	if (dirent->d_name[0] == '.' && 0 != strcmp(dirent->d_name,".."))
 	    continue;
@@ -229,7 +244,7 @@ static Boolean browser_readdir(XtPointer clientdata)
 	if (file->d_type != DT_UNKNOWN) {
 	    file->st.st_mode = DTTOIF(file->d_type);
 	} else {
-	    if (-1 == stat(file->filename, &file->st)) {
+	    if (-1 == fstatat(dirfd(dir), dirent->d_name, &file->st, 0)) {
 		fprintf(stderr,"stat %s: %s\n",
 			file->filename,strerror(errno));
 	    }
@@ -238,44 +253,71 @@ static Boolean browser_readdir(XtPointer clientdata)
 	/* user-specified filter */
 	if (S_ISDIR(file->st.st_mode)) {
 	    h->dirs++;
-	    if (h->lastdir && 0 == strcmp(h->lastdir,file->filename)) {
-		lastdir = file;
-	    }
 	} else {
 	    h->afiles++;
 	    if (h->filter && 0 != fnmatch(h->filter,dirent->d_name,0)) {
+		free(file->basename);
+		free(file->filename);
 		free(file);
 		continue;
 	    } else
 		h->sfiles++;
 	}
 
-	list_add_sorted(h,file);
+	if (h->nscan == size) {
+	    size = size ? size * 2 : 256;
+	    h->scan = realloc(h->scan, size * sizeof(*h->scan));
+	}
+	h->scan[h->nscan++] = file;
     }
     closedir(dir);
 
-    /* create & manage widgets */
-    list_for_each(item,&h->files) {
-	file = list_entry(item, struct file_button, window);
+    if (h->nscan)
+	qsort(h->scan, h->nscan, sizeof(*h->scan), browser_cmp);
+
+ done:
+    write(h->pipe[1], "", 1);
+    return NULL;
+}
+
+static Boolean browser_addfiles(XtPointer clientdata)
+{
+    struct browser_handle *h = clientdata;
+    struct file_button *file;
+    Widget batch[ADD_BATCH];
+    Cardinal n;
+
+    /* create widgets, a batch at a time */
+    for (n = 0; n < ADD_BATCH && h->iscan < h->nscan; n++) {
+	file = h->scan[h->iscan++];
+	list_add_tail(&file->window,&h->files);
 	file_createwidgets(h->container, file);
+	batch[n] = file->widget;
+	if (h->lastdir && S_ISDIR(file->st.st_mode) &&
+	    0 == strcmp(h->lastdir,file->filename))
+	    h->lastdir_file = file;
     }
-    nchildren = XmContainerGetItemChildren(h->container,NULL,&children);
-    XtManageChildren(children,nchildren);
-    if (nchildren)
-	XtFree((XtPointer)children);
+    if (n)
+	XtManageChildren(batch,n);
+    if (h->iscan < h->nscan)
+	return FALSE;
+
+    /* all done */
+    browser_freescan(h);
     container_relayout(h->container);
     if (h->lastdir) {
-	if (lastdir) {
+	if (h->lastdir_file) {
 	    if (debug)
 		fprintf(stderr,"lastdir: %s\n",h->lastdir);
 	    XtVaSetValues(h->container,
-			  XmNinitialFocus, lastdir->widget,
+			  XmNinitialFocus, h->lastdir_file->widget,
 			  NULL);
 // 	    XmScrollVisible(h->scroll, lastdir->widget, 25, 25);
 //	    XtSetKeyboardFocus(h->shell,h->container);
 	}
 	free(h->lastdir);
 	h->lastdir = NULL;
+	h->lastdir_file = NULL;
     }
     XtVaSetValues(h->shell,XtNtitle,h->dirname,NULL);
     ptr_idle();
@@ -286,11 +328,80 @@ static Boolean browser_readdir(XtPointer clientdata)
     return TRUE;
 }
 
+static void browser_scanjoin(struct browser_handle *h)
+{
+    pthread_join(h->thread,NULL);
+    XtRemoveInput(h->input);
+    close(h->pipe[0]);
+    close(h->pipe[1]);
+    h->scanning = 0;
+}
+
+static void
+browser_scandone(XtPointer clientdata, int *src, XtInputId *id)
+{
+    struct browser_handle *h = clientdata;
+
+    browser_scanjoin(h);
+    h->wproc = XtAppAddWorkProc(app_context,browser_addfiles,h);
+}
+
+static Boolean browser_readdir(XtPointer clientdata)
+{
+    struct browser_handle *h = clientdata;
+    XmString str,elem;
+
+    /* status line */
+    str  = XmStringGenerate("scanning ", NULL, XmMULTIBYTE_TEXT, NULL);
+    elem = XmStringGenerate(h->dirname, NULL, XmMULTIBYTE_TEXT, NULL);
+    str  = XmStringConcatAndFree(str,elem);
+    elem = XmStringGenerate(" ...", NULL, XmMULTIBYTE_TEXT, NULL);
+    str  = XmStringConcatAndFree(str,elem);
+    XtVaSetValues(h->status,XmNlabelString,str,NULL);
+    XmStringFree(str);
+    ptr_busy();
+
+    /* read + sort dir in background */
+    h->wproc = 0;
+    h->cancel = 0;
+    if (-1 == pipe2(h->pipe, O_CLOEXEC)) {
+	fprintf(stderr,"pipe: %s\n",strerror(errno));
+	ptr_idle();
+	return TRUE;
+    }
+    errno = pthread_create(&h->thread, NULL, browser_scandir, h);
+    if (0 != errno) {
+	fprintf(stderr,"pthread_create: %s\n",strerror(errno));
+	close(h->pipe[0]);
+	close(h->pipe[1]);
+	h->pipe[0] = -1;
+	h->pipe[1] = -1;
+	browser_scandir(h);
+	h->wproc = XtAppAddWorkProc(app_context,browser_addfiles,h);
+	return TRUE;
+    }
+    h->input = XtAppAddInput(app_context, h->pipe[0],
+			     (XtPointer)XtInputReadMask,
+			     browser_scandone, h);
+    h->scanning = 1;
+    return TRUE;
+}
+
 static void browser_bgcancel(struct browser_handle *h)
 {
-    if (h->wproc)
+    if (h->scanning) {
+	__atomic_store_n(&h->cancel, 1, __ATOMIC_RELAXED);
+	browser_scanjoin(h);
+	ptr_idle();
+    }
+    if (h->wproc) {
 	XtRemoveWorkProc(h->wproc);
+	if (h->scan)
+	    ptr_idle(); /* browser_addfiles interrupted */
+    }
     h->wproc = 0;
+    browser_freescan(h);
+    h->lastdir_file = NULL;
 }
 
 /*----------------------------------------------------------------------*/
@@ -298,6 +409,9 @@ static void browser_bgcancel(struct browser_handle *h)
 static void
 browser_cd(struct browser_handle *h, char *dir)
 {
+    /* stop scanning the old dir */
+    browser_bgcancel(h);
+
     /* build new dir path */
     if (h->lastdir)
 	free(h->lastdir);
@@ -305,7 +419,6 @@ browser_cd(struct browser_handle *h, char *dir)
     h->dirname = strdup(dir);
 
     /* cleanup old stuff + read dir */
-    browser_bgcancel(h);
     container_delwidgets(h->container);
     h->wproc = XtAppAddWorkProc(app_context,browser_readdir,h);
 }
@@ -318,6 +431,7 @@ browser_filter_done(Widget widget, XtPointer clientdata, XtPointer call_data)
     char *filter;
 
     if (cb->reason == XmCR_OK) {
+	browser_bgcancel(h);
 	filter = XmStringUnparse(cb->value,NULL,
 				 XmMULTIBYTE_TEXT,XmMULTIBYTE_TEXT,
 				 NULL,0,0);
@@ -330,7 +444,6 @@ browser_filter_done(Widget widget, XtPointer clientdata, XtPointer call_data)
 	
 	if (debug)
 	    fprintf(stderr,"filter: %s\n", h->filter ? h->filter : "[none]");
-	browser_bgcancel(h);
 	container_delwidgets(h->container);
 	h->wproc = XtAppAddWorkProc(app_context,browser_readdir,h);
     }
@@ -359,10 +472,10 @@ browser_nofilter(Widget widget, XtPointer clientdata, XtPointer call_data)
 	return;
     if (debug)
 	fprintf(stderr,"filter: reset\n");
+    browser_bgcancel(h);
     free(h->filter);
     h->filter = NULL;
     
-    browser_bgcancel(h);
     container_delwidgets(h->container);
     h->wproc = XtAppAddWorkProc(app_context,browser_readdir,h);
 }
@@ -505,6 +618,7 @@ browser_window(char *dirname)
 
     XtAddCallback(h->scroll, XmNtraverseObscuredCallback,
 		  container_traverse_cb, NULL);
+    container_scroll_prio(h->scroll, h->container);
     XtAddCallback(h->container,XmNconvertCallback,
 		  container_convert_cb,h);
 
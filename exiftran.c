@@ -16,6 +16,7 @@
 #include <jpeglib.h>
 #include "transupp.h"		/* Support routines for jpegtran */
 #include "jpegtools.h"
+#include "jpegscan.h"
 #include "genthumbnail.h"
 
 /* ---------------------------------------------------------------------- */
@@ -48,7 +49,7 @@ static int dump_file(FILE *out, char *filename)
 {
     ExifData   *ed;
 
-    ed = exif_data_new_from_file (filename);
+    ed = jpeg_exif_data(filename);
     if (NULL == ed) {
 	fprintf(stderr,"%s: no EXIF data\n",filename);
 	return -1;
@@ -140,6 +140,8 @@ void shadow_composite_image(struct ida_image *img,
                                img->i.width, img->i.height);
         pixman_image_unref(mask);
     }
+    /* out-of-core images: the shadow buffer has a copy now */
+    ida_image_release(img, 0, img->i.height);
 }
 
 void shadow_darkify(int x1, int x2, int y1,int y2, int percent)
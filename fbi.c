@@ -14,6 +14,7 @@
 #include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <termios.h>
 #include <math.h>
 #include <signal.h>
@@ -24,6 +25,9 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/inotify.h>
+#include <dirent.h>
 
 #include <jpeglib.h>
 
@@ -42,6 +46,7 @@
 
 #include "transupp.h"		/* Support routines for jpegtran */
 #include "jpegtools.h"
+#include "jpegscan.h"
 
 /* ---------------------------------------------------------------------- */
 
@@ -54,6 +59,8 @@ int             textreading = 0, redraw = 0, statusline = 1;
 int             fitwidth;
 
 /* file list */
+#define ROI_MARGIN 256 /* pixels around the visible part of huge images */
+
 struct flist {
     /* file list */
     int               nr;
@@ -71,6 +78,12 @@ struct flist {
     struct ida_image  *fimg;
     struct ida_image  *simg;
     struct list_head  lru;
+
+    /* huge images: fimg is a reduced overview, zoomed in simg
+     * is the visible region only, see flist_img_roi() */
+    unsigned int      vwidth, vheight; /* size of the scaled image */
+    int               region;
+    struct ida_rect   roi;             /* simg within the scaled image */
 };
 static LIST_HEAD(flist);
 static LIST_HEAD(flru);
@@ -79,10 +92,13 @@ static struct flist  *fcurrent;
 static struct ida_image *img;
 static const char *filelist;
 static struct stat liststat;
+static const char *watchdir;
+static int watchfd = -1;
 
 /* accounting */
 static int img_cnt, min_cnt = 2, max_cnt = 16;
-static int img_mem, max_mem_mb;
+static size_t img_mem;
+static int max_mem_mb;
 
 /* graphics interface */
 gfxstate                   *gfx;
@@ -114,7 +130,10 @@ static cairo_font_extents_t *extents;
 
 static struct ida_image *flist_img_get(struct flist *f);
 static void flist_img_load(struct flist *f, int prefetch);
+static void flist_img_pass(struct flist *f, struct ida_image *img);
+static void flist_img_roi(struct flist *f);
 static void flist_img_free(struct flist *f);
+static char *make_info(struct ida_image *img, float scale);
 
 /* ---------------------------------------------------------------------- */
 
@@ -171,6 +190,26 @@ static struct flist *flist_add(const char *filename)
     return f;
 }
 
+static struct flist *flist_add_sorted(const char *filename)
+{
+    struct list_head *item;
+    struct flist *f, *n;
+
+    n = malloc(sizeof(*n));
+    memset(n,0,sizeof(*n));
+    n->name = strdup(filename);
+    INIT_LIST_HEAD(&n->lru);
+
+    /* new files usually show up at the end, so search backwards */
+    for (item = flist.prev; item != &flist; item = item->prev) {
+	f = list_entry(item, struct flist, list);
+	if (strcoll(f->name, filename) <= 0)
+	    break;
+    }
+    list_add(&n->list, item);
+    return n;
+}
+
 static struct flist *flist_find(const char *filename)
 {
     struct list_head *item;
@@ -186,7 +225,7 @@ static struct flist *flist_find(const char *filename)
 
 static int flist_add_list(const char *listfile)
 {
-    char filename[256];
+    char filename[PATH_MAX];
     struct flist *f;
     FILE *list;
 
@@ -266,6 +305,102 @@ static int flist_check_reload_list(const char *listfile)
     return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* watch a directory, add images as they show up (fbgs renders into one)  */
+
+static void flist_watch_add(const char *name)
+{
+    char *filename;
+    struct flist *f;
+
+    if (name[0] == '.')
+	return;
+    if (asprintf(&filename, "%s/%s", watchdir, name) < 0)
+	return;
+    f = flist_find(filename);
+    if (f) {
+	/* file rewritten, drop cached (maybe incomplete) image */
+	if (f != fcurrent)
+	    flist_img_free(f);
+    } else {
+	flist_add_sorted(filename);
+    }
+    free(filename);
+}
+
+static int flist_watch_scan_filter(const struct dirent *ent)
+{
+    return ent->d_name[0] != '.';
+}
+
+static int flist_watch_init(const char *dirname)
+{
+    struct dirent **namelist;
+    int i, n;
+
+    watchdir = dirname;
+    watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watchfd < 0) {
+	fprintf(stderr,"inotify_init: %s\n",strerror(errno));
+	return -1;
+    }
+    if (inotify_add_watch(watchfd, dirname, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+	fprintf(stderr,"watch %s: %s\n",dirname,strerror(errno));
+	close(watchfd);
+	watchfd = -1;
+	return -1;
+    }
+
+    /* pick up files which are already there */
+    n = scandir(dirname, &namelist, flist_watch_scan_filter, alphasort);
+    for (i = 0; i < n; i++) {
+	flist_watch_add(namelist[i]->d_name);
+	free(namelist[i]);
+    }
+    if (n >= 0)
+	free(namelist);
+    return 0;
+}
+
+static int flist_watch_check(int wait)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    fd_set set;
+    ssize_t len;
+    char *ptr;
+    int count = 0;
+
+    if (watchfd < 0)
+	return 0;
+
+    for (;;) {
+	len = read(watchfd, buf, sizeof(buf));
+	if (len <= 0) {
+	    if (len < 0 && errno == EAGAIN && wait && !count) {
+		FD_ZERO(&set);
+		FD_SET(watchfd, &set);
+		select(watchfd + 1, &set, NULL, NULL, NULL);
+		continue;
+	    }
+	    break;
+	}
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *)ptr;
+	    if (!ev->len)
+		continue;
+	    flist_watch_add(ev->name);
+	    count++;
+	}
+    }
+    if (count)
+	flist_renumber();
+    return count;
+}
+
+/* ---------------------------------------------------------------------- */
+
 static int flist_islast(struct flist *f)
 {
     return (&flist == f->list.next) ? 1 : 0;
@@ -371,6 +506,13 @@ shadow_draw_image(struct ida_image *img, int xoff, int yoff,
     shadow_composite_image(img, xs - xoff, ys - yoff, weight);
 }
 
+static void flist_img_draw(struct flist *f, unsigned int first,
+			   unsigned int last, int weight)
+{
+    shadow_draw_image(flist_img_get(f), f->left - f->roi.x1,
+		      f->top - f->roi.y1, first, last, weight);
+}
+
 static void status_prepare(void)
 {
     struct ida_image *img = flist_img_get(fcurrent);
@@ -378,7 +520,7 @@ static void status_prepare(void)
     int y2 = gfx->vdisplay - 1;
 
     if (img) {
-	shadow_draw_image(img, fcurrent->left, fcurrent->top, y1, y2, 100);
+	flist_img_draw(fcurrent, y1, y2, 100);
 	shadow_darkify(0, gfx->hdisplay-1, y1, y2, transparency);
     } else {
 	shadow_clear_lines(y1, y2);
@@ -451,7 +593,7 @@ static void show_exif(struct flist *f)
     if (!console_visible)
 	return;
 
-    ed = exif_data_new_from_file(f->name);
+    ed = jpeg_exif_data(f->name);
     if (NULL == ed) {
 	status_error("image has no EXIF data");
 	return;
@@ -533,27 +675,76 @@ static void show_help(void)
 	"  x              - mirror image vertically (top / bottom)",
 	"  y              - mirror image horizontally (left to right)",
     };
-
-    shadow_draw_text_box(24, 16, transparency,
-			 help, ARRAY_SIZE(help));
+    char *lines[ARRAY_SIZE(help) + 3];
+    char cache[80], pool[80];
+    struct ida_pool_stats st;
+    unsigned int i;
+
+    ida_pool_get_stats(&st);
+    snprintf(cache, sizeof(cache), "image cache: %d of %d MB used",
+	     (int)(img_mem >> 20), max_mem_mb);
+    snprintf(pool, sizeof(pool),
+	     "buffer pool: %lu reused, %lu new, %lu freed, %zd MB idle",
+	     st.hits, st.misses, st.dropped, st.idle >> 20);
+    for (i = 0; i < ARRAY_SIZE(help); i++)
+	lines[i] = help[i];
+    lines[i++] = "";
+    lines[i++] = cache;
+    lines[i++] = pool;
+
+    shadow_draw_text_box(24, 16, transparency, lines, i);
     shadow_render(gfx);
 }
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ * cache accounting.  Out-of-core images are paged by the kernel, but
+ * they still occupy their temp file until evicted, so they count too.
+ */
+static size_t img_bytes(struct ida_image *img)
+{
+    return (size_t)pixman_image_get_stride(img->p) * img->i.height;
+}
+
 static void free_image(struct ida_image *img)
 {
     if (img) {
 	if (img->p) {
-	    img_mem -= img->i.width * img->i.height * 3;
+	    img_mem -= img_bytes(img);
 	    ida_image_free(img);
 	}
 	free(img);
     }
 }
 
+/* real size of possibly reduced (overview, thumbnail) images */
+static unsigned int img_real_width(struct ida_image *img)
+{
+    return img->i.thumbnail ? img->i.real_width : img->i.width;
+}
+
+static unsigned int img_real_height(struct ida_image *img)
+{
+    return img->i.thumbnail ? img->i.real_height : img->i.height;
+}
+
+/* huge images are loaded as reduced overview, see flist_img_roi() */
+static int img_huge(struct ida_image_info *i)
+{
+    uint64_t bytes = (uint64_t)i->width * i->height *
+	ida_format_bits(i->format) / 8;
+
+    return bytes > (uint64_t)max_mem_mb * 1024 * 1024 / 4;
+}
+
+/*
+ * preview != NULL: show intermediate passes of progressive images
+ * rect != NULL: load only that region, reduced by *shrink
+ */
 static struct ida_image*
-read_image(char *filename)
+read_image(char *filename, struct flist *preview,
+	   struct ida_rect *rect, unsigned int *shrink)
 {
     struct ida_loader *loader = NULL;
     struct ida_image *img;
@@ -611,17 +802,42 @@ read_image(char *filename)
     /* load image */
     img = malloc(sizeof(*img));
     memset(img,0,sizeof(*img));
-    data = loader->init(fp,filename,0,&img->i,0);
+    data = loader->init(fp,filename,0,&img->i,
+			LOAD_NATIVE | (preview ? LOAD_PROGRESSIVE : 0));
     if (NULL == data) {
 	fprintf(stderr,"loading %s [%s] FAILED\n",filename,loader->name);
 	free_image(img);
 	return NULL;
     }
+    if (rect) {
+	if (!loader->region ||
+	    0 != loader->region(data, &img->i, rect, shrink)) {
+	    loader->done(data);
+	    free_image(img);
+	    return NULL;
+	}
+    } else if (loader->region && img_huge(&img->i)) {
+	struct ida_rect all = { 0, 0, img->i.width, img->i.height };
+	unsigned int reduce = 1;
+
+	/* overview: reduce as long as it still covers the screen */
+	while (reduce < 8 &&
+	       (img->i.width  / (reduce * 2) >= gfx->hdisplay ||
+		img->i.height / (reduce * 2) >= gfx->vdisplay))
+	    reduce *= 2;
+	loader->region(data, &img->i, &all, &reduce);
+    }
     ida_image_alloc(img);
-    img_mem += img->i.width * img->i.height * 3;
-    for (y = 0; y < img->i.height; y++) {
-        check_console_switch();
-	loader->read(ida_image_scanline(img, y), y, data);
+    img_mem += img_bytes(img);
+    for (;;) {
+	for (y = 0; y < img->i.height; y++) {
+	    check_console_switch();
+	    loader->read(ida_image_native_scanline(img, y), y, data);
+	    ida_image_line_done(img, y);
+	}
+	if (!preview || !loader->pass || !loader->pass(data))
+	    break;
+	flist_img_pass(preview, img);
     }
     loader->done(data);
     return img;
@@ -651,12 +867,14 @@ scale_image(struct ida_image *src, float scale)
 
     data = desc_resize.init(src,&rect,&dest->i,&p);
     ida_image_alloc(dest);
-    img_mem += dest->i.width * dest->i.height * 3;
+    img_mem += img_bytes(dest);
     for (y = 0; y < dest->i.height; y++) {
         check_console_switch();
 	desc_resize.work(src, &rect, ida_image_scanline(dest, y), y, data);
+	ida_image_line_done(dest, y);
     }
     desc_resize.done(data);
+    ida_image_release(src, 0, src->i.height);
     return dest;
 }
 
@@ -664,10 +882,10 @@ static float auto_scale(struct ida_image *img)
 {
     float xs,ys,scale;
 
-    xs = (float)gfx->hdisplay / img->i.width;
+    xs = (float)gfx->hdisplay / img_real_width(img);
     if (fitwidth)
 	return xs;
-    ys = (float)gfx->vdisplay / img->i.height;
+    ys = (float)gfx->vdisplay / img_real_height(img);
     scale = (xs < ys) ? xs : ys;
     return scale;
 }
@@ -697,10 +915,8 @@ static void effect_blend(struct flist *f, struct flist *t)
 	weight = msecs * 100 / blend_msecs;
 	if (weight > 100)
 	    weight = 100;
-	shadow_draw_image(flist_img_get(f), f->left, f->top,
-			  0, gfx->vdisplay-1, 100);
-	shadow_draw_image(flist_img_get(t), t->left, t->top,
-			  0, gfx->vdisplay-1, weight);
+	flist_img_draw(f, 0, gfx->vdisplay-1, 100);
+	flist_img_draw(t, 0, gfx->vdisplay-1, weight);
 
 	if (perfmon) {
 	    pos += snprintf(linebuffer+pos, sizeof(linebuffer)-pos,
@@ -731,14 +947,18 @@ svga_show(struct flist *f, struct flist *prev,
 {
     static int        paused = 0, skip = -1;
 
-    struct ida_image  *img = flist_img_get(f);
+    struct ida_image  *img;
     int               exif = 0, help = 0;
     int               rc;
     char              key[16];
     uint32_t          keycode, keymod;
     char              linebuffer[80];
+    time_t            deadline = 0;
+    int               wait;
 
     *nr = 0;
+    flist_img_roi(f);
+    img = flist_img_get(f);
     if (NULL == img)
 	return skip;
 
@@ -746,28 +966,29 @@ svga_show(struct flist *f, struct flist *prev,
     for (;;) {
 	if (redraw) {
 	    redraw = 0;
-	    if (img->i.height <= gfx->vdisplay) {
+	    if (f->vheight <= gfx->vdisplay) {
 		f->top = 0;
 	    } else {
 		if (f->top < 0)
 		    f->top = 0;
-		if (f->top + gfx->vdisplay > img->i.height)
-		    f->top = img->i.height - gfx->vdisplay;
+		if (f->top + gfx->vdisplay > f->vheight)
+		    f->top = f->vheight - gfx->vdisplay;
 	    }
-	    if (img->i.width <= gfx->hdisplay) {
+	    if (f->vwidth <= gfx->hdisplay) {
 		f->left = 0;
 	    } else {
 		if (f->left < 0)
 		    f->left = 0;
-		if (f->left + gfx->hdisplay > img->i.width)
-		    f->left = img->i.width - gfx->hdisplay;
+		if (f->left + gfx->hdisplay > f->vwidth)
+		    f->left = f->vwidth - gfx->hdisplay;
 	    }
+	    flist_img_roi(f);
 	    if (blend_msecs && prev && prev != f &&
 		flist_img_get(prev) && flist_img_get(f)) {
 		effect_blend(prev, f);
 		prev = NULL;
 	    } else {
-		shadow_draw_image(img, f->left, f->top, 0, gfx->vdisplay-1, 100);
+		flist_img_draw(f, 0, gfx->vdisplay-1, 100);
 	    }
 	    status_update(desc, info);
 	    shadow_render(gfx);
@@ -789,12 +1010,29 @@ svga_show(struct flist *f, struct flist *prev,
 	    return -1;
 	}
 
-        rc = kbd_wait(paused ? 0 : timeout);
+	/* new pages (fbgs) wake us up too, keep the slideshow timing */
+	wait = 0;
+	if (!paused && timeout) {
+	    if (!deadline)
+		deadline = time(NULL) + timeout;
+	    wait = deadline - time(NULL);
+	    if (wait < 1)
+		return -1; /* timeout */
+	}
+        rc = kbd_wait_fd(wait, watchfd);
         if (check_console_switch()) {
 	    continue;
 	}
 	if (rc < 1)
 	    return -1; /* timeout */
+	if (2 == rc) {
+	    if (flist_watch_check(0) && f->fimg) {
+		info = make_info(f->fimg, f->scale);
+		status_update(desc, info);
+	    }
+	    continue;
+	}
+	deadline = 0;
 
         rc = kbd_read(key, sizeof(key), &keycode, &keymod);
         if (rc < 0)
@@ -802,7 +1040,7 @@ svga_show(struct flist *f, struct flist *prev,
 
         switch (keycode) {
         case XKB_KEY_space:
-	    if (textreading && f->top < (int)(img->i.height - gfx->vdisplay)) {
+	    if (textreading && f->top < (int)(f->vheight - gfx->vdisplay)) {
 		redraw = 1;
 		f->top += f->text_steps;
 	    } else {
@@ -825,7 +1063,7 @@ svga_show(struct flist *f, struct flist *prev,
             break;
         case XKB_KEY_End:
 	    redraw = 1;
-	    f->top = img->i.height - gfx->vdisplay;
+	    f->top = f->vheight - gfx->vdisplay;
             break;
         case XKB_KEY_Left:
 	    redraw = 1;
@@ -849,7 +1087,7 @@ svga_show(struct flist *f, struct flist *prev,
         case XKB_KEY_Page_Down:
         case XKB_KEY_J:
         case XKB_KEY_N:
-	    if (textreading && f->top < (int)(img->i.height - gfx->vdisplay)) {
+	    if (textreading && f->top < (int)(f->vheight - gfx->vdisplay)) {
 		redraw = 1;
 		f->top += f->text_steps;
 	    } else {
@@ -920,15 +1158,16 @@ svga_show(struct flist *f, struct flist *prev,
 
 static void scale_fix_top_left(struct flist *f, float old, float new)
 {
-    struct ida_image *img = flist_img_get(f);
     unsigned int width, height;
     float cx,cy;
 
-    cx = (float)(f->left + gfx->hdisplay/2) / (img->i.width  * old);
-    cy = (float)(f->top  + gfx->vdisplay/2) / (img->i.height * old);
+    width   = img_real_width(f->fimg);
+    height  = img_real_height(f->fimg);
+    cx = (float)(f->left + gfx->hdisplay/2) / (width  * old);
+    cy = (float)(f->top  + gfx->vdisplay/2) / (height * old);
 
-    width   = img->i.width  * new;
-    height  = img->i.height * new;
+    width   = width  * new;
+    height  = height * new;
     f->left = cx * width  - gfx->hdisplay/2;
     f->top  = cy * height - gfx->vdisplay/2;
 
@@ -998,7 +1237,7 @@ static char *make_info(struct ida_image *img, float scale)
 	     "%s%.0f%% %ux%u %d/%d",
 	     fcurrent->tag ? "* " : "",
 	     scale*100,
-	     img->i.width, img->i.height,
+	     img_real_width(img), img_real_height(img),
 	     fcurrent->nr, fcount);
     return linebuffer;
 }
@@ -1007,12 +1246,15 @@ static char *make_info(struct ida_image *img, float scale)
 
 static struct ida_image *flist_img_get(struct flist *f)
 {
-    if (!f)
+    if (!f || !f->fimg)
         return NULL;
-    if (1 != f->scale)
+    if (f->simg)
 	return f->simg;
-    else
+    if (!f->region &&
+	f->vwidth  == f->fimg->i.width &&
+	f->vheight == f->fimg->i.height)
 	return f->fimg;
+    return NULL;
 }
 
 static void flist_img_free(struct flist *f)
@@ -1025,6 +1267,8 @@ static void flist_img_free(struct flist *f)
 	free_image(f->simg);
     f->fimg = NULL;
     f->simg = NULL;
+    f->region = 0;
+    memset(&f->roi, 0, sizeof(f->roi));
     list_del(&f->lru);
     img_cnt--;
 }
@@ -1048,7 +1292,7 @@ static void flist_img_release_memory(void)
 	try_release = 0;
 	if (img_cnt > max_cnt)
 	    try_release = 1;
-	if (img_mem > max_mem_mb * 1024 * 1024)
+	if (img_mem > (size_t)max_mem_mb * 1024 * 1024)
 	    try_release = 1;
 	if (!try_release)
 	    break;
@@ -1061,38 +1305,196 @@ static void flist_img_release_memory(void)
 static void flist_img_scale(struct flist *f, float scale, int prefetch)
 {
     char linebuffer[128];
+    float factor;
 
     if (!f->fimg)
 	return;
-    if (f->simg && f->scale == scale)
+    if ((f->simg || f->region) && f->scale == scale)
 	return;
 
     if (f->simg) {
 	free_image(f->simg);
 	f->simg = NULL;
     }
-    if (scale != 1) {
+    memset(&f->roi, 0, sizeof(f->roi));
+    f->vwidth  = img_real_width(f->fimg)  * scale;
+    f->vheight = img_real_height(f->fimg) * scale;
+    f->scale   = scale;
+
+    /* scale factor relative to fimg, which might be an overview */
+    factor = scale * img_real_width(f->fimg) / f->fimg->i.width;
+    f->region = f->fimg->i.thumbnail && factor > 1;
+    if (f->region)
+	return; /* flist_img_roi() loads what is visible */
+
+    if (factor != 1) {
 	if (!prefetch) {
 	    snprintf(linebuffer, sizeof(linebuffer),
 		     "scaling (%.0f%%) %s ...",
 		     scale*100, f->name);
 	    status_update(linebuffer, NULL);
 	}
-	f->simg = scale_image(f->fimg,scale);
+	f->simg = scale_image(f->fimg,factor);
 	if (!f->simg) {
 	    snprintf(linebuffer,sizeof(linebuffer),
 		     "%s: scaling FAILED",f->name);
 	    status_error(linebuffer);
+	    return;
 	}
+	f->vwidth  = f->simg->i.width;
+	f->vheight = f->simg->i.height;
+    } else {
+	f->vwidth  = f->fimg->i.width;
+	f->vheight = f->fimg->i.height;
     }
-    f->scale = scale;
 }
 
-static void flist_img_load(struct flist *f, int prefetch)
+/* zoomed into a huge image: decode the visible part plus margin */
+static void flist_img_roi(struct flist *f)
 {
+    struct ida_rect view, rect;
+    struct ida_image *img;
+    unsigned int shrink = 1;
     char linebuffer[128];
+    float factor, fit;
+
+    if (!f->fimg || !f->region)
+	return;
+
+    /* visible part, in scaled image pixels */
+    view.x1 = f->left;
+    if (view.x1 > (int)f->vwidth - (int)gfx->hdisplay)
+	view.x1 = (int)f->vwidth - (int)gfx->hdisplay;
+    if (view.x1 < 0)
+	view.x1 = 0;
+    view.y1 = f->top;
+    if (view.y1 > (int)f->vheight - (int)gfx->vdisplay)
+	view.y1 = (int)f->vheight - (int)gfx->vdisplay;
+    if (view.y1 < 0)
+	view.y1 = 0;
+    view.x2 = view.x1 + gfx->hdisplay;
+    if (view.x2 > f->vwidth)
+	view.x2 = f->vwidth;
+    view.y2 = view.y1 + gfx->vdisplay;
+    if (view.y2 > f->vheight)
+	view.y2 = f->vheight;
+    if (f->simg &&
+	view.x1 >= f->roi.x1 && view.x2 <= f->roi.x2 &&
+	view.y1 >= f->roi.y1 && view.y2 <= f->roi.y2)
+	return;
+
+    if (f->simg) {
+	free_image(f->simg);
+	f->simg = NULL;
+    }
+    snprintf(linebuffer, sizeof(linebuffer),
+	     "loading region (%.0f%%) %s ...", f->scale*100, f->name);
+    status_update(linebuffer, NULL);
+
+    /* full size image pixels, loader clips to the image size */
+    rect.x1 = (view.x1 > ROI_MARGIN ? view.x1 - ROI_MARGIN : 0) / f->scale;
+    rect.y1 = (view.y1 > ROI_MARGIN ? view.y1 - ROI_MARGIN : 0) / f->scale;
+    rect.x2 = (view.x2 + ROI_MARGIN) / f->scale + 1;
+    rect.y2 = (view.y2 + ROI_MARGIN) / f->scale + 1;
+    while (shrink < 8 && f->scale * shrink * 2 <= 1)
+	shrink *= 2;
+
+    img = read_image(f->name, NULL, &rect, &shrink);
+    if (!img) {
+	/* no region support, show the overview, upscaled to screen size max */
+	f->region = 0;
+	memset(&f->roi, 0, sizeof(f->roi));
+	factor = (float)f->vwidth / f->fimg->i.width;
+	fit = (float)gfx->hdisplay / f->fimg->i.width;
+	if (fit > (float)gfx->vdisplay / f->fimg->i.height)
+	    fit = (float)gfx->vdisplay / f->fimg->i.height;
+	if (factor > fit)
+	    factor = fit;
+	if (factor > 1) {
+	    f->simg = scale_image(f->fimg, factor);
+	    if (!f->simg) {
+		snprintf(linebuffer,sizeof(linebuffer),
+			 "%s: scaling FAILED",f->name);
+		status_error(linebuffer);
+	    }
+	}
+	f->vwidth  = f->simg ? f->simg->i.width  : f->fimg->i.width;
+	f->vheight = f->simg ? f->simg->i.height : f->fimg->i.height;
+	return;
+    }
+    if (f->scale * shrink != 1) {
+	f->simg = scale_image(img, f->scale * shrink);
+	free_image(img);
+	if (!f->simg) {
+	    snprintf(linebuffer,sizeof(linebuffer),
+		     "%s: scaling FAILED",f->name);
+	    status_error(linebuffer);
+	    return;
+	}
+    } else {
+	f->simg = img;
+    }
+    f->roi.x1 = rect.x1 * f->scale;
+    f->roi.y1 = rect.y1 * f->scale;
+    f->roi.x2 = f->roi.x1 + f->simg->i.width;
+    f->roi.y2 = f->roi.y1 + f->simg->i.height;
+
+    /* don't let rounding errors trigger reloads at the image edges */
+    if (rect.x2 >= img_real_width(f->fimg) && f->roi.x2 < f->vwidth)
+	f->roi.x2 = f->vwidth;
+    if (rect.y2 >= img_real_height(f->fimg) && f->roi.y2 < f->vheight)
+	f->roi.y2 = f->vheight;
+}
+
+static float flist_img_autoscale(struct flist *f, struct ida_image *img)
+{
     float scale = 1;
 
+    if (f->seen)
+	return f->scale;
+    if (autoup || autodown) {
+	scale = auto_scale(img);
+	if (scale < 1 && !autodown)
+	    scale = 1;
+	if (scale > 1 && !autoup)
+	    scale = 1;
+    }
+    return scale;
+}
+
+/* show a coarse pass of a progressive image, the final one follows */
+static void flist_img_pass(struct flist *f, struct ida_image *img)
+{
+    struct ida_image *simg = img;
+    float scale = flist_img_autoscale(f, img);
+    int left = 0, top = 0;
+
+    if (scale != 1)
+	simg = scale_image(img, scale);
+    if (!simg)
+	return;
+
+    if (f->seen) {
+	left = f->left;
+	top  = f->top;
+    } else {
+	if (simg->i.width > gfx->hdisplay)
+	    left = (simg->i.width - gfx->hdisplay) / 2;
+	if (simg->i.height > gfx->vdisplay && !textreading)
+	    top = (simg->i.height - gfx->vdisplay) / 2;
+    }
+    shadow_draw_image(simg, left, top, 0, gfx->vdisplay-1, 100);
+    shadow_render(gfx);
+
+    if (simg != img)
+	free_image(simg);
+}
+
+static void flist_img_load(struct flist *f, int prefetch)
+{
+    char linebuffer[128];
+    float scale;
+
     if (f->fimg) {
 	/* touch */
 	list_del(&f->lru);
@@ -1103,7 +1505,7 @@ static void flist_img_load(struct flist *f, int prefetch)
     snprintf(linebuffer,sizeof(linebuffer),"%s %s ...",
 	     prefetch ? "prefetch" : "loading", f->name);
     status_update(linebuffer, NULL);
-    f->fimg = read_image(f->name);
+    f->fimg = read_image(f->name, prefetch ? NULL : f, NULL, NULL);
     if (!f->fimg) {
 	snprintf(linebuffer,sizeof(linebuffer),
 		 "%s: loading FAILED",f->name);
@@ -1116,32 +1518,21 @@ static void flist_img_load(struct flist *f, int prefetch)
 	return;
     }
 
-    if (!f->seen) {
-	scale = 1;
-	if (autoup || autodown) {
-	    scale = auto_scale(f->fimg);
-	    if (scale < 1 && !autodown)
-		scale = 1;
-	    if (scale > 1 && !autoup)
-		scale = 1;
-	}
-    } else {
-	scale = f->scale;
-    }
+    scale = flist_img_autoscale(f, f->fimg);
     flist_img_scale(f, scale, prefetch);
 
     if (!f->seen) {
- 	struct ida_image *img = flist_img_get(f);
-	if (img->i.width > gfx->hdisplay)
-	    f->left = (img->i.width - gfx->hdisplay) / 2;
-	if (img->i.height > gfx->vdisplay) {
-	    f->top = (img->i.height - gfx->vdisplay) / 2;
+	if (f->vwidth > gfx->hdisplay)
+	    f->left = (f->vwidth - gfx->hdisplay) / 2;
+	if (f->vheight > gfx->vdisplay) {
+	    f->top = (f->vheight - gfx->vdisplay) / 2;
 	    if (textreading) {
-                f->text_steps = calculate_text_steps(img->i.height, gfx->vdisplay);
+                f->text_steps = calculate_text_steps(f->vheight, gfx->vdisplay);
 		f->top = 0;
 	    }
 	}
     }
+    flist_img_roi(f);
 
     list_add_tail(&f->lru, &flru);
     f->seen = 1;
@@ -1269,6 +1660,8 @@ int main(int argc, char *argv[])
     read_ahead  = GET_READ_AHEAD();
 
     max_mem_mb  = GET_CACHE_MEM();
+    ida_image_mmap_min = (size_t)max_mem_mb * 1024 * 1024 / 4;
+    ida_pool_max       = (size_t)max_mem_mb * 1024 * 1024 / 4;
     blend_msecs = GET_BLEND_MSECS();
     v_steps     = GET_SCROLL();
     h_steps     = GET_SCROLL();
@@ -1284,7 +1677,13 @@ int main(int argc, char *argv[])
 	flist_add_list(filelist);
     for (i = optind; i < argc; i++)
 	flist_add(argv[i]);
+    if (cfg_get_str(O_WATCH_DIR)) {
+	if (flist_watch_init(cfg_get_str(O_WATCH_DIR)) < 0)
+	    exit(1);
+    }
     flist_renumber();
+    if (0 == fcount && watchfd >= 0)
+	flist_watch_check(1);
 
     if (0 == fcount) {
 	usage(stderr, argv[0]);
@@ -1365,12 +1764,16 @@ int main(int argc, char *argv[])
             }
             /* list is empty */
             flist_check_reload_list(filelist);
+            if (list_empty(&flist) && watchfd >= 0) {
+                status_update("waiting for images ...", NULL);
+                flist_watch_check(1);
+            }
             if (list_empty(&flist))
                 cleanup_and_exit(0);
             fcurrent = flist_first();
         }
 	flist_img_release_memory();
-	img = flist_img_get(fcurrent);
+	img = fcurrent->fimg;
 	if (img) {
 	    desc = make_desc(&fcurrent->fimg->i, fcurrent->name);
 	    info = make_info(fcurrent->fimg, fcurrent->scale);
@@ -1378,6 +1781,7 @@ int main(int argc, char *argv[])
 
 	key = svga_show(fcurrent, fprev, timeout, desc, info, &arg);
 	fprev = fcurrent;
+	flist_watch_check(0);
 	switch (key) {
 	case XKB_KEY_D | (KEY_MOD_SHIFT << 16):
 	    if (editable) {
@@ -39,6 +39,11 @@ struct cfg_cmdline fbi_cmd[] = {
 	.option   = { O_FILE_LIST },
 	.needsarg = 1,
 	.desc     = "read image filelist from file <arg>",
+    },{
+	.cmdline  = "watch",
+	.option   = { O_WATCH_DIR },
+	.needsarg = 1,
+	.desc     = "watch directory <arg> for new images",
     },{
 	.letter   = 'P',
 	.cmdline  = "text",
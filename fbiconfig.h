@@ -7,6 +7,7 @@
 #define O_VERSION		O_CMDLINE, "version"
 #define O_WRITECONF		O_CMDLINE, "writeconf"
 #define O_FILE_LIST		O_CMDLINE, "file-list"
+#define O_WATCH_DIR		O_CMDLINE, "watch-dir"
 #define O_TEXT_MODE		O_CMDLINE, "text-mode"
 #define O_AUTO_ZOOM		O_CMDLINE, "auto-zoom"
 #define O_DEVICE_INFO		O_CMDLINE, "device-info"
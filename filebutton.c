@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <X11/Xlib.h>
 #include <X11/Intrinsic.h>
@@ -44,7 +46,6 @@ struct fileinfo {
 static LIST_HEAD(pcache);
 static LIST_HEAD(pqueue);
 static LIST_HEAD(files);
-static XtWorkProcId pproc;
 
 /*----------------------------------------------------------------------*/
 
@@ -94,30 +95,6 @@ static struct fileinfo* fileinfo_cache_get(char *path)
 
 /*----------------------------------------------------------------------*/
 
-static void
-fileinfo_cleanup(struct file_button *file)
-{
-    switch (file->state) {
-    case 1:
-	file->loader->done(file->wdata);
-	break;
-    case 2:
-	desc_resize.done(file->wdata);
-	break;
-    }
-    file->state = 0;
-
-    if (file->wimg.p) {
-        ida_image_free(&file->wimg);
-    }
-    if (file->simg.p) {
-        ida_image_free(&file->simg);
-    }
-    if (!list_empty(&file->queue)) {
-	list_del_init(&file->queue);
-    }
-}
-
 static void fileinfo_details(struct file_button *file)
 {
     struct ida_image_info *img;
@@ -144,202 +121,378 @@ static void fileinfo_details(struct file_button *file)
 		  NULL);
 }
 
-static Boolean
-fileinfo_loader(XtPointer clientdata)
+/*----------------------------------------------------------------------*/
+/* thumbnail thread pool                                                */
+
+/*
+ * Workers pick jobs from pqueue, load the image (thumbnail mode, so
+ * the exif thumbnail is used if available), scale it down to icon
+ * size and put the job on the done list.  The main thread is woken
+ * via pipe, creates the pixmaps and updates the file buttons.
+ * Everything protected by plock.  file == NULL means the button is
+ * gone and the result should be dropped.
+ */
+struct fileinfo_job {
+    struct list_head       list;
+    struct file_button     *file;
+    char                   *filename;
+    int                    busy, ok;
+    struct stat            st;
+    struct ida_image_info  info;  /* full image */
+    struct ida_image       wimg;  /* large icon */
+    struct ida_image       simg;  /* small icon */
+};
+
+#define POOL_MAX  8
+
+static LIST_HEAD(pdone);
+static pthread_mutex_t plock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcond = PTHREAD_COND_INITIALIZER;
+static int ppipe[2] = { -1, -1 };
+static unsigned int pthreads;
+
+static void
+fileinfo_job_free(struct fileinfo_job *job)
+{
+    if (job->wimg.p)
+	ida_image_free(&job->wimg);
+    if (job->simg.p)
+	ida_image_free(&job->simg);
+    free(job->filename);
+    free(job);
+}
+
+static int
+fileinfo_scale(struct ida_image *src, struct ida_image *dst,
+	       unsigned int size)
 {
     struct op_resize_parm resize;
     struct ida_rect rect;
+    float xs,ys,scale;
+    unsigned int y;
+    void *data;
+
+    xs = (float)size / src->i.width;
+    ys = (float)size / src->i.height;
+    scale = (xs < ys) ? xs : ys;
+    resize.width  = src->i.width  * scale;
+    resize.height = src->i.height * scale;
+    if (0 == resize.width)
+	resize.width = 1;
+    if (0 == resize.height)
+	resize.height = 1;
+
+    rect.x1 = 0;
+    rect.x2 = src->i.width;
+    rect.y1 = 0;
+    rect.y2 = src->i.height;
+    memset(dst, 0, sizeof(*dst));
+    data = desc_resize.init(src,&rect,&dst->i,&resize);
+    if (NULL == data)
+	return -1;
+    ida_image_alloc(dst);
+    for (y = 0; y < dst->i.height; y++)
+	desc_resize.work(src,&rect,ida_image_scanline(dst, y),y,data);
+    desc_resize.done(data);
+    return 0;
+}
+
+static int
+fileinfo_load(struct fileinfo_job *job)
+{
+    struct ida_loader *loader = NULL;
     struct list_head *item;
-    struct file_button *file;
-    struct fileinfo *info;
-    Pixmap pix;
+    struct ida_image img;
     char blk[512];
     FILE *fp;
-    float xs,ys,scale;
-    struct ida_image timg;
-    void *data;
 
-    if (list_empty(&pqueue)) {
-	/* nothing to do */
-	pproc = 0;
-	return TRUE;
+    /* open file */
+    if (NULL == (fp = fopen(job->filename, "r"))) {
+	if (debug)
+	    fprintf(stderr,"open %s: %s\n",job->filename,strerror(errno));
+	return -1;
+    }
+    if (debug)
+	fprintf(stderr,"OPENED: %s\n",job->filename);
+    fstat(fileno(fp),&job->st);
+
+    /* pick loader */
+    memset(blk,0,sizeof(blk));
+    fread(blk,1,sizeof(blk),fp);
+    rewind(fp);
+    list_for_each(item,&loaders) {
+	loader = list_entry(item, struct ida_loader, list);
+	if (NULL == loader->magic)
+	    continue;
+	if (0 == memcmp(blk+loader->moff,loader->magic,loader->mlen))
+	    break;
+	loader = NULL;
+    }
+    if (NULL == loader) {
+	if (debug)
+	    fprintf(stderr,"%s: unknown format\n",job->filename);
+	fclose(fp);
+	return -1;
     }
-    file = list_entry(pqueue.next, struct file_button, queue);
 
-    switch (file->state) {
-    case 0:
-	/* ------------------- new file -------------------- */
-	info = fileinfo_cache_get(file->filename);
-	if (info) {
-	    file_set_info(file,info);
-	    goto next;
-	}
-	
-	/* open file */
-	if (NULL == (fp = fopen(file->filename, "r"))) {
-	    if (debug)
-		fprintf(stderr,"open %s: %s\n",file->filename,
-			strerror(errno));
-	    goto unknown;
-	}
+    /* load image, decoded on demand while scaling */
+    if (0 != ida_pipe_load(&img, loader, fp, job->filename, 0,
+			   LOAD_THUMB_EXIF | LOAD_THUMB_SCALED)) {
 	if (debug)
-	    fprintf(stderr,"OPENED: %s\n",file->filename);
-	fstat(fileno(fp),&file->st);
-	
-	/* pick loader */
-	memset(blk,0,sizeof(blk));
-	fread(blk,1,sizeof(blk),fp);
-	rewind(fp);
-	list_for_each(item,&loaders) {
-	    file->loader = list_entry(item, struct ida_loader, list);
-	    if (NULL == file->loader->magic)
-		continue;
-	    if (0 == memcmp(blk+file->loader->moff,file->loader->magic,
-			    file->loader->mlen))
-		break;
-	    file->loader = NULL;
-	}
-	if (NULL == file->loader) {
-	    if (debug)
-		fprintf(stderr,"%s: unknown format\n",file->filename);
-	    fclose(fp);
-	    goto unknown;
-	}
+	    fprintf(stderr,"loading %s [%s] FAILED\n",
+		    job->filename, loader->name);
+	return -1;
+    }
+    if (debug)
+	fprintf(stderr,"LOADED: %s [%ux%u]\n",
+		job->filename, img.i.width, img.i.height);
 
-	/* load image */
-	file->wdata = file->loader->init(fp, file->filename,
-					 0, &file->wimg.i, 1);
-	if (NULL == file->wdata) {
-	    if (debug)
-		fprintf(stderr,"loading %s [%s] FAILED\n",
-			file->filename, file->loader->name);
-	    goto unknown;
-	}
+    /* scale down (large icon), once more (small icon) */
+    if (0 != fileinfo_scale(&img, &job->wimg, GET_ICON_LARGE())) {
+	ida_image_free(&img);
+	return -1;
+    }
+    job->info = img.i;
+    ida_image_free(&img);
+    if (0 != fileinfo_scale(&job->wimg, &job->simg, GET_ICON_SMALL()))
+	return -1;
+    if (debug)
+	fprintf(stderr,"SCALED: %s [%ux%u]\n",
+		job->filename,job->wimg.i.width,job->wimg.i.height);
+    return 0;
+}
 
-        ida_image_alloc(&file->wimg);
-	file->state = 1;
-	file->y     = 0;
-	return FALSE;
+static void*
+fileinfo_worker(void *arg)
+{
+    struct fileinfo_job *job;
+
+    for (;;) {
+	pthread_mutex_lock(&plock);
+	while (list_empty(&pqueue))
+	    pthread_cond_wait(&pcond,&plock);
+	job = list_entry(pqueue.next, struct fileinfo_job, list);
+	list_del(&job->list);
+	job->busy = 1;
+	pthread_mutex_unlock(&plock);
+
+	job->ok = (0 == fileinfo_load(job));
+
+	pthread_mutex_lock(&plock);
+	list_add_tail(&job->list,&pdone);
+	pthread_mutex_unlock(&plock);
+	write(ppipe[1], "", 1);
+    }
+    return NULL;
+}
 
-    case 1:
-	/* ------------------- loading file -------------------- */
-	if (file->y < file->wimg.i.height) {
-	    file->loader->read(ida_image_scanline(&file->wimg, file->y),
-			       file->y, file->wdata);
-	    file->y++;
-	    return FALSE;
-	}
-	file->loader->done(file->wdata);
-	if (debug)
-	    fprintf(stderr,"LOADED: %s [%ux%u]\n",
-		    file->filename, file->wimg.i.width, file->wimg.i.height);
-	
-	/* resize image */
-	xs = (float)GET_ICON_LARGE() / file->wimg.i.width;
-	ys = (float)GET_ICON_LARGE() / file->wimg.i.height;
-	scale = (xs < ys) ? xs : ys;
-	resize.width  = file->wimg.i.width  * scale;
-	resize.height = file->wimg.i.height * scale;
-	if (0 == resize.width)
-	    resize.width = 1;
-	if (0 == resize.height)
-	    resize.height = 1;
-	
-	rect.x1 = 0;
-	rect.x2 = file->wimg.i.width;
-	rect.y1 = 0;
-	rect.y2 = file->wimg.i.height;
-	file->wdata = desc_resize.init(&file->wimg,&rect,&file->simg.i,&resize);
-        ida_image_alloc(&file->simg);
-
-	file->state = 2;
-	file->y     = 0;
-	return FALSE;
-
-    case 2:
-	/* ------------------- scaling file -------------------- */
-	if (file->y < file->simg.i.height) {
-	    desc_resize.work(&file->wimg,&rect,
-                             ida_image_scanline(&file->simg, file->y),
-			     file->y, file->wdata);
-	    file->y++;
-	    return FALSE;
+static void
+fileinfo_done(XtPointer clientdata, int *src, XtInputId *id)
+{
+    struct fileinfo_job *job;
+    struct file_button *file;
+    struct fileinfo *info;
+    LIST_HEAD(done);
+    char buf[64];
+    Pixmap pix;
+
+    while (read(ppipe[0], buf, sizeof(buf)) > 0)
+	/* drain */;
+
+    pthread_mutex_lock(&plock);
+    list_splice(&pdone,&done);
+    INIT_LIST_HEAD(&pdone);
+    pthread_mutex_unlock(&plock);
+
+    while (!list_empty(&done)) {
+	job = list_entry(done.next, struct fileinfo_job, list);
+	list_del(&job->list);
+	file = job->file;
+	if (file) {
+	    file->job = NULL;
+	    if (job->ok) {
+		/* build, cache + install pixmap */
+		file->st = job->st;
+		info = fileinfo_cache_get(job->filename);
+		if (!info)
+		    info = fileinfo_cache_add(job->filename, &job->info,
+					      image_to_pixmap(&job->simg),
+					      image_to_pixmap(&job->wimg));
+		file_set_info(file,info);
+	    } else {
+		/* generic file icon */
+		pix = XmGetPixmap(file->screen,"unknown",0,0);
+		file_set_icon(file,pix,pix);
+	    }
 	}
-	desc_resize.done(file->wdata);
-	if (debug)
-	    fprintf(stderr,"SCALED: %s [%ux%u]\n",
-		    file->filename,file->simg.i.width,file->simg.i.height);
-
-	/* scale once more (small icon) */
-	xs = (float)GET_ICON_SMALL() / file->simg.i.width;
-	ys = (float)GET_ICON_SMALL() / file->simg.i.height;
-	scale = (xs < ys) ? xs : ys;
-	resize.width  = file->simg.i.width  * scale;
-	resize.height = file->simg.i.height * scale;
-	if (0 == resize.width)
-	    resize.width = 1;
-	if (0 == resize.height)
-	    resize.height = 1;
-	
-	rect.x1 = 0;
-	rect.x2 = file->simg.i.width;
-	rect.y1 = 0;
-	rect.y2 = file->simg.i.height;
-        memset(&timg, 0, sizeof(timg));
-	data = desc_resize.init(&file->simg,&rect,&timg.i,&resize);
-	ida_image_alloc(&timg);
-
-	for (file->y = 0; file->y < timg.i.height; file->y++)
-	    desc_resize.work(&file->simg,&rect,
-                             ida_image_scanline(&timg, file->y),
-			     file->y, data);
-	desc_resize.done(data);
-
-	/* build, cache + install pixmap */
-	info = fileinfo_cache_add(file->filename,&file->wimg.i,
-				  image_to_pixmap(&timg),
-				  image_to_pixmap(&file->simg));
-	file_set_info(file,info);
-	ida_image_free(&timg);
-	file->state = 0;
-	goto next;
+	fileinfo_job_free(job);
+    }
+}
 
-    default:
-	/* shouldn't happen */
-	fprintf(stderr,"Oops: %s:%d\n",__FILE__,__LINE__);
+static void
+fileinfo_pool_init(void)
+{
+    pthread_t thread;
+    long cpus;
+
+    if (-1 != ppipe[0])
+	return;
+    if (-1 == pipe2(ppipe, O_NONBLOCK | O_CLOEXEC)) {
+	fprintf(stderr,"pipe: %s\n",strerror(errno));
 	exit(1);
     }
+    XtAppAddInput(app_context, ppipe[0], (XtPointer)XtInputReadMask,
+		  fileinfo_done, NULL);
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+	cpus = 1;
+    if (cpus > POOL_MAX)
+	cpus = POOL_MAX;
+    for (pthreads = 0; pthreads < cpus; pthreads++) {
+	errno = pthread_create(&thread, NULL, fileinfo_worker, NULL);
+	if (0 != errno) {
+	    fprintf(stderr,"pthread_create: %s\n",strerror(errno));
+	    break;
+	}
+	pthread_detach(thread);
+    }
+    if (0 == pthreads)
+	exit(1);
+    if (debug)
+	fprintf(stderr,"fileinfo: %u worker threads\n",pthreads);
+}
 
- unknown:
-    /* generic file icon */
-    pix = XmGetPixmap(file->screen,"unknown",0,0);
-    file_set_icon(file,pix,pix);
-    
- next:
-    fileinfo_cleanup(file);
-    return FALSE;
+static void
+fileinfo_cleanup(struct file_button *file)
+{
+    struct fileinfo_job *job = file->job;
+
+    if (NULL == job)
+	return;
+    file->job = NULL;
+
+    pthread_mutex_lock(&plock);
+    if (job->busy) {
+	/* worker has it, drop the result when done */
+	job->file = NULL;
+	job = NULL;
+    } else {
+	list_del(&job->list);
+    }
+    pthread_mutex_unlock(&plock);
+    if (job)
+	fileinfo_job_free(job);
 }
 
 /*----------------------------------------------------------------------*/
 
 void fileinfo_queue(struct file_button *file)
 {
-    if (NULL == file->queue.next)
-	INIT_LIST_HEAD(&file->queue);
+    struct fileinfo_job *job;
+    struct fileinfo *info;
+    int queued;
 
-    if (!list_empty(&file->queue)) {
-	/* already queued */
-	if (0 == file->state)
+    info = fileinfo_cache_get(file->filename);
+    if (info) {
+	file_set_info(file,info);
+	return;
+    }
+    if (file->job) {
+	pthread_mutex_lock(&plock);
+	queued = !file->job->busy;
+	pthread_mutex_unlock(&plock);
+	if (queued)
 	    return;
-	fileinfo_cleanup(file);
     }
+    fileinfo_cleanup(file);
+    fileinfo_pool_init();
+
+    job = malloc(sizeof(*job));
+    memset(job,0,sizeof(*job));
+    job->file = file;
+    job->filename = strdup(file->filename);
+    file->job = job;
+
+    pthread_mutex_lock(&plock);
+    list_add_tail(&job->list,&pqueue);
+    pthread_cond_signal(&pcond);
+    pthread_mutex_unlock(&plock);
+}
+
+/*
+ * move queued jobs for the visible icons to the head of the queue.
+ * Runs for every scroll event, so find the visible ones (main thread
+ * data only) first and hold plock for the splice only.
+ */
+void fileinfo_prioritize(Widget container)
+{
+    static struct fileinfo_job **jobs;
+    static unsigned int size;
+    Widget clip = XtParent(container);
+    struct file_button *file;
+    struct list_head *item;
+    LIST_HEAD(visible);
+    Position cx,cy,x,y;
+    Dimension cw,ch,w,h;
+    unsigned int i, count = 0;
+
+    if (-1 == ppipe[0])
+	return;
+    XtVaGetValues(container, XtNx, &cx, XtNy, &cy, NULL);
+    XtVaGetValues(clip, XtNwidth, &cw, XtNheight, &ch, NULL);
 
-    file->state = 0;
-    memset(&file->wimg,0,sizeof(file->wimg));
-    memset(&file->simg,0,sizeof(file->simg));
-    list_add_tail(&file->queue,&pqueue);
-    if (0 == pproc)
-	pproc = XtAppAddWorkProc(app_context,fileinfo_loader,NULL);
+    list_for_each(item,&files) {
+	file = list_entry(item, struct file_button, global);
+	if (!file->job || XtParent(file->widget) != container)
+	    continue;
+	XtVaGetValues(file->widget, XtNx, &x, XtNy, &y,
+		      XtNwidth, &w, XtNheight, &h, NULL);
+	x += cx;
+	y += cy;
+	if (x + w < 0 || x >= cw || y + h < 0 || y >= ch)
+	    continue;
+	if (count == size) {
+	    size = size ? size * 2 : 64;
+	    jobs = realloc(jobs, size * sizeof(*jobs));
+	}
+	jobs[count++] = file->job;
+    }
+    if (!count)
+	return;
+
+    pthread_mutex_lock(&plock);
+    for (i = 0; i < count; i++) {
+	if (jobs[i]->busy)
+	    continue; /* worker has it already */
+	list_del(&jobs[i]->list);
+	list_add_tail(&jobs[i]->list,&visible);
+    }
+    if (!list_empty(&visible))
+	list_splice(&visible,&pqueue);
+    pthread_mutex_unlock(&plock);
+}
+
+static void
+container_scroll_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
+{
+    fileinfo_prioritize(clientdata);
+}
+
+void container_scroll_prio(Widget scroll, Widget container)
+{
+    Widget sb;
+
+    XtVaGetValues(scroll, XmNverticalScrollBar, &sb, NULL);
+    if (sb) {
+	XtAddCallback(sb,XmNvalueChangedCallback,container_scroll_cb,container);
+	XtAddCallback(sb,XmNdragCallback,container_scroll_cb,container);
+    }
+    XtVaGetValues(scroll, XmNhorizontalScrollBar, &sb, NULL);
+    if (sb) {
+	XtAddCallback(sb,XmNvalueChangedCallback,container_scroll_cb,container);
+	XtAddCallback(sb,XmNdragCallback,container_scroll_cb,container);
+    }
 }
 
 void fileinfo_invalidate(char *filename)
@@ -872,8 +1025,7 @@ file_destroy_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
     if (debug)
 	fprintf(stderr,"file: del %p [%s]\n",file,file->filename);
 
-    if (NULL != file->queue.next)
-	fileinfo_cleanup(file);
+    fileinfo_cleanup(file);
     
     if (file->basename)
 	free(file->basename);
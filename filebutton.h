@@ -7,6 +7,7 @@
 #define DETAIL_COUNT     2
 
 struct fileinfo_cache;
+struct fileinfo_job;
 
 struct file_button {
     /* file info */
@@ -28,16 +29,12 @@ struct file_button {
     struct list_head   window;
 
     /* private for file info + icon loader */
-    struct list_head   queue;
-    int                state,y;
-    struct ida_loader  *loader;
-    void               *wdata;
-    struct ida_image   wimg;
-    struct ida_image   simg;
+    struct fileinfo_job *job;
 };
 
 void fileinfo_queue(struct file_button *file);
 void fileinfo_invalidate(char *filename);
+void fileinfo_prioritize(Widget container);
 void file_set_icon(struct file_button *file, Pixmap s, Pixmap l);
 void file_set_info(struct file_button *file, struct fileinfo *info);
 
@@ -54,6 +51,7 @@ void container_convert_cb(Widget widget, XtPointer clientdata,
 			  XtPointer call_data);
 void container_traverse_cb(Widget scroll, XtPointer clientdata,
 			   XtPointer call_data);
+void container_scroll_prio(Widget scroll, Widget container);
 
 void container_menu_edit(Widget menu, Widget container,
 			 int cut, int copy, int paste, int del);
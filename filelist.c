@@ -559,6 +559,7 @@ filelist_window(void)
 
     XtAddCallback(h->scroll, XmNtraverseObscuredCallback,
 		  container_traverse_cb, NULL);
+    container_scroll_prio(h->scroll, h->container);
     XtAddCallback(h->container,XmNdefaultActionCallback,
 		  filelist_action_cb,h);
     XtAddCallback(h->container,XmNconvertCallback,
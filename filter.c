@@ -5,6 +5,7 @@
 
 #include "readers.h"
 #include "filter.h"
+#include "op.h"
 
 /* ----------------------------------------------------------------------- */
 
@@ -31,6 +32,20 @@ op_grayscale(struct ida_image *src, struct ida_rect *rect,
     }
 }
 
+static void
+op_grayscale_point(struct op_points *pts, void *parm)
+{
+    int i;
+
+    op_points_clear(pts);
+    pts->gray = 1;
+    for (i = 0; i < 256; i++) {
+	pts->pre[0][i] = i*30;
+	pts->pre[1][i] = i*59;
+	pts->pre[2][i] = i*11;
+    }
+}
+
 /* ----------------------------------------------------------------------- */
 
 struct op_3x3_handle {
@@ -106,9 +121,9 @@ op_3x3_calc_line(struct ida_image *src, struct ida_rect *rect,
 	memcpy(b1,s1+src->i.width*3-6,6);
 	memcpy(b2,s2+src->i.width*3-6,6);
 	memcpy(b3,s3+src->i.width*3-6,6);
-	memcpy(b1+3,s1+src->i.width*3-3,3);
-	memcpy(b2+3,s2+src->i.width*3-3,3);
-	memcpy(b3+3,s3+src->i.width*3-3,3);
+	memcpy(b1+6,s1+src->i.width*3-3,3);
+	memcpy(b2+6,s2+src->i.width*3-3,3);
+	memcpy(b3+6,s3+src->i.width*3-3,3);
 	dst[src->i.width*3-3] = op_3x3_calc_pixel(p,b1,b2,b3);
 	dst[src->i.width*3-2] = op_3x3_calc_pixel(p,b1+1,b2+1,b3+1);
 	dst[src->i.width*3-1] = op_3x3_calc_pixel(p,b1+2,b2+2,b3+2);
@@ -226,9 +241,275 @@ op_sharpe_free(void *data)
 
 /* ----------------------------------------------------------------------- */
 
+/*
+ * Separable convolution: gaussian blur, box blur and unsharp mask.
+ * Source rows are filtered horizontally into a ring of float rows
+ * which covers the window around the current line, then the window
+ * is filtered vertically.  Lines are normally requested in order, so
+ * each source row goes through the horizontal pass once only.  Box
+ * blur uses running sums in both directions, its cost doesn't depend
+ * on the size.  The inner loops are plain float loops over whole
+ * rows, simple enough for the compiler to vectorize.
+ */
+
+struct op_conv_handle {
+    int          radius;       /* kernel half width */
+    int          box;
+    float        *kernel;      /* gaussian weights */
+    int          amount;       /* unsharp mask (percent), 0 == blur */
+    int          threshold;
+
+    int          x1, x2;       /* columns processed */
+    unsigned int len;          /* floats per row */
+    unsigned int vlen;         /* len, rounded up to a multiple of 8 */
+    unsigned int nrows;
+    float        *rows;        /* ring of horizontally filtered rows */
+    int          *tags;        /* source row in each ring slot */
+    float        *pad;         /* source row, edges replicated */
+    float        *acc;         /* vertical pass result */
+    double       *sum;         /* box blur running sum */
+    int          line;
+};
+
+static void*
+op_conv_init(struct ida_image *src, struct ida_rect *rect,
+	     struct ida_image_info *i, int sigma, int box)
+{
+    struct op_conv_handle *h;
+    float total;
+    int k;
+
+    if (sigma < 1)
+	return NULL;
+
+    h = malloc(sizeof(*h));
+    memset(h,0,sizeof(*h));
+    h->box = box;
+    if (box) {
+	h->radius = sigma; /* half width */
+    } else {
+	/* cut off the kernel at 3 sigma */
+	h->radius = 3 * sigma;
+	h->kernel = malloc(sizeof(float) * (2 * h->radius + 1));
+	for (total = 0, k = -h->radius; k <= h->radius; k++) {
+	    h->kernel[k + h->radius] = exp(-(k*k) / (2.0f * sigma * sigma));
+	    total += h->kernel[k + h->radius];
+	}
+	for (k = 0; k < 2 * h->radius + 1; k++)
+	    h->kernel[k] /= total;
+    }
+
+    h->x1    = rect->x1;
+    h->x2    = rect->x2;
+    h->len   = (h->x2 - h->x1) * 3;
+    h->vlen  = (h->len + 7) & ~7;
+    h->nrows = 2 * h->radius + 2;
+    h->rows  = calloc(h->nrows, sizeof(float) * h->vlen);
+    h->tags  = malloc(sizeof(int) * h->nrows);
+    h->pad   = calloc(h->vlen + (2 * h->radius + 1) * 3, sizeof(float));
+    h->acc   = calloc(h->vlen, sizeof(float));
+    if (box)
+	h->sum = calloc(h->vlen, sizeof(double));
+    for (k = 0; k < h->nrows; k++)
+	h->tags[k] = -1;
+    h->line = -2;
+
+    *i = src->i;
+    return h;
+}
+
+/*
+ * The row loops.  n is a multiple of 8 and the buffers don't overlap,
+ * which allows gcc to vectorize them at -O2 already.
+ */
+static void
+op_conv_madd(float *restrict dst, const float *restrict src,
+	     float w, unsigned int n)
+{
+    unsigned int i;
+
+    n &= ~7;
+    for (i = 0; i < n; i++)
+	dst[i] += w * src[i];
+}
+
+static void
+op_conv_addsub(double *restrict dst, const float *restrict add,
+	       const float *restrict sub, unsigned int n)
+{
+    unsigned int i;
+
+    n &= ~7;
+    for (i = 0; i < n; i++)
+	dst[i] += add[i] - sub[i];
+}
+
+static float*
+op_conv_row(struct op_conv_handle *h, struct ida_image *src, int y)
+{
+    unsigned char *scanline;
+    float *row, *pad, sum;
+    int x, sx, c, k, n, r = h->radius;
+
+    if (y < 0)
+	y = 0;
+    if (y >= (int)src->i.height)
+	y = src->i.height - 1;
+    row = h->rows + (y % h->nrows) * h->vlen;
+    if (h->tags[y % h->nrows] == y)
+	return row;
+    h->tags[y % h->nrows] = y;
+
+    /* source columns x1-r ... x2+r */
+    scanline = ida_image_scanline(src, y);
+    n = h->x2 - h->x1;
+    for (x = -r; x < n + r; x++) {
+	sx = h->x1 + x;
+	if (sx < 0)
+	    sx = 0;
+	if (sx >= (int)src->i.width)
+	    sx = src->i.width - 1;
+	pad = h->pad + (x + r) * 3;
+	pad[0] = scanline[sx * 3 + 0];
+	pad[1] = scanline[sx * 3 + 1];
+	pad[2] = scanline[sx * 3 + 2];
+    }
+
+    if (h->box) {
+	/* running sums (exact, integer values) */
+	for (c = 0; c < 3; c++) {
+	    pad = h->pad + c;
+	    for (sum = 0, k = 0; k < 2 * r + 1; k++)
+		sum += pad[k * 3];
+	    for (x = 0; x < n; x++) {
+		row[x * 3 + c] = sum;
+		if (x + 1 < n)
+		    sum += pad[(x + 2 * r + 1) * 3] - pad[x * 3];
+	    }
+	}
+    } else {
+	memset(row, 0, sizeof(float) * h->vlen);
+	for (k = 0; k < 2 * r + 1; k++)
+	    op_conv_madd(row, h->pad + k * 3, h->kernel[k], h->vlen);
+    }
+    return row;
+}
+
+static void
+op_conv_vert(struct op_conv_handle *h, struct ida_image *src, int line)
+{
+    float *row, *sub;
+    double norm;
+    unsigned int i;
+    int k, r = h->radius;
+
+    if (h->box) {
+	if (line == h->line + 1) {
+	    row = op_conv_row(h, src, line + r);
+	    sub = op_conv_row(h, src, line - r - 1);
+	    op_conv_addsub(h->sum, row, sub, h->vlen);
+	} else {
+	    memset(h->sum, 0, sizeof(double) * h->vlen);
+	    for (k = -r; k <= r; k++) {
+		row = op_conv_row(h, src, line + k);
+		for (i = 0; i < h->len; i++)
+		    h->sum[i] += row[i];
+	    }
+	}
+	h->line = line;
+	norm = 1.0 / ((2 * r + 1) * (2 * r + 1));
+	for (i = 0; i < h->len; i++)
+	    h->acc[i] = h->sum[i] * norm;
+    } else {
+	memset(h->acc, 0, sizeof(float) * h->vlen);
+	for (k = -r; k <= r; k++)
+	    op_conv_madd(h->acc, op_conv_row(h, src, line + k),
+			 h->kernel[k + r], h->vlen);
+    }
+}
+
+static void
+op_conv_work(struct ida_image *src, struct ida_rect *rect,
+	     unsigned char *dst, int line, void *data)
+{
+    struct op_conv_handle *h = data;
+    unsigned char *scanline;
+    float v, diff, amount;
+    unsigned int i;
+
+    scanline = ida_image_scanline(src, line);
+    memcpy(dst,scanline,src->i.width * 3);
+    if (line < rect->y1 || line >= rect->y2)
+	return;
+
+    op_conv_vert(h, src, line);
+    scanline += h->x1 * 3;
+    dst      += h->x1 * 3;
+    amount = h->amount / 100.0;
+    for (i = 0; i < h->len; i++) {
+	v = h->acc[i];
+	if (h->amount) {
+	    /* unsharp mask: amplify the difference to the blurred image */
+	    diff = scanline[i] - v;
+	    if (fabsf(diff) < h->threshold)
+		v = scanline[i];
+	    else
+		v = scanline[i] + diff * amount;
+	}
+	if (v < 0)
+	    v = 0;
+	if (v > 255)
+	    v = 255;
+	dst[i] = v + 0.5;
+    }
+}
+
+static void
+op_conv_done(void *data)
+{
+    struct op_conv_handle *h = data;
+
+    free(h->kernel);
+    free(h->rows);
+    free(h->tags);
+    free(h->pad);
+    free(h->acc);
+    free(h->sum);
+    free(h);
+}
+
+static void*
+op_blur_init(struct ida_image *src, struct ida_rect *rect,
+	     struct ida_image_info *i, void *parm)
+{
+    struct op_blur_parm *args = parm;
+
+    return op_conv_init(src, rect, i, args->sigma, args->box);
+}
+
+static void*
+op_unsharp_init(struct ida_image *src, struct ida_rect *rect,
+		struct ida_image_info *i, void *parm)
+{
+    struct op_unsharp_parm *args = parm;
+    struct op_conv_handle *h;
+
+    if (0 == args->amount)
+	return NULL;
+    h = op_conv_init(src, rect, i, args->sigma, 0);
+    if (NULL == h)
+	return NULL;
+    h->amount    = args->amount;
+    h->threshold = args->threshold;
+    return h;
+}
+
+/* ----------------------------------------------------------------------- */
+
 struct op_resize_state {
     float xscale,yscale,inleft;
     float *rowbuf;
+    uint8_t *rgbbuf; /* compact source images */
     unsigned int width,height,srcrow;
 };
 
@@ -245,6 +526,7 @@ op_resize_init(struct ida_image *src, struct ida_rect *rect,
     h->xscale = (float)args->width/src->i.width;
     h->yscale = (float)args->height/src->i.height;
     h->rowbuf = malloc(src->i.width * 3 * sizeof(float));
+    h->rgbbuf = malloc(src->i.width * 3);
     h->srcrow = 0;
     h->inleft = 1;
 
@@ -252,6 +534,7 @@ op_resize_init(struct ida_image *src, struct ida_rect *rect,
     i->width  = args->width;
     i->height = args->height;
     i->dpi    = args->dpi;
+    i->format = IDA_FMT_RGB;
     return h;
 }
 
@@ -283,7 +566,7 @@ op_resize_work(struct ida_image *src, struct ida_rect *rect,
 	    fprintf(stderr,"y:  %6.2f%%: %d/%d => %d/%d\n",
 		    weight*100,h->srcrow,src->height,line,h->height);
 #endif
-	csrcline = ida_image_scanline(src, h->srcrow);
+	csrcline = ida_image_rgb_scanline(src, h->srcrow, h->rgbbuf);
 	for (i = 0; i < src->i.width * 3; i++)
 	    h->rowbuf[i] += (float)csrcline[i] * weight;
 	if (0 == h->inleft) {
@@ -334,15 +617,27 @@ op_resize_done(void *data)
     struct op_resize_state *h = data;
 
     free(h->rowbuf);
+    free(h->rgbbuf);
     free(h);
 }
     
 /* ----------------------------------------------------------------------- */
 
+/*
+ * The source position is stepped along the destination line in 32.32
+ * fixed point.  For each line the range where all four bilinear taps
+ * are inside the rectangle is computed first; that (usually by far the
+ * largest) part runs without any bounds checks.  Only the pixels near
+ * the edges take the careful path through op_rotate_getpixel().
+ */
+#define ROT_SHIFT 32
+#define ROT_ONE   ((int64_t)1 << ROT_SHIFT)
+
 struct op_rotate_state {
     float angle,sina,cosa;
     struct ida_rect calc;
     int cx,cy;
+    int64_t dx,dy;
 };
 
 static void*
@@ -359,6 +654,8 @@ op_rotate_init(struct ida_image *src, struct ida_rect *rect,
     h->cosa  = cos(h->angle);
     h->cx    = (rect->x2 - rect->x1) / 2 + rect->x1;
     h->cy    = (rect->y2 - rect->y1) / 2 + rect->y1;
+    h->dx    = llrint(h->cosa * ROT_ONE);
+    h->dy    = llrint(h->sina * ROT_ONE);
 
     /* the area we have to process (worst case: 45) */
     diag     = sqrt((rect->x2 - rect->x1)*(rect->x2 - rect->x1) +
@@ -396,54 +693,128 @@ unsigned char* op_rotate_getpixel(struct ida_image *src, struct ida_rect *rect,
     return ida_image_scanline(src, sy) + sx * 3;
 }
 
+static inline void
+op_rotate_blend(unsigned char *dst,
+		unsigned char *p00, unsigned char *p01,
+		unsigned char *p10, unsigned char *p11,
+		unsigned int wx, unsigned int wy)
+{
+    unsigned int c,t;
+
+    for (c = 0; c < 3; c++) {
+	t  = (p00[c] * (256-wx) + p01[c] * wx) * (256-wy);
+	t += (p10[c] * (256-wx) + p11[c] * wx) * wy;
+	dst[c] = (t + 32768) >> 16;
+    }
+}
+
+static int
+op_rotate_inside(struct ida_rect *rect, int64_t fx, int64_t fy)
+{
+    int sx = fx >> ROT_SHIFT;
+    int sy = fy >> ROT_SHIFT;
+
+    return (sx >= rect->x1 && sx+1 < rect->x2 &&
+	    sy >= rect->y1 && sy+1 < rect->y2);
+}
+
+/* narrow [*a,*b) to the steps i where lo <= (f + i*d) >> ROT_SHIFT < hi */
+static void
+op_rotate_range(int64_t f, int64_t d, int lo, int hi, int *a, int *b)
+{
+    double i1,i2,t;
+
+    if (0 == d) {
+	if ((f >> ROT_SHIFT) < lo || (f >> ROT_SHIFT) >= hi)
+	    *b = *a;
+	return;
+    }
+    i1 = ((double)lo * ROT_ONE - f) / d;
+    i2 = ((double)hi * ROT_ONE - f) / d;
+    if (d < 0) {
+	t = i1; i1 = i2; i2 = t;
+    }
+    if (*a < ceil(i1))
+	*a = (i1 < *b) ? ceil(i1) : *b;
+    if (*b > ceil(i2))
+	*b = (i2 > *a) ? ceil(i2) : *a;
+}
+
 static void
 op_rotate_work(struct ida_image *src, struct ida_rect *rect,
 	       unsigned char *dst, int y, void *data)
 {
     struct op_rotate_state *h = data;
-    unsigned char *pix;
-    float fx,fy,w;
-    int x,sx,sy;
+    unsigned char *pix,*base,*p0,*p1;
+    unsigned int stride,wx,wy;
+    int64_t fx,fy,fx0,fy0;
+    int x,a,b;
 
     pix = ida_image_scanline(src, y);
     memcpy(dst,pix,src->i.width * 3);
     if (y < h->calc.y1 || y >= h->calc.y2)
 	return;
-
     dst += 3*h->calc.x1;
-    memset(dst, 0, (h->calc.x2-h->calc.x1) * 3);
-    for (x = h->calc.x1; x < h->calc.x2; x++, dst+=3) {
-	fx = h->cosa * (x - h->cx) - h->sina * (y - h->cy) + h->cx;
-	fy = h->sina * (x - h->cx) + h->cosa * (y - h->cy) + h->cy;
-	sx = (int)fx;
-	sy = (int)fy;
-	if (fx < 0)
-	    sx--;
-	if (fy < 0)
-	    sy--;
-	fx -= sx;
-	fy -= sy;
-
-	pix = op_rotate_getpixel(src,rect,sx,sy,x,y);
-	w = (1-fx) * (1-fy);
-	dst[0] += pix[0] * w;
-	dst[1] += pix[1] * w;
-	dst[2] += pix[2] * w;
-	pix = op_rotate_getpixel(src,rect,sx+1,sy,x,y);
-	w = fx * (1-fy);
-	dst[0] += pix[0] * w;
-	dst[1] += pix[1] * w;
-	dst[2] += pix[2] * w;
-	pix = op_rotate_getpixel(src,rect,sx,sy+1,x,y);
-	w = (1-fx) * fy;
-	dst[0] += pix[0] * w;
-	dst[1] += pix[1] * w;
-	dst[2] += pix[2] * w;
-	pix = op_rotate_getpixel(src,rect,sx+1,sy+1,x,y);
-	w = fx * fy;
-	dst[0] += pix[0] * w;
-	dst[1] += pix[1] * w;
-	dst[2] += pix[2] * w;
+
+    /* source position for the first pixel */
+    fx0 = llrint(((double)h->cosa * (h->calc.x1 - h->cx) -
+		  (double)h->sina * (y - h->cy) + h->cx) * ROT_ONE);
+    fy0 = llrint(((double)h->sina * (h->calc.x1 - h->cx) +
+		  (double)h->cosa * (y - h->cy) + h->cy) * ROT_ONE);
+
+    /* interior range, relative to calc.x1 */
+    a = 0;
+    b = h->calc.x2 - h->calc.x1;
+    op_rotate_range(fx0, h->dx, rect->x1, rect->x2 - 1, &a, &b);
+    op_rotate_range(fy0, h->dy, rect->y1, rect->y2 - 1, &a, &b);
+    while (a < b && !op_rotate_inside(rect, fx0 + a * h->dx, fy0 + a * h->dy))
+	a++;
+    while (a < b && !op_rotate_inside(rect, fx0 + (b-1) * h->dx,
+				      fy0 + (b-1) * h->dy))
+	b--;
+
+    fx = fx0;
+    fy = fy0;
+    for (x = 0; x < h->calc.x2 - h->calc.x1; x++, dst += 3) {
+	if (x == a && a < b) {
+	    /* interior, no checks needed */
+	    base   = ida_image_scanline(src, 0);
+	    stride = ida_image_stride(src);
+	    for (; x < b; x++, dst += 3) {
+		p0 = base + (fy >> ROT_SHIFT) * stride + (fx >> ROT_SHIFT) * 3;
+		p1 = p0 + stride;
+		wx = (fx >> (ROT_SHIFT - 8)) & 0xff;
+		wy = (fy >> (ROT_SHIFT - 8)) & 0xff;
+		op_rotate_blend(dst, p0, p0+3, p1, p1+3, wx, wy);
+		fx += h->dx;
+		fy += h->dy;
+	    }
+	    if (x == h->calc.x2 - h->calc.x1)
+		break;
+	}
+
+	/* near the edges */
+	op_rotate_blend(dst,
+			op_rotate_getpixel(src, rect,
+					   (fx >> ROT_SHIFT),
+					   (fy >> ROT_SHIFT),
+					   h->calc.x1 + x, y),
+			op_rotate_getpixel(src, rect,
+					   (fx >> ROT_SHIFT) + 1,
+					   (fy >> ROT_SHIFT),
+					   h->calc.x1 + x, y),
+			op_rotate_getpixel(src, rect,
+					   (fx >> ROT_SHIFT),
+					   (fy >> ROT_SHIFT) + 1,
+					   h->calc.x1 + x, y),
+			op_rotate_getpixel(src, rect,
+					   (fx >> ROT_SHIFT) + 1,
+					   (fy >> ROT_SHIFT) + 1,
+					   h->calc.x1 + x, y),
+			(fx >> (ROT_SHIFT - 8)) & 0xff,
+			(fy >> (ROT_SHIFT - 8)) & 0xff);
+	fx += h->dx;
+	fy += h->dy;
     }
 }
 
@@ -462,28 +833,53 @@ struct ida_op desc_grayscale = {
     .init  = op_none_init,
     .work  = op_grayscale,
     .done  = op_none_done,
+    .point = op_grayscale_point,
+    .lines = 1,
+    .in_rect = 1,
+    .proxy = 1,
 };
 struct ida_op desc_3x3 = {
     .name  = "3x3",
     .init  = op_3x3_init,
     .work  = op_3x3_work,
     .done  = op_3x3_free,
+    .lines = 3,
+    .in_rect = 1,
 };
 struct ida_op desc_sharpe = {
     .name  = "sharpe",
     .init  = op_sharpe_init,
     .work  = op_sharpe_work,
     .done  = op_sharpe_free,
+    .lines = 3,
+    .in_rect = 1,
 };
 struct ida_op desc_resize = {
     .name  = "resize",
     .init  = op_resize_init,
     .work  = op_resize_work,
     .done  = op_resize_done,
+    .lines = 1,
+    .native = 1,
+};
+struct ida_op desc_blur = {
+    .name  = "blur",
+    .init  = op_blur_init,
+    .work  = op_conv_work,
+    .done  = op_conv_done,
+    .in_rect = 1,
+};
+struct ida_op desc_unsharp = {
+    .name  = "unsharp",
+    .init  = op_unsharp_init,
+    .work  = op_conv_work,
+    .done  = op_conv_done,
+    .in_rect = 1,
 };
 struct ida_op desc_rotate = {
     .name  = "rotate",
     .init  = op_rotate_init,
     .work  = op_rotate_work,
     .done  = op_rotate_done,
+    .proxy = 1,
 };
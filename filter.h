@@ -10,6 +10,17 @@ struct op_sharpe_parm {
     int factor;
 };
 
+struct op_blur_parm {
+    int sigma;       /* box blur: half width */
+    int box;
+};
+
+struct op_unsharp_parm {
+    int sigma;
+    int amount;      /* percent */
+    int threshold;
+};
+
 struct op_resize_parm {
     int width;
     int height;
@@ -23,5 +34,7 @@ struct op_rotate_parm {
 extern struct ida_op desc_grayscale;
 extern struct ida_op desc_3x3;
 extern struct ida_op desc_sharpe;
+extern struct ida_op desc_blur;
+extern struct ida_op desc_unsharp;
 extern struct ida_op desc_resize;
 extern struct ida_op desc_rotate;
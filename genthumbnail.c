@@ -22,8 +22,6 @@ read_jpeg(char *filename)
 {
     struct ida_image *img;
     FILE *fp;
-    unsigned int y;
-    void *data;
 
     /* open file */
     if (NULL == (fp = fopen(filename, "r"))) {
@@ -31,19 +29,14 @@ read_jpeg(char *filename)
 	return NULL;
     }
 
-    /* load image */
+    /* load image (on demand, see ida_pipe_load), never use the old
+     * exif thumbnail, but let libjpeg scale down while decoding */
     img = malloc(sizeof(*img));
-    memset(img,0,sizeof(*img));
-    data = jpeg_loader.init(fp,filename,0,&img->i,0);
-    if (NULL == data) {
+    if (0 != ida_pipe_load(img,&jpeg_loader,fp,filename,0,LOAD_THUMB_SCALED)) {
 	fprintf(stderr,"loading %s [%s] FAILED\n",filename,jpeg_loader.name);
 	free(img);
 	return NULL;
     }
-    ida_image_alloc(img);
-    for (y = 0; y < img->i.height; y++)
-  	jpeg_loader.read(ida_image_scanline(img, y), y, data);
-    jpeg_loader.done(data);
     return img;
 }
 
@@ -53,10 +46,7 @@ static struct ida_image*
 scale_thumbnail(struct ida_image *src, int max)
 {
     struct op_resize_parm p;
-    struct ida_rect  rect;
     struct ida_image *dest;
-    void *data;
-    unsigned int y;
     float xs,ys,scale;
     
     xs = (float)max / src->i.width;
@@ -64,8 +54,6 @@ scale_thumbnail(struct ida_image *src, int max)
     scale = (xs < ys) ? xs : ys;
 
     dest = malloc(sizeof(*dest));
-    memset(dest,0,sizeof(*dest));
-    memset(&rect,0,sizeof(rect));
     memset(&p,0,sizeof(p));
     
     p.width  = src->i.width  * scale;
@@ -76,11 +64,10 @@ scale_thumbnail(struct ida_image *src, int max)
     if (0 == p.height)
 	p.height = 1;
     
-    data = desc_resize.init(src,&rect,&dest->i,&p);
-    ida_image_alloc(dest);
-    for (y = 0; y < dest->i.height; y++)
-	desc_resize.work(src, &rect, ida_image_scanline(dest, y), y, data);
-    desc_resize.done(data);
+    if (0 != ida_pipe_op(dest,src,NULL,&desc_resize,&p)) {
+	free(dest);
+	return NULL;
+    }
     return dest;
 }
 
@@ -122,6 +109,7 @@ static int
 compress_thumbnail(struct ida_image *img, char *dest, int max)
 {
     struct thc thc;
+    JSAMPROW row;
     unsigned int i;
 
     memset(&thc,0,sizeof(thc));
@@ -138,8 +126,10 @@ compress_thumbnail(struct ida_image *img, char *dest, int max)
     jpeg_set_defaults(&thc.dst);
     jpeg_start_compress(&thc.dst, TRUE);
 
-    for (i = 0; i < img->i.height; i++)
-        jpeg_write_scanlines(&thc.dst, (void*)ida_image_scanline(img, i), 1);
+    for (i = 0; i < img->i.height; i++) {
+	row = ida_image_scanline(img, i);
+	jpeg_write_scanlines(&thc.dst, &row, 1);
+    }
     
     jpeg_finish_compress(&(thc.dst));
     jpeg_destroy_compress(&(thc.dst));
@@ -173,8 +163,7 @@ int create_thumbnail(char *filename, unsigned char *dest, int max)
     //fprintf(stderr,"compress ");
     size = compress_thumbnail(thumb,dest,max);
 
-    /* cleanup */
-    ida_image_free(img);
+    /* cleanup (img is owned by the thumb pipeline) */
     free(img);
     ida_image_free(thumb);
     free(thumb);
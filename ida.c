@@ -68,6 +68,7 @@ static void save_ac(Widget, XEvent*, String*, Cardinal*);
 static void print_ac(Widget, XEvent*, String*, Cardinal*);
 
 static void undo_ac(Widget, XEvent*, String*, Cardinal*);
+static void redo_ac(Widget, XEvent*, String*, Cardinal*);
 static void filter_ac(Widget, XEvent*, String*, Cardinal*);
 static void gamma_ac(Widget, XEvent*, String*, Cardinal*);
 static void bright_ac(Widget, XEvent*, String*, Cardinal*);
@@ -77,6 +78,8 @@ static void f3x3_ac(Widget, XEvent*, String*, Cardinal*);
 static void resize_ac(Widget, XEvent*, String*, Cardinal*);
 static void rotate_ac(Widget, XEvent*, String*, Cardinal*);
 static void sharpe_ac(Widget, XEvent*, String*, Cardinal*);
+static void blur_ac(Widget, XEvent*, String*, Cardinal*);
+static void unsharp_ac(Widget, XEvent*, String*, Cardinal*);
 
 static XtActionsRec actionTable[] = {
     { "Exit",     exit_ac      },
@@ -96,6 +99,7 @@ static XtActionsRec actionTable[] = {
     { "Filelist", filelist_ac  },
 
     { "Undo",     undo_ac      },
+    { "Redo",     redo_ac      },
     { "Filter",   filter_ac    },
     { "Gamma",    gamma_ac     },
     { "Bright",   bright_ac    },
@@ -105,6 +109,8 @@ static XtActionsRec actionTable[] = {
     { "Resize",   resize_ac    },
     { "Rotate",   rotate_ac    },
     { "Sharpe",   sharpe_ac    },
+    { "Blur",     blur_ac      },
+    { "Unsharp",  unsharp_ac   },
 
     { "Ipc",      ipc_ac       },
     { "Xdnd",     XdndAction   },
@@ -185,6 +191,13 @@ static int bright_val   = 0;
 static int contrast_val = 0;
 static int rotate_val   = 0;
 static int sharpe_val   = 10;
+static int blur_val     = 2;
+static int blur_box     = 0;
+static int unsharp_val  = 2;
+static struct op_unsharp_parm unsharp_parm = {
+    .amount    = 100,
+    .threshold = 0,
+};
 
 static struct MY_TOPLEVELS {
     char        *name;
@@ -552,6 +565,8 @@ create_control(void)
 			    XmNsubMenuId,menu,NULL);
     push = XtVaCreateManagedWidget("undo",xmPushButtonWidgetClass,menu,NULL);
     XtAddCallback(push,XmNactivateCallback,action_cb,"Undo()");
+    push = XtVaCreateManagedWidget("redo",xmPushButtonWidgetClass,menu,NULL);
+    XtAddCallback(push,XmNactivateCallback,action_cb,"Redo()");
     XtVaCreateManagedWidget("sep",xmSeparatorWidgetClass,menu,NULL);
     push = XtVaCreateManagedWidget("copy",xmPushButtonWidgetClass,menu,NULL);
     XtAddCallback(push,XmNactivateCallback,action_cb,"Ipc(copy)");
@@ -596,8 +611,12 @@ create_control(void)
     push = XtVaCreateManagedWidget("blur",xmPushButtonWidgetClass,menu,NULL);
     XtAddCallback(push,XmNactivateCallback,action_cb,
 		  "F3x3(1,1,1, 1,1,1, 1,1,1, 1,9,0)");
+    push = XtVaCreateManagedWidget("gblur",xmPushButtonWidgetClass,menu,NULL);
+    XtAddCallback(push,XmNactivateCallback,action_cb,"Blur()");
     push = XtVaCreateManagedWidget("sharpe",xmPushButtonWidgetClass,menu,NULL);
     XtAddCallback(push,XmNactivateCallback,action_cb,"Sharpe()");
+    push = XtVaCreateManagedWidget("unsharp",xmPushButtonWidgetClass,menu,NULL);
+    XtAddCallback(push,XmNactivateCallback,action_cb,"Unsharp()");
     push = XtVaCreateManagedWidget("edge",xmPushButtonWidgetClass,menu,NULL);
     XtAddCallback(push,XmNactivateCallback,action_cb,
 		  "F3x3(-1,-1,-1, -1,8,-1, -1,-1,-1)");
@@ -1198,10 +1217,10 @@ void
 undo_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
 {
     Widget msgbox;
-    int resize;
+    unsigned int width, height;
 
-    resize = (ida->undo.i.width  != ida->img.i.width ||
-	      ida->undo.i.height != ida->img.i.height);
+    width  = ida->img.i.width;
+    height = ida->img.i.height;
     if (-1 == viewer_undo(ida)) {
 	msgbox = XmCreateInformationDialog(app_shell,"noundobox",NULL,0);
 	XtUnmanageChild(XmMessageBoxGetChild(msgbox,XmDIALOG_HELP_BUTTON));
@@ -1209,7 +1228,27 @@ undo_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
 	XtAddCallback(msgbox,XmNokCallback,destroy_cb,msgbox);
 	XtManageChild(msgbox);
     } else {
-	if (resize)
+	if (width != ida->img.i.width || height != ida->img.i.height)
+	    resize_shell();
+    }
+}
+
+void
+redo_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
+{
+    Widget msgbox;
+    unsigned int width, height;
+
+    width  = ida->img.i.width;
+    height = ida->img.i.height;
+    if (-1 == viewer_redo(ida)) {
+	msgbox = XmCreateInformationDialog(app_shell,"noredobox",NULL,0);
+	XtUnmanageChild(XmMessageBoxGetChild(msgbox,XmDIALOG_HELP_BUTTON));
+	XtUnmanageChild(XmMessageBoxGetChild(msgbox,XmDIALOG_CANCEL_BUTTON));
+	XtAddCallback(msgbox,XmNokCallback,destroy_cb,msgbox);
+	XtManageChild(msgbox);
+    } else {
+	if (width != ida->img.i.width || height != ida->img.i.height)
 	    resize_shell();
     }
 }
@@ -1455,6 +1494,50 @@ sharpe_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
     prompt_init("sharpe",0,sharpe_val,sharpe_notify);
 }
 
+static void
+blur_notify(int value, int preview)
+{
+    struct op_blur_parm parm;
+
+    parm.sigma  = value;
+    parm.box    = blur_box;
+    if (preview) {
+	viewer_start_preview(ida,&desc_blur,&parm);
+    } else {
+	blur_val = value;
+	viewer_start_op(ida,&desc_blur,&parm);
+    }
+}
+
+void
+blur_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
+{
+    /* Blur([box]) */
+    blur_box = (*num > 0 && 0 == strcasecmp(params[0],"box"));
+    prompt_init(blur_box ? "boxblur" : "blur",0,blur_val,blur_notify);
+}
+
+static void
+unsharp_notify(int value, int preview)
+{
+    unsharp_parm.sigma = value;
+    if (preview) {
+	viewer_start_preview(ida,&desc_unsharp,&unsharp_parm);
+    } else {
+	unsharp_val = value;
+	viewer_start_op(ida,&desc_unsharp,&unsharp_parm);
+    }
+}
+
+void
+unsharp_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
+{
+    /* Unsharp([amount[,threshold]]) */
+    unsharp_parm.amount    = (*num > 0) ? atoi(params[0]) : 100;
+    unsharp_parm.threshold = (*num > 1) ? atoi(params[1]) : 0;
+    prompt_init("unsharp",0,unsharp_val,unsharp_notify);
+}
+
 void
 color_ac(Widget widget, XEvent *event, String *params, Cardinal *num)
 {
@@ -1800,9 +1883,12 @@ main(int argc, char *argv[])
 #endif
 
     binary = argv[0];
+    ida_image_mmap_min = 64 * 1024 * 1024;
     ida_init_config();
     ida_read_config();
 
+    /* thumbnail loaders run in threads, some of them talk to the X server */
+    XInitThreads();
     XtSetLanguageProc(NULL,NULL,NULL);
     app_shell = XtAppInitialize(&app_context, "Ida",
 				opt_desc, opt_count,
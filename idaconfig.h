@@ -8,12 +8,14 @@
 #define O_SANE_RES		O_OPTIONS, "sane_res"
 #define O_ICON_SMALL		O_OPTIONS, "icon_small"
 #define O_ICON_LARGE		O_OPTIONS, "icon_large"
+#define O_UNDO_MEM		O_OPTIONS, "undo_mem"
 
 #define GET_AUTOZOOM()		cfg_get_bool(O_AUTOZOOM,      1)
 #define GET_PHOTOCD_RES()      	cfg_get_int(O_PHOTOCD_RES,    3)
 #define GET_SANE_RES()		cfg_get_int(O_SANE_RES,     300)
 #define GET_ICON_SMALL()     	cfg_get_int(O_ICON_SMALL,    32)
 #define GET_ICON_LARGE()     	cfg_get_int(O_ICON_LARGE,    96)
+#define GET_UNDO_MEM()		cfg_get_int(O_UNDO_MEM,     256)
 
 /* -------------------------------------------------------------------------- */
 
@@ -0,0 +1,315 @@
+/*
+ * jpeg header scanner
+ *
+ * Reads the markers up to the first scan, usually with a single
+ * 64k read, and picks the exif data and the frame size.  Much
+ * cheaper than having libexif read the file when only the headers
+ * are needed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <libexif/exif-data.h>
+#include <libexif/exif-tag.h>
+
+#include "jpegscan.h"
+
+/* ---------------------------------------------------------------------- */
+
+/* copy file data, from the buffer if possible */
+static int scan_read(int fd, unsigned char *buf, size_t have,
+		     unsigned char *dst, size_t len, off_t pos)
+{
+    if (pos + len <= have) {
+	memcpy(dst, buf + pos, len);
+	return 0;
+    }
+    return (len == pread(fd, dst, len, pos)) ? 0 : -1;
+}
+
+int jpeg_scan_fd(int fd, struct jpeg_scan *scan)
+{
+    unsigned char *buf, hdr[5];
+    struct exif_tiff t;
+    unsigned int ifd1, entry;
+    long toff, tsize;
+    int marker, len;
+    ssize_t have;
+    off_t pos;
+
+    memset(scan, 0, sizeof(*scan));
+    buf = malloc(JPEG_SCAN_READ);
+    have = pread(fd, buf, JPEG_SCAN_READ, 0);
+    if (have < 4 || buf[0] != 0xff || buf[1] != 0xd8)
+	goto err;
+
+    for (pos = 2;;) {
+	if (0 != scan_read(fd, buf, have, hdr, 4, pos) || hdr[0] != 0xff)
+	    goto err;
+	marker = hdr[1];
+	if (marker == 0xff) {
+	    pos++; /* fill byte */
+	    continue;
+	}
+	if (marker == 0xda || marker == 0xd9)
+	    break;
+	len = hdr[2] << 8 | hdr[3];
+	if (len < 2 || (marker >= 0xd0 && marker <= 0xd8))
+	    goto err;
+
+	if (marker == 0xe1 && !scan->app1 && len > 2 + 6 + 8) {
+	    /* APP1 */
+	    scan->app1 = malloc(len - 2);
+	    if (0 != scan_read(fd, buf, have, scan->app1, len - 2, pos + 4))
+		goto err;
+	    if (0 == memcmp(scan->app1, "Exif\0\0", 6)) {
+		scan->app1_size   = len - 2;
+		scan->app1_offset = pos + 4;
+	    } else {
+		free(scan->app1);
+		scan->app1 = NULL;
+	    }
+	}
+	if (marker >= 0xc0 && marker <= 0xcf &&
+	    marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+	    /* SOFn: precision, height, width, components */
+	    if (len < 8 ||
+		0 != scan_read(fd, buf, have, hdr, 5, pos + 4))
+		goto err;
+	    scan->height = hdr[1] << 8 | hdr[2];
+	    scan->width  = hdr[3] << 8 | hdr[4];
+	}
+	pos += 2 + len;
+    }
+    free(buf);
+
+    /* exif thumbnail */
+    if (0 == exif_tiff_init(&t, scan)) {
+	ifd1  = exif_tiff_next_ifd(&t, exif_tiff_get32(&t, 4));
+	entry = exif_tiff_find(&t, ifd1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT);
+	toff  = entry ? exif_tiff_get_int(&t, entry) : 0;
+	entry = exif_tiff_find(&t, ifd1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH);
+	tsize = entry ? exif_tiff_get_int(&t, entry) : 0;
+	/* values come straight from the file, don't let them wrap */
+	if (toff > 0 && tsize > 0 &&
+	    toff <= t.size && tsize <= t.size - toff) {
+	    scan->thumb_offset = toff + 6;
+	    scan->thumb_size   = tsize;
+	}
+    }
+    return 0;
+
+ err:
+    free(buf);
+    jpeg_scan_free(scan);
+    return -1;
+}
+
+int jpeg_scan_file(const char *filename, struct jpeg_scan *scan)
+{
+    int fd, rc;
+
+    fd = open(filename, O_RDONLY);
+    if (-1 == fd) {
+	memset(scan, 0, sizeof(*scan));
+	return -1;
+    }
+    rc = jpeg_scan_fd(fd, scan);
+    close(fd);
+    return rc;
+}
+
+void jpeg_scan_free(struct jpeg_scan *scan)
+{
+    free(scan->app1);
+    memset(scan, 0, sizeof(*scan));
+}
+
+int jpeg_scan_orientation(struct jpeg_scan *scan)
+{
+    struct exif_tiff t;
+    unsigned int entry;
+    long value;
+
+    if (0 != exif_tiff_init(&t, scan))
+	return 1; /* top - left */
+    entry = exif_tiff_find(&t, exif_tiff_get32(&t, 4), EXIF_TAG_ORIENTATION);
+    value = entry ? exif_tiff_get_int(&t, entry) : -1;
+    if (value < 1 || value > 8)
+	return 1;
+    return value;
+}
+
+/* ---------------------------------------------------------------------- */
+
+int exif_tiff_init(struct exif_tiff *t, struct jpeg_scan *scan)
+{
+    memset(t, 0, sizeof(*t));
+    if (!scan->app1 || scan->app1_size < 6 + 8)
+	return -1;
+    t->data = scan->app1 + 6;
+    t->size = scan->app1_size - 6;
+    t->base = scan->app1_offset + 6;
+    if (0 == memcmp(t->data, "MM", 2))
+	t->motorola = 1;
+    else if (0 != memcmp(t->data, "II", 2))
+	return -1;
+    return 0;
+}
+
+/* reads outside the data return 0 */
+unsigned int exif_tiff_get16(struct exif_tiff *t, unsigned int off)
+{
+    unsigned char *p = t->data + off;
+
+    if (t->size < 2 || off > t->size - 2)
+	return 0;
+    if (t->motorola)
+	return p[0] << 8 | p[1];
+    return p[1] << 8 | p[0];
+}
+
+unsigned int exif_tiff_get32(struct exif_tiff *t, unsigned int off)
+{
+    unsigned char *p = t->data + off;
+
+    if (t->size < 4 || off > t->size - 4)
+	return 0;
+    if (t->motorola)
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    return (unsigned int)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+/* returns the offset of the ifd entry, 0 if not found */
+unsigned int exif_tiff_find(struct exif_tiff *t, unsigned int ifd, int tag)
+{
+    unsigned int i, n;
+
+    if (!ifd || ifd > t->size - 2)
+	return 0;
+    n = exif_tiff_get16(t, ifd);
+    if (ifd + 2 + n * 12 > t->size)
+	return 0;
+    for (i = 0; i < n; i++)
+	if (exif_tiff_get16(t, ifd + 2 + i * 12) == tag)
+	    return ifd + 2 + i * 12;
+    return 0;
+}
+
+unsigned int exif_tiff_next_ifd(struct exif_tiff *t, unsigned int ifd)
+{
+    unsigned int n;
+
+    if (!ifd || ifd > t->size - 2)
+	return 0;
+    n = exif_tiff_get16(t, ifd);
+    if (ifd + 2 + n * 12 + 4 > t->size)
+	return 0;
+    return exif_tiff_get32(t, ifd + 2 + n * 12);
+}
+
+/* follow a pointer tag (exif ifd, interop ifd) */
+unsigned int exif_tiff_sub_ifd(struct exif_tiff *t, unsigned int ifd, int tag)
+{
+    unsigned int entry = exif_tiff_find(t, ifd, tag);
+    long value;
+
+    if (!entry)
+	return 0;
+    value = exif_tiff_get_int(t, entry);
+    return (value > 0) ? value : 0;
+}
+
+/* value of a single SHORT/LONG entry, -1 if unusable */
+long exif_tiff_get_int(struct exif_tiff *t, unsigned int entry)
+{
+    if (t->size < 12 || entry > t->size - 12)
+	return -1;
+    if (exif_tiff_get32(t, entry + 4) != 1)
+	return -1;
+    switch (exif_tiff_get16(t, entry + 2)) {
+    case EXIF_FORMAT_SHORT:
+	return exif_tiff_get16(t, entry + 8);
+    case EXIF_FORMAT_LONG:
+    case EXIF_FORMAT_SLONG:
+	return exif_tiff_get32(t, entry + 8);
+    default:
+	return -1;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Parsed exif data, cached by file identity.  Returns a reference,
+ * release with exif_data_unref().  Not thread safe.
+ */
+
+#define EXIF_CACHE 8
+
+static struct exif_cache {
+    dev_t            dev;
+    ino_t            ino;
+    off_t            size;
+    struct timespec  mtime;
+    ExifData         *ed;
+    unsigned int     used;
+} exif_cache[EXIF_CACHE];
+static unsigned int exif_cache_clock;
+
+ExifData *jpeg_exif_data(const char *filename)
+{
+    struct exif_cache *c, *victim = exif_cache;
+    struct jpeg_scan scan;
+    struct stat st;
+    ExifData *ed = NULL;
+    int fd, i;
+
+    fd = open(filename, O_RDONLY);
+    if (-1 == fd)
+	return NULL;
+    if (-1 == fstat(fd, &st))
+	goto out;
+
+    for (i = 0; i < EXIF_CACHE; i++) {
+	c = exif_cache + i;
+	if (c->ed && c->dev == st.st_dev && c->ino == st.st_ino &&
+	    c->size == st.st_size &&
+	    c->mtime.tv_sec  == st.st_mtim.tv_sec &&
+	    c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+	    c->used = ++exif_cache_clock;
+	    ed = c->ed;
+	    exif_data_ref(ed);
+	    goto out;
+	}
+	if (c->used < victim->used)
+	    victim = c;
+    }
+
+    if (0 != jpeg_scan_fd(fd, &scan))
+	goto out;
+    if (scan.app1)
+	ed = exif_data_new_from_data(scan.app1, scan.app1_size);
+    jpeg_scan_free(&scan);
+    if (!ed)
+	goto out;
+
+    if (victim->ed)
+	exif_data_unref(victim->ed);
+    victim->dev   = st.st_dev;
+    victim->ino   = st.st_ino;
+    victim->size  = st.st_size;
+    victim->mtime = st.st_mtim;
+    victim->ed    = ed;
+    victim->used  = ++exif_cache_clock;
+    exif_data_ref(ed);
+
+ out:
+    close(fd);
+    return ed;
+}
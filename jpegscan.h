@@ -0,0 +1,38 @@
+#include <sys/types.h>
+#include <libexif/exif-data.h>
+
+/* jpeg header scan, reads the markers up to the first scan only */
+struct jpeg_scan {
+    unsigned int   width, height;   /* frame size (SOFn) */
+    unsigned char  *app1;           /* exif APP1 payload ("Exif\0\0" + tiff) */
+    unsigned int   app1_size;
+    off_t          app1_offset;     /* file offset of the payload */
+    unsigned int   thumb_offset;    /* exif thumbnail, offset into app1 */
+    unsigned int   thumb_size;
+};
+
+/* exif (tiff) structure access */
+struct exif_tiff {
+    unsigned char  *data;
+    unsigned int   size;
+    off_t          base;            /* file offset of data */
+    int            motorola;
+};
+
+#define JPEG_SCAN_READ  (64 * 1024)
+
+/* functions */
+int jpeg_scan_fd(int fd, struct jpeg_scan *scan);
+int jpeg_scan_file(const char *filename, struct jpeg_scan *scan);
+void jpeg_scan_free(struct jpeg_scan *scan);
+int jpeg_scan_orientation(struct jpeg_scan *scan);
+
+int exif_tiff_init(struct exif_tiff *t, struct jpeg_scan *scan);
+unsigned int exif_tiff_get16(struct exif_tiff *t, unsigned int off);
+unsigned int exif_tiff_get32(struct exif_tiff *t, unsigned int off);
+unsigned int exif_tiff_find(struct exif_tiff *t, unsigned int ifd, int tag);
+unsigned int exif_tiff_next_ifd(struct exif_tiff *t, unsigned int ifd);
+unsigned int exif_tiff_sub_ifd(struct exif_tiff *t, unsigned int ifd, int tag);
+long exif_tiff_get_int(struct exif_tiff *t, unsigned int entry);
+
+ExifData *jpeg_exif_data(const char *filename);
@@ -28,6 +28,7 @@
 #include <errno.h>
 #include <string.h>
 #include <utime.h>
+#include <fcntl.h>
 #include <setjmp.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -35,6 +36,7 @@
 #include <jpeglib.h>
 #include "transupp.h"		/* Support routines for jpegtran */
 #include "jpegtools.h"
+#include "jpegscan.h"
 
 #include "misc.h"
 
@@ -204,12 +206,13 @@ static int get_orientation(ExifData *ed)
 
 static int get_file_orientation(const char *file)
 {
-    ExifData *ed;
+    struct jpeg_scan scan;
     int ret;
 
-    ed = exif_data_new_from_file(file);
-    ret = ed ? get_orientation(ed) : 1 /* top - left */;
-    exif_data_unref(ed);
+    if (0 != jpeg_scan_file(file, &scan))
+	return 1; /* top - left */
+    ret = jpeg_scan_orientation(&scan);
+    jpeg_scan_free(&scan);
     return ret;
 }
 
@@ -474,6 +477,134 @@ static int do_transform(struct jpeg_decompress_struct *src,
     return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* metadata-only updates, patching the exif tags in place                 */
+
+#define EXIF_PATCH_MAX  8
+
+struct exif_patch {
+    off_t          offset;
+    unsigned char  data[4];
+    int            len;
+};
+
+struct exif_patches {
+    struct exif_tiff  t;
+    struct exif_patch patch[EXIF_PATCH_MAX];
+    int               npatch;
+};
+
+static int tiff_set_int(struct exif_patches *p, unsigned int entry, long value)
+{
+    struct exif_tiff *t = &p->t;
+    struct exif_patch *patch;
+    int i, len;
+
+    if (!entry)
+	return 0;
+    if (exif_tiff_get_int(t, entry) < 0)
+	return -1;
+    if (exif_tiff_get_int(t, entry) == value)
+	return 0;
+    if (p->npatch == EXIF_PATCH_MAX)
+	return -1;
+
+    len = (exif_tiff_get16(t, entry + 2) == EXIF_FORMAT_SHORT) ? 2 : 4;
+    patch = p->patch + p->npatch++;
+    patch->offset = t->base + entry + 8;
+    patch->len = len;
+    for (i = 0; i < len; i++)
+	patch->data[i] = value >> (t->motorola ? (len-1-i) * 8 : i * 8);
+    return 0;
+}
+
+/*
+ * Handle updates which don't touch the image data by patching the
+ * tag values in the APP1 segment directly.  All the tags we update
+ * have their value inline, so the segment size never changes.
+ * Returns -1 if we can't do it that way, the caller takes the
+ * full transform path then.
+ */
+static int jpeg_exif_inplace(char *file, JXFORM_CODE transform,
+			     unsigned int flags)
+{
+    struct exif_patches p;
+    struct exif_tiff *t = &p.t;
+    struct jpeg_scan scan;
+    unsigned int ifd0, ifd1, exif, interop;
+    int fd, i, orientation;
+    struct stat st;
+
+    if (flags & (JFLAG_UPDATE_COMMENT | JFLAG_UPDATE_THUMBNAIL |
+		 JFLAG_TRANSFORM_IMAGE | JFLAG_FILE_BACKUP))
+	return -1;
+
+    fd = open(file, O_RDWR);
+    if (-1 == fd)
+	return -1;
+    if (-1 == fstat(fd, &st) || 0 != jpeg_scan_fd(fd, &scan)) {
+	close(fd);
+	return -1;
+    }
+    memset(&p, 0, sizeof(p));
+    if (!scan.width || !scan.height || 0 != exif_tiff_init(t, &scan))
+	goto fallback;
+
+    ifd0    = exif_tiff_get32(t, 4);
+    ifd1    = exif_tiff_next_ifd(t, ifd0);
+    exif    = exif_tiff_sub_ifd(t, ifd0, EXIF_TAG_EXIF_IFD_POINTER);
+    interop = exif_tiff_sub_ifd(t, exif, EXIF_TAG_INTEROPERABILITY_IFD_POINTER);
+
+    orientation = jpeg_scan_orientation(&scan);
+    if (-1 == transform)
+	transform = transmagic[orientation];
+
+    /* a thumbnail which needs rotating changes the segment size */
+    if ((flags & JFLAG_TRANSFORM_THUMBNAIL) && transform != JXFORM_NONE &&
+	scan.thumb_size)
+	goto fallback;
+
+    /* same updates as do_exif() */
+    if (flags & JFLAG_UPDATE_ORIENTATION) {
+	if (0 != tiff_set_int(&p, exif_tiff_find(t, ifd0, EXIF_TAG_ORIENTATION), 1) ||
+	    0 != tiff_set_int(&p, exif_tiff_find(t, ifd1, EXIF_TAG_ORIENTATION), 1))
+	    goto fallback;
+    }
+    if (0 != tiff_set_int(&p, exif_tiff_find(t, exif, EXIF_TAG_PIXEL_X_DIMENSION),
+			  scan.width) ||
+	0 != tiff_set_int(&p, exif_tiff_find(t, exif, EXIF_TAG_PIXEL_Y_DIMENSION),
+			  scan.height) ||
+	0 != tiff_set_int(&p, exif_tiff_find(t, interop, EXIF_TAG_RELATED_IMAGE_WIDTH),
+			  scan.width) ||
+	0 != tiff_set_int(&p, exif_tiff_find(t, interop, EXIF_TAG_RELATED_IMAGE_LENGTH),
+			  scan.height))
+	goto fallback;
+
+    /* write out */
+    for (i = 0; i < p.npatch; i++) {
+	if (p.patch[i].len != pwrite(fd, p.patch[i].data, p.patch[i].len,
+				     p.patch[i].offset)) {
+	    fprintf(stderr,"write %s: %s\n",file,strerror(errno));
+	    goto fallback;
+	}
+    }
+    close(fd);
+    jpeg_scan_free(&scan);
+
+    if (p.npatch && (flags & JFLAG_FILE_KEEP_TIME)) {
+	struct utimbuf u;
+	u.actime = st.st_atime;
+	u.modtime = st.st_mtime;
+	utime(file,&u);
+    }
+    return 0;
+
+ fallback:
+    close(fd);
+    jpeg_scan_free(&scan);
+    return -1;
+}
+
 /* ---------------------------------------------------------------------- */
 
 int jpeg_transform_fp(FILE *in, FILE *out,
@@ -576,6 +707,10 @@ int jpeg_transform_inplace(char *file,
             return 0;
     }
 
+    /* image data stays as-is?  try patching the exif tags then */
+    if (0 == jpeg_exif_inplace(file, transform, flags))
+	return 0;
+
     /* open infile */
     in = fopen(file,"r");
     if (NULL == in) {
@@ -241,7 +241,7 @@ static void tty_restore(void)
     tcsetattr(STDIN_FILENO, TCSANOW, &saved_attributes);
 }
 
-static int file_wait(int fd, int timeout)
+static int file_wait(int fd, int extra, int timeout)
 {
     struct timeval limit;
     fd_set set;
@@ -249,11 +249,15 @@ static int file_wait(int fd, int timeout)
 
     FD_ZERO(&set);
     FD_SET(fd, &set);
+    if (extra >= 0)
+        FD_SET(extra, &set);
     limit.tv_sec = timeout;
     limit.tv_usec = 0;
-    rc = select(fd + 1, &set, NULL, NULL,
+    rc = select((fd > extra ? fd : extra) + 1, &set, NULL, NULL,
                 timeout ? &limit : NULL);
-    return rc;
+    if (rc > 0 && !FD_ISSET(fd, &set))
+        return 2; /* extra fd only */
+    return rc > 0 ? 1 : rc;
 }
 
 /* ---------------------------------------------------------------------- */
@@ -334,11 +338,17 @@ void kbd_fini(void)
 }
 
 int kbd_wait(int timeout)
+{
+    return kbd_wait_fd(timeout, -1);
+}
+
+/* also wake up when fd becomes readable, returns 2 then */
+int kbd_wait_fd(int timeout, int fd)
 {
     if (ctx) {
-        return file_wait(libinput_get_fd(ctx), timeout);
+        return file_wait(libinput_get_fd(ctx), fd, timeout);
     } else {
-        return file_wait(STDIN_FILENO, timeout);
+        return file_wait(STDIN_FILENO, fd, timeout);
     }
 }
 
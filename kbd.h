@@ -22,6 +22,7 @@ void xkb_init(void);
 
 void kbd_init(bool use_libinput, bool use_logind, dev_t gfx);
 int kbd_wait(int timeout);
+int kbd_wait_fd(int timeout, int fd);
 int kbd_read(char *buf, uint32_t len,
              uint32_t *keycode, uint32_t *modifier);
 void kbd_suspend(void);
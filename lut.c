@@ -4,6 +4,7 @@
 
 #include "readers.h"
 #include "viewer.h"
+#include "op.h"
 #include "lut.h"
 
 /* ----------------------------------------------------------------------- */
@@ -16,12 +17,6 @@ struct op_map_parm_ch op_map_nothing = {
     right:  255
 };
 
-struct op_map_lut {
-    unsigned char red[256];
-    unsigned char green[256];
-    unsigned char blue[256];
-};
-
 /* ----------------------------------------------------------------------- */
 /* functions                                                               */
 
@@ -48,43 +43,27 @@ static void build_lut(struct op_map_parm_ch *arg, unsigned char *lut)
 	lut[i] = 255;
 }
 
-static void*
-op_map_init(struct ida_image *src, struct ida_rect *rect,
-	    struct ida_image_info *i, void *parm)
+static void
+op_map_point(struct op_points *pts, void *parm)
 {
     struct op_map_parm *args = parm;
-    struct op_map_lut *lut;
-
-    lut = malloc(sizeof(*lut));
-    build_lut(&args->red,lut->red);
-    build_lut(&args->green,lut->green);
-    build_lut(&args->blue,lut->blue);
 
-    *i = src->i;
-    return lut;
+    op_points_clear(pts);
+    build_lut(&args->red,pts->lut[0]);
+    build_lut(&args->green,pts->lut[1]);
+    build_lut(&args->blue,pts->lut[2]);
 }
 
-static void
-op_map_work(struct ida_image *src, struct ida_rect *rect,
-	    unsigned char *dst, int line, void *data)
+static void*
+op_map_init(struct ida_image *src, struct ida_rect *rect,
+	    struct ida_image_info *i, void *parm)
 {
-    struct op_map_lut *lut = data;
-    unsigned char *scanline;
-    int i;
+    struct op_points *pts;
 
-    scanline = ida_image_scanline(src, line);
-    memcpy(dst,scanline,src->i.width * 3);
-    if (line < rect->y1 || line >= rect->y2)
-	return;
-    dst      += 3*rect->x1;
-    scanline += 3*rect->x1;
-    for (i = rect->x1; i < rect->x2; i++) {
-	dst[0] = lut->red[scanline[0]];
-	dst[1] = lut->green[scanline[1]];
-	dst[2] = lut->blue[scanline[2]];
-	scanline += 3;
-	dst += 3;
-    }
+    pts = malloc(sizeof(*pts));
+    op_map_point(pts, parm);
+    *i = src->i;
+    return pts;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -92,6 +71,10 @@ op_map_work(struct ida_image *src, struct ida_rect *rect,
 struct ida_op desc_map = {
     name:  "map",
     init:  op_map_init,
-    work:  op_map_work,
+    work:  op_points_work,
     done:  op_free_done,
+    point: op_map_point,
+    lines: 1,
+    in_rect: 1,
+    proxy: 1,
 };
@@ -26,19 +26,48 @@ static void
 op_flip_horz(struct ida_image *src, struct ida_rect *rect,
 	     unsigned char *dst, int line, void *data)
 {
-    char *scanline;
+    unsigned char *scanline;
     unsigned int i, bpp;
 
     bpp = ida_image_bpp(src);
     scanline = ida_image_scanline(src, line);
     scanline += src->i.width * bpp;
-    for (i = 0; i < src->i.width; i++) {
-	scanline -= bpp;
-        memcpy(dst, scanline, bpp);
-	dst += bpp;
+    switch (bpp) {
+    case 3:
+	for (i = 0; i < src->i.width; i++) {
+	    scanline -= 3;
+	    dst[0] = scanline[0];
+	    dst[1] = scanline[1];
+	    dst[2] = scanline[2];
+	    dst += 3;
+	}
+	break;
+    case 4:
+	for (i = 0; i < src->i.width; i++) {
+	    scanline -= 4;
+	    memcpy(dst, scanline, 4);
+	    dst += 4;
+	}
+	break;
+    default:
+	for (i = 0; i < src->i.width; i++) {
+	    scanline -= bpp;
+	    memcpy(dst, scanline, bpp);
+	    dst += bpp;
+	}
+	break;
     }
 }
 
+/*
+ * 90 degree rotation: each destination line is a source column.
+ * Walking down a column for every line means one cache miss (and
+ * often a TLB miss) per pixel on large images.  The band callback
+ * fills several destination lines at once instead, reading the
+ * source row by row (count contiguous pixels per row) and writing
+ * straight into the destination lines.  The per line work callback
+ * is the same with a band of one line, good enough for previews.
+ */
 static void*
 op_rotate_init(struct ida_image *src, struct ida_rect *rect,
 	       struct ida_image_info *i, void *parm)
@@ -51,35 +80,73 @@ op_rotate_init(struct ida_image *src, struct ida_rect *rect,
 }
 
 static void
-op_rotate_cw(struct ida_image *src, struct ida_rect *rect,
-	     unsigned char *dst, int line, void *data)
+op_rotate_band(struct ida_image *src, unsigned char *dst, unsigned int stride,
+	       unsigned int line, unsigned int count, int cw)
 {
-    char *pix;
-    unsigned int i, bpp;
+    unsigned char *s, *d;
+    unsigned int y, k, bpp;
+    int step;
 
     bpp = ida_image_bpp(src);
-    pix = ida_image_scanline(src, src->i.height) + line * bpp;
-    for (i = 0; i < src->i.height; i++) {
-	pix -= ida_image_stride(src);
-        memcpy(dst, pix, bpp);
-	dst += bpp;
+    for (y = 0; y < src->i.height; y++) {
+	s = ida_image_scanline(src, y);
+	if (cw) {
+	    d = dst + (src->i.height - y - 1) * bpp;
+	    s += line * bpp;
+	    step = bpp;
+	} else {
+	    d = dst + y * bpp;
+	    s += (src->i.width - line - 1) * bpp;
+	    step = -bpp;
+	}
+	switch (bpp) {
+	case 3:
+	    for (k = 0; k < count; k++, s += step, d += stride) {
+		d[0] = s[0];
+		d[1] = s[1];
+		d[2] = s[2];
+	    }
+	    break;
+	case 4:
+	    for (k = 0; k < count; k++, s += step, d += stride)
+		memcpy(d, s, 4);
+	    break;
+	default:
+	    for (k = 0; k < count; k++, s += step, d += stride)
+		memcpy(d, s, bpp);
+	    break;
+	}
     }
 }
 
+static void
+op_rotate_cw(struct ida_image *src, struct ida_rect *rect,
+	     unsigned char *dst, int line, void *data)
+{
+    op_rotate_band(src, dst, 0, line, 1, 1);
+}
+
 static void
 op_rotate_ccw(struct ida_image *src, struct ida_rect *rect,
 	      unsigned char *dst, int line, void *data)
 {
-    char *pix;
-    unsigned int i, bpp;
+    op_rotate_band(src, dst, 0, line, 1, 0);
+}
 
-    bpp = ida_image_bpp(src);
-    pix = ida_image_scanline(src, 0) + (src->i.width-line-1) * bpp;
-    for (i = 0; i < src->i.height; i++) {
-        memcpy(dst, pix, bpp);
-	pix += ida_image_stride(src);
-	dst += bpp;
-    }
+static void
+op_rotate_cw_band(struct ida_image *src, struct ida_rect *rect,
+		  unsigned char *dst, unsigned int stride, int line,
+		  unsigned int count, void *data)
+{
+    op_rotate_band(src, dst, stride, line, count, 1);
+}
+
+static void
+op_rotate_ccw_band(struct ida_image *src, struct ida_rect *rect,
+		   unsigned char *dst, unsigned int stride, int line,
+		   unsigned int count, void *data)
+{
+    op_rotate_band(src, dst, stride, line, count, 0);
 }
 
 static void
@@ -108,6 +175,121 @@ op_invert(struct ida_image *src, struct ida_rect *rect,
     }
 }
 
+static void
+op_invert_point(struct op_points *pts, void *parm)
+{
+    int c,i;
+
+    op_points_clear(pts);
+    for (c = 0; c < 3; c++)
+	for (i = 0; i < 256; i++)
+	    pts->lut[c][i] = 255-i;
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Point operations (invert, grayscale, gamma/levels, ...) are
+ * described as lookup tables, so a chain of them can be merged into
+ * a single struct op_points and applied in one pass over the image.
+ */
+void
+op_points_clear(struct op_points *pts)
+{
+    int c,i;
+
+    pts->gray = 0;
+    for (c = 0; c < 3; c++)
+	for (i = 0; i < 256; i++) {
+	    pts->pre[c][i] = 0;
+	    pts->lut[c][i] = i;
+	}
+}
+
+/* pts = next after pts */
+void
+op_points_merge(struct op_points *pts, struct op_points *next)
+{
+    unsigned int c,i,v;
+
+    if (!next->gray) {
+	for (c = 0; c < 3; c++)
+	    for (i = 0; i < 256; i++)
+		pts->lut[c][i] = next->lut[c][pts->lut[c][i]];
+	return;
+    }
+
+    if (!pts->gray) {
+	for (c = 0; c < 3; c++)
+	    for (i = 0; i < 256; i++)
+		pts->pre[c][i] = next->pre[c][pts->lut[c][i]];
+	memcpy(pts->lut, next->lut, sizeof(pts->lut));
+	pts->gray = 1;
+	return;
+    }
+
+    /* gray twice: the first one yields a single value per pixel */
+    for (i = 0; i < 256; i++) {
+	v = (next->pre[0][pts->lut[0][i]] +
+	     next->pre[1][pts->lut[1][i]] +
+	     next->pre[2][pts->lut[2][i]]) / 100;
+	for (c = 0; c < 3; c++)
+	    pts->lut[c][i] = next->lut[c][v];
+    }
+}
+
+static void*
+op_points_init(struct ida_image *src, struct ida_rect *rect,
+	       struct ida_image_info *i, void *parm)
+{
+    struct op_points *pts;
+
+    pts = malloc(sizeof(*pts));
+    memcpy(pts, parm, sizeof(*pts));
+    *i = src->i;
+    return pts;
+}
+
+void
+op_points_work(struct ida_image *src, struct ida_rect *rect,
+	       unsigned char *dst, int line, void *data)
+{
+    struct op_points *pts = data;
+    unsigned char *scanline;
+    unsigned int i, v, bpp;
+
+    bpp = ida_image_bpp(src);
+    scanline = ida_image_scanline(src, line);
+    memcpy(dst, scanline, src->i.width * bpp);
+    if (line < rect->y1 || line >= rect->y2)
+	return;
+    dst      += bpp*rect->x1;
+    scanline += bpp*rect->x1;
+
+    if (!pts->gray) {
+	for (i = rect->x1; i < rect->x2; i++) {
+	    dst[0] = pts->lut[0][scanline[0]];
+	    dst[1] = pts->lut[1][scanline[1]];
+	    dst[2] = pts->lut[2][scanline[2]];
+	    scanline += bpp;
+	    dst += bpp;
+	}
+    } else {
+	for (i = rect->x1; i < rect->x2; i++) {
+	    v = (pts->pre[0][scanline[0]] +
+		 pts->pre[1][scanline[1]] +
+		 pts->pre[2][scanline[2]]) / 100;
+	    dst[0] = pts->lut[0][v];
+	    dst[1] = pts->lut[1][v];
+	    dst[2] = pts->lut[2][v];
+	    scanline += bpp;
+	    dst += bpp;
+	}
+    }
+}
+
+/* ----------------------------------------------------------------------- */
+
 static void*
 op_crop_init(struct ida_image *src, struct ida_rect *rect,
 	     struct ida_image_info *i, void *parm)
@@ -138,92 +320,113 @@ op_crop_work(struct ida_image *src, struct ida_rect *rect,
     }
 }
 
+/*
+ * autocrop: find the area with edges, using the same edge detection
+ * as the 3x3 filter (f = 9 * center - sum of 3x3 block, border pixels
+ * duplicated), but computed on the fly while scanning inwards.  No
+ * filtered image copy, and only the border region gets touched.
+ */
+#define AUTOCROP_LIMIT 64
+
+static void
+autocrop_lines(struct ida_image *src, int y, unsigned char **s1,
+	       unsigned char **s2, unsigned char **s3)
+{
+    *s1 = ida_image_scanline(src, (0 == y) ? y : y - 1);
+    *s2 = ida_image_scanline(src, y);
+    *s3 = ida_image_scanline(src, (src->i.height-1 == y) ? y : y + 1);
+}
+
+static int
+autocrop_pixel(unsigned char *s1, unsigned char *s2, unsigned char *s3,
+	       int x, int width)
+{
+    int l = (x > 0)       ? (x-1)*3 : x*3;
+    int r = (x < width-1) ? (x+1)*3 : x*3;
+    int c, i, val;
+
+    for (c = x*3, i = 0; i < 3; c++, l++, r++, i++) {
+	val = 9 * s2[c] -
+	    (s1[l] + s1[c] + s1[r] +
+	     s2[l] + s2[c] + s2[r] +
+	     s3[l] + s3[c] + s3[r]);
+	if (val > AUTOCROP_LIMIT)
+	    return 1;
+    }
+    return 0;
+}
+
+static int
+autocrop_row(struct ida_image *src, int y)
+{
+    unsigned char *s1, *s2, *s3;
+    int i, val, end, edge = 0;
+    int width = src->i.width;
+
+    autocrop_lines(src, y, &s1, &s2, &s3);
+    if (autocrop_pixel(s1, s2, s3, 0, width) ||
+	autocrop_pixel(s1, s2, s3, width-1, width))
+	return 1;
+
+    /* inner pixels, no early exit so the compiler can vectorize this */
+    end = (width-1) * 3;
+    for (i = 3; i < end; i++) {
+	val = 9 * s2[i] -
+	    (s1[i-3] + s1[i] + s1[i+3] +
+	     s2[i-3] + s2[i] + s2[i+3] +
+	     s3[i-3] + s3[i] + s3[i+3]);
+	edge |= (val > AUTOCROP_LIMIT);
+    }
+    return edge;
+}
+
 static void*
 op_autocrop_init(struct ida_image *src, struct ida_rect *unused,
 		 struct ida_image_info *i, void *parm)
 {
-    static struct op_3x3_parm filter = {
-	f1: { -1, -1, -1 },
-	f2: { -1,  8, -1 },
-	f3: { -1, -1, -1 },
-    };
+    unsigned char *s1, *s2, *s3;
     struct ida_rect rect;
-    struct ida_image img;
-    int x,y,limit;
-    unsigned char *line;
-    void *data;
-    
-    /* detect edges */
-    rect.x1 = 0;
-    rect.x2 = src->i.width;
-    rect.y1 = 0;
-    rect.y2 = src->i.height;
-    memset(&img, 0, sizeof(img));
-    data = desc_3x3.init(src, &rect, &img.i, &filter);
-
-    ida_image_alloc(&img);
-    for (y = 0; y < (int)img.i.height; y++)
-	desc_3x3.work(src, &rect, ida_image_scanline(&img, y), y, data);
-    desc_3x3.done(data);
-    limit = 64;
+    int x, y, width, height;
+
+    width  = src->i.width;
+    height = src->i.height;
 
     /* y border */
-    for (y = 0; y < (int)img.i.height; y++) {
-	line = ida_image_scanline(&img, y);
-	for (x = 0; x < (int)img.i.width; x++)
-	    if (line[3*x+0] > limit ||
-		line[3*x+1] > limit ||
-		line[3*x+2] > limit)
-		break;
-	if (x != (int)img.i.width)
+    for (y = 0; y < height; y++)
+	if (autocrop_row(src, y))
 	    break;
-    }
     rect.y1 = y;
-    for (y = (int)img.i.height-1; y > rect.y1; y--) {
-	line = ida_image_scanline(&img, y);
-	for (x = 0; x < (int)img.i.width; x++)
-	    if (line[3*x+0] > limit ||
-		line[3*x+1] > limit ||
-		line[3*x+2] > limit)
-		break;
-	if (x != (int)img.i.width)
+    for (y = height-1; y > rect.y1; y--)
+	if (autocrop_row(src, y))
 	    break;
-    }
     rect.y2 = y+1;
 
-    /* x border */
-    for (x = 0; x < (int)img.i.width; x++) {
-	for (y = 0; y < (int)img.i.height; y++) {
-	    line = ida_image_scanline(&img, y) + x * 3;
-	    if (line[0] > limit ||
-		line[1] > limit ||
-		line[2] > limit)
+    /*
+     * x border: go line by line, scan from both sides, but only up
+     * to the edges already found.
+     */
+    rect.x1 = width;
+    rect.x2 = 0;
+    for (y = rect.y1; y < rect.y2 && y < height; y++) {
+	autocrop_lines(src, y, &s1, &s2, &s3);
+	for (x = 0; x < rect.x1; x++)
+	    if (autocrop_pixel(s1, s2, s3, x, width)) {
+		rect.x1 = x;
 		break;
-	}
-	if (y != (int)img.i.height)
-	    break;
-    }
-    rect.x1 = x;
-    for (x = (int)img.i.width-1; x > rect.x1; x--) {
-	for (y = 0; y < (int)img.i.height; y++) {
-	    line = ida_image_scanline(&img, y) + x * 3;
-	    if (line[0] > limit ||
-		line[1] > limit ||
-		line[2] > limit)
+	    }
+	for (x = width-1; x >= rect.x2 && x >= rect.x1; x--)
+	    if (autocrop_pixel(s1, s2, s3, x, width)) {
+		rect.x2 = x+1;
 		break;
-	}
-	if (y != (int)img.i.height)
-	    break;
+	    }
     }
-    rect.x2 = x+1;
 
-    ida_image_free(&img);
     if (debug)
 	fprintf(stderr,"y: %d-%d/%u  --  x: %d-%d/%u\n",
-		rect.y1, rect.y2, img.i.height,
-		rect.x1, rect.x2, img.i.width);
+		rect.y1, rect.y2, src->i.height,
+		rect.x1, rect.x2, src->i.width);
 
-    if (0 == rect.x2 - rect.x1  ||  0 == rect.y2 - rect.y1)
+    if (rect.x2 <= rect.x1  ||  rect.y2 <= rect.y1)
 	return NULL;
     
     *unused = rect;
@@ -260,17 +463,20 @@ struct ida_op desc_flip_horz = {
     .init =  op_none_init,
     .work =  op_flip_horz,
     .done =  op_none_done,
+    .lines =  1,
 };
 struct ida_op desc_rotate_cw = {
     .name =  "rotate-cw",
     .init =  op_rotate_init,
     .work =  op_rotate_cw,
+    .band =  op_rotate_cw_band,
     .done =  op_none_done,
 };
 struct ida_op desc_rotate_ccw = {
     .name =  "rotate-ccw",
     .init =  op_rotate_init,
     .work =  op_rotate_ccw,
+    .band =  op_rotate_ccw_band,
     .done =  op_none_done,
 };
 struct ida_op desc_invert = {
@@ -278,12 +484,26 @@ struct ida_op desc_invert = {
     .init =  op_none_init,
     .work =  op_invert,
     .done =  op_none_done,
+    .point = op_invert_point,
+    .lines =  1,
+    .in_rect = 1,
+    .proxy = 1,
+};
+struct ida_op desc_points = {
+    .name =  "points",
+    .init =  op_points_init,
+    .work =  op_points_work,
+    .done =  op_free_done,
+    .lines =  1,
+    .in_rect = 1,
+    .proxy = 1,
 };
 struct ida_op desc_crop = {
     .name =  "crop",
     .init =  op_crop_init,
     .work =  op_crop_work,
     .done =  op_none_done,
+    .lines =  1,
 };
 struct ida_op desc_autocrop = {
     .name =  "autocrop",
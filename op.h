@@ -5,3 +5,16 @@ extern struct ida_op desc_rotate_ccw;
 extern struct ida_op desc_invert;
 extern struct ida_op desc_crop;
 extern struct ida_op desc_autocrop;
+
+/* point operations: per channel lookup, optionally mixed to gray */
+struct op_points {
+    int           gray;        /* pixel = lut[(pre[r]+pre[g]+pre[b])/100] */
+    unsigned int  pre[3][256];
+    unsigned char lut[3][256];
+};
+
+void op_points_clear(struct op_points *pts);
+void op_points_merge(struct op_points *pts, struct op_points *next);
+void op_points_work(struct ida_image *src, struct ida_rect *rect,
+		    unsigned char *dst, int line, void *data);
+extern struct ida_op desc_points;
@@ -43,6 +43,7 @@ struct bmp_state {
     struct bmp_hdr  hdr;
     struct bmp_cmap cmap[256];
     FILE *fp;
+    int native;
 };
 
 static void*
@@ -50,6 +51,7 @@ bmp_init(FILE *fp, char *filename, unsigned int page,
 	 struct ida_image_info *i, int thumbnail)
 {
     struct bmp_state *h;
+    unsigned int c;
     
     h = malloc(sizeof(*h));
     memset(h,0,sizeof(*h));
@@ -112,6 +114,16 @@ bmp_init(FILE *fp, char *filename, unsigned int page,
     if (h->hdr.xpels_meter)
 	i->dpi = res_m_to_inch(h->hdr.xpels_meter);
     i->npages = 1;
+
+    if ((thumbnail & LOAD_NATIVE) && h->hdr.bit_cnt <= 8) {
+	for (c = 0; c < h->hdr.num_colors; c++)
+	    i->cmap[c] = 0xff000000 |
+		h->cmap[c].red << 16 |
+		h->cmap[c].green << 8 |
+		h->cmap[c].blue;
+	i->format = (1 == h->hdr.bit_cnt) ? IDA_FMT_MONO : IDA_FMT_INDEXED;
+	h->native = 1;
+    }
     return h;
 
  oops:
@@ -129,6 +141,29 @@ bmp_read(unsigned char *dst, unsigned int line, void *data)
     y  = h->hdr.height - line - 1;
     fseek(h->fp,h->hdr.foobar + y * ll,SEEK_SET);
 
+    if (h->native) {
+	switch (h->hdr.bit_cnt) {
+	case 1:
+	    fread(dst, (h->hdr.width + 7) >> 3, 1, h->fp);
+	    load_mono(dst, dst, h->hdr.width);
+	    break;
+	case 4:
+	    for (x = 0; x < h->hdr.width; x++) {
+		if (x & 1) {
+		    *(dst++) = byte & 0xf;
+		} else {
+		    byte = fgetc(h->fp);
+		    *(dst++) = byte >> 4;
+		}
+	    }
+	    break;
+	case 8:
+	    fread(dst, h->hdr.width, 1, h->fp);
+	    break;
+	}
+	return;
+    }
+
     switch (h->hdr.bit_cnt) {
     case 1:
 	for (x = 0; x < h->hdr.width; x++) {
@@ -25,6 +25,7 @@ struct gif_state {
     GifPixelType *row;
     GifPixelType *il;
     int w,h;
+    int native;
 };
 
 static GifRecordType
@@ -162,6 +163,19 @@ gif_init(FILE *fp, char *filename, unsigned int page,
     if (0 == info->width || 0 == info->height)
 	goto oops;
 
+    if (thumbnail & LOAD_NATIVE) {
+	ColorMapObject *cmap = h->gif->Image.ColorMap ?
+	    h->gif->Image.ColorMap : h->gif->SColorMap;
+
+	for (i = 0; i < cmap->ColorCount && i < 256; i++)
+	    info->cmap[i] = 0xff000000 |
+		cmap->Colors[i].Red << 16 |
+		cmap->Colors[i].Green << 8 |
+		cmap->Colors[i].Blue;
+	info->format = IDA_FMT_INDEXED;
+	h->native = 1;
+    }
+
     if (debug)
 	fprintf(stderr,"gif: s=%dx%d i=%dx%d\n",
 		h->gif->SWidth,h->gif->SHeight,
@@ -194,6 +208,10 @@ gif_read(unsigned char *dst, unsigned int line, void *data)
     } else {
 	DGifGetLine(h->gif, h->row, h->w);
     }
+    if (h->native) {
+	memcpy(dst, h->row, h->w);
+	return;
+    }
     cmap = h->gif->Image.ColorMap ?
 	h->gif->Image.ColorMap->Colors : h->gif->SColorMap->Colors;
     for (x = 0; x < h->w; x++) {
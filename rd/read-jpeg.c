@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <jpeglib.h>
 #include <setjmp.h>
 
@@ -24,9 +25,19 @@ struct jpeg_state {
     int row_stride,linelength;    /* physical row width in output buffer */
     unsigned char *image,*ptr;
 
+    /* progressive: buffered-image mode, one output pass per ->pass() */
+    int            buffered, pending, final;
+    J_DCT_METHOD   dct_method;
+
+    /* region decoding, see jpeg_region() */
+    int            started;
+    unsigned int   xoff;
+    JSAMPROW       row;
+
     /* thumbnail */
     unsigned char  *thumbnail;
     unsigned int   tpos, tsize;
+    struct jpeg_source_mgr tmgr;
 };
 
 /* ---------------------------------------------------------------------- */
@@ -64,6 +75,49 @@ static struct jpeg_source_mgr thumbnail_mgr = {
     .term_source         = thumbnail_src_term,
 };
 
+/* ---------------------------------------------------------------------- */
+/* buffered-image mode                                                    */
+
+/* how long to absorb more scans before showing the next refinement */
+#define JPEG_PASS_MSECS 250
+
+static unsigned int jpeg_msecs_since(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec  - start->tv_sec)  * 1000 +
+	   (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void jpeg_pass_start(struct jpeg_state *h)
+{
+    struct timespec start;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+	rc = jpeg_consume_input(&h->cinfo);
+	if (rc == JPEG_SUSPENDED || rc == JPEG_REACHED_EOI)
+	    break;
+	if (h->cinfo.input_scan_number == h->cinfo.output_scan_number)
+	    continue; /* nothing new to show yet */
+	if (rc == JPEG_SCAN_COMPLETED && 0 == h->cinfo.output_scan_number)
+	    break;    /* first scan: show it asap */
+	if (jpeg_msecs_since(&start) >= JPEG_PASS_MSECS)
+	    break;
+    }
+
+    /* intermediate passes are replaced soon, go for speed */
+    h->final = jpeg_input_complete(&h->cinfo);
+    h->cinfo.dct_method = h->final ? h->dct_method : JDCT_IFAST;
+    if (debug)
+	fprintf(stderr,"jpeg: output pass, scan %d%s\n",
+		h->cinfo.input_scan_number, h->final ? " (final)" : "");
+    jpeg_start_output(&h->cinfo, h->cinfo.input_scan_number);
+    h->pending = 0;
+}
+
 /* ---------------------------------------------------------------------- */
 /* jpeg loader                                                            */
 
@@ -112,7 +166,7 @@ jpeg_init(FILE *fp, char *filename, unsigned int page,
 		fprintf(stderr,"jpeg: exif data found (APP1 marker)\n");
 	    load_add_extra(i,EXTRA_COMMENT,mark->data,mark->data_length);
 
-	    if (thumbnail) {
+	    if (thumbnail & LOAD_THUMB_EXIF) {
 		ExifData *ed;
 		
 		ed = exif_data_new_from_data(mark->data,mark->data_length);
@@ -144,14 +198,40 @@ jpeg_init(FILE *fp, char *filename, unsigned int page,
 	fclose(h->infile);
 	h->infile = NULL;
 	jpeg_create_decompress(&h->cinfo);
-	h->cinfo.src = &thumbnail_mgr;
+	h->tmgr = thumbnail_mgr;  /* per instance, loaders run in threads */
+	h->cinfo.src = &h->tmgr;
 	jpeg_read_header(&h->cinfo, TRUE);
     }
 
+    if (!h->thumbnail && (thumbnail & LOAD_THUMB_SCALED)) {
+	/* let libjpeg scale down in the DCT domain */
+	unsigned int size = h->cinfo.image_width > h->cinfo.image_height
+	    ? h->cinfo.image_width : h->cinfo.image_height;
+	h->cinfo.scale_num   = 1;
+	h->cinfo.scale_denom = 1;
+	while (h->cinfo.scale_denom < 8 &&
+	       size / (h->cinfo.scale_denom * 2) >= LOAD_THUMB_MIN)
+	    h->cinfo.scale_denom *= 2;
+	h->cinfo.dct_method  = JDCT_IFAST;
+	if (h->cinfo.scale_denom > 1) {
+	    i->thumbnail   = 1;
+	    i->real_width  = h->cinfo.image_width;
+	    i->real_height = h->cinfo.image_height;
+	}
+    }
+
+    if ((thumbnail & LOAD_PROGRESSIVE) && !i->thumbnail &&
+	jpeg_has_multiple_scans(&h->cinfo)) {
+	h->buffered = 1;
+	h->pending = 1;
+	h->dct_method = h->cinfo.dct_method;
+	h->cinfo.buffered_image = TRUE;
+    }
+
     h->cinfo.out_color_space = JCS_RGB;
-    jpeg_start_decompress(&h->cinfo);
-    i->width  = h->cinfo.image_width;
-    i->height = h->cinfo.image_height;
+    jpeg_calc_output_dimensions(&h->cinfo);
+    i->width  = h->cinfo.output_width;
+    i->height = h->cinfo.output_height;
     i->npages = 1;
     switch (h->cinfo.density_unit) {
     case 0: /* unknown */
@@ -175,9 +255,107 @@ jpeg_read(unsigned char *dst, unsigned int line, void *data)
 
     if(setjmp(h->errjump))
 	return;
+    if (!h->started) {
+	jpeg_start_decompress(&h->cinfo);
+	h->started = 1;
+    }
+    if (h->pending)
+	jpeg_pass_start(h);
+    if (h->row) {
+	/* cropping without libjpeg-turbo */
+	jpeg_read_scanlines(&h->cinfo, &h->row, 1);
+	memcpy(dst, h->row + h->xoff * 3, h->linelength);
+	return;
+    }
     jpeg_read_scanlines(&h->cinfo, &row, 1);
 }
 
+static int
+jpeg_pass(void *data)
+{
+    struct jpeg_state *h = data;
+
+    if (!h->buffered || !h->started || h->pending)
+	return 0;
+    if (setjmp(h->errjump))
+	return 0;
+    jpeg_finish_output(&h->cinfo);
+    if (h->final)
+	return 0;
+    /* next pass starts with the next jpeg_read() call */
+    h->pending = 1;
+    return 1;
+}
+
+static int
+jpeg_region(void *data, struct ida_image_info *i,
+	    struct ida_rect *rect, unsigned int *shrink)
+{
+    struct jpeg_state *h = data;
+    JDIMENSION x, y, w, lines;
+    unsigned int denom;
+
+    if (h->started || h->thumbnail)
+	return -1;
+    if (setjmp(h->errjump))
+	return -1;
+
+    /* no buffered-image mode, we don't need all lines */
+    h->buffered = 0;
+    h->pending  = 0;
+    h->cinfo.buffered_image = FALSE;
+
+    for (denom = 1; denom < 8 && denom * 2 <= *shrink;)
+	denom *= 2;
+    h->cinfo.scale_num   = 1;
+    h->cinfo.scale_denom = denom;
+    jpeg_start_decompress(&h->cinfo);
+    h->started = 1;
+
+    x = rect->x1 / denom;
+    w = (rect->x2 + denom - 1) / denom - x;
+    y = rect->y1 / denom;
+    lines = (rect->y2 + denom - 1) / denom - y;
+    if (x + w > h->cinfo.output_width)
+	w = h->cinfo.output_width - x;
+    if (y + lines > h->cinfo.output_height)
+	lines = h->cinfo.output_height - y;
+
+#ifdef LIBJPEG_TURBO_VERSION
+    /* rounds x + w to iMCU boundaries */
+    jpeg_crop_scanline(&h->cinfo, &x, &w);
+    jpeg_skip_scanlines(&h->cinfo, y);
+#else
+    h->row = malloc(h->cinfo.output_width * 3);
+    for (JDIMENSION l = 0; l < y; l++)
+	jpeg_read_scanlines(&h->cinfo, &h->row, 1);
+    h->xoff = x;
+    h->linelength = w * 3;
+#endif
+    if (debug)
+	fprintf(stderr,"jpeg: region %ux%u+%u+%u, 1/%u\n",
+		w, lines, x, y, denom);
+
+    rect->x1 = x * denom;
+    rect->y1 = y * denom;
+    rect->x2 = (x + w) * denom;
+    rect->y2 = (y + lines) * denom;
+    if (rect->x2 > h->cinfo.image_width)
+	rect->x2 = h->cinfo.image_width;
+    if (rect->y2 > h->cinfo.image_height)
+	rect->y2 = h->cinfo.image_height;
+    *shrink = denom;
+
+    i->width  = w;
+    i->height = lines;
+    if (denom > 1 || w < h->cinfo.image_width || lines < h->cinfo.image_height) {
+	i->thumbnail   = 1;
+	i->real_width  = h->cinfo.image_width;
+	i->real_height = h->cinfo.image_height;
+    }
+    return 0;
+}
+
 static void
 jpeg_done(void *data)
 {
@@ -190,6 +368,8 @@ jpeg_done(void *data)
 	fclose(h->infile);
     if (h->thumbnail)
 	free(h->thumbnail);
+    if (h->row)
+	free(h->row);
     free(h);
 }
 
@@ -200,6 +380,8 @@ struct ida_loader jpeg_loader = {
     .name  = "libjpeg",
     .init  = jpeg_init,
     .read  = jpeg_read,
+    .pass  = jpeg_pass,
+    .region = jpeg_region,
     .done  = jpeg_done,
 };
 
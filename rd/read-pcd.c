@@ -29,7 +29,9 @@ pcd_init(FILE *fp, char *filename, unsigned int page,
 
     if (0 != pcd_open(&h->img, filename))
 	goto oops;
-    if (-1 == pcd_select(&h->img, thumbnail ? 1 : pcd_res,
+    if (-1 == pcd_select(&h->img,
+			 (thumbnail & (LOAD_THUMB_EXIF | LOAD_THUMB_SCALED)) ?
+			 1 : pcd_res,
 			 0,0,0, pcd_get_rot(&h->img, 0),
                          &h->left, &h->top, &h->width, &h->height))
 	goto oops;
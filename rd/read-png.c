@@ -19,6 +19,7 @@ struct png_state {
     png_bytep    image;
     png_uint_32  w,h;
     int          color_type;
+    int          native;
 };
 
 static void*
@@ -84,6 +85,10 @@ png_init(FILE *fp, char *filename, unsigned int page,
     h->color_type = png_get_color_type(h->png, h->info);
     if (debug)
 	fprintf(stderr,"png: color_type=%s #2\n",ct[h->color_type]);
+    if ((thumbnail & LOAD_NATIVE) && h->color_type == PNG_COLOR_TYPE_GRAY) {
+	i->format = IDA_FMT_GRAY;
+	h->native = 1;
+    }
 
     h->image = malloc(i->width * i->height * 4);
 
@@ -117,7 +122,10 @@ png_read(unsigned char *dst, unsigned int line, void *data)
     switch (h->color_type) {
     case PNG_COLOR_TYPE_GRAY:
 	png_read_rows(h->png, &row, NULL, 1);
-	load_gray(dst,row,h->w);
+	if (h->native)
+	    memcpy(dst,row,h->w);
+	else
+	    load_gray(dst,row,h->w);
 	break;
     case PNG_COLOR_TYPE_RGB:
 	png_read_rows(h->png, &row, NULL, 1);
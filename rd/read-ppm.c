@@ -12,6 +12,7 @@
 struct ppm_state {
     FILE          *infile;
     int           width,height;
+    int           native;
     unsigned char *row;
 };
 
@@ -42,6 +43,17 @@ pnm_init(FILE *fp, char *filename, unsigned int page,
     i->npages = 1;
     h->row = malloc(h->width*3);
 
+    if ((thumbnail & LOAD_NATIVE) && '4' == p) {
+	h->native  = 1;
+	i->format  = IDA_FMT_MONO;
+	i->cmap[0] = 0xffffffff;
+	i->cmap[1] = 0xff000000;
+    }
+    if ((thumbnail & LOAD_NATIVE) && '5' == p) {
+	h->native  = 1;
+	i->format  = IDA_FMT_GRAY;
+    }
+
     return h;
 
  oops:
@@ -65,6 +77,10 @@ pgm_read(unsigned char *dst, unsigned int line, void *data)
     unsigned char *src;
     int x;
 
+    if (h->native) {
+	fread(dst,h->width,1,h->infile);
+	return;
+    }
     fread(h->row,h->width,1,h->infile);
     src = h->row;
     for (x = 0; x < h->width; x++) {
@@ -84,7 +100,10 @@ pbm_read(unsigned char *dst, unsigned int line, void *data)
 
     bpl = ((h->width+7) >> 3);
     fread(h->row,bpl,1,h->infile);
-    load_bits_msb(dst,(unsigned char*)(h->row),h->width,0,255);
+    if (h->native)
+	load_mono(dst,(unsigned char*)(h->row),h->width);
+    else
+	load_bits_msb(dst,(unsigned char*)(h->row),h->width,0,255);
 }
 
 static void
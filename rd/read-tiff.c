@@ -18,6 +18,18 @@ struct tiff_state {
     uint32*        image;
     uint16         resunit;
     float          xres,yres;
+    int            native;    /* compact lines, see LOAD_NATIVE */
+
+    /* tiled images: decode one row of tiles at a time */
+    uint32         tw,th,tx1,tx2,trow;
+    uint32*        tile;
+    uint32*        tiles;
+
+    /* region, see tiff_region() */
+    struct ida_rect rect;
+    unsigned int   shrink;
+    unsigned char* rgb;
+    uint32         next;      /* compressed strips can't skip lines */
 };
 
 static void*
@@ -50,7 +62,6 @@ tiff_init(FILE *fp, char *filename, unsigned int page,
     TIFFGetField(h->tif, TIFFTAG_BITSPERSAMPLE,   &h->depth);
     TIFFGetField(h->tif, TIFFTAG_FILLORDER,       &h->fillorder);
     TIFFGetField(h->tif, TIFFTAG_PHOTOMETRIC,     &h->photometric);
-    h->row = malloc(TIFFScanlineSize(h->tif));
     if (debug)
 	fprintf(stderr,"tiff: %" PRId32 "x%" PRId32 ", planar=%d, "
 		"nsamples=%d, depth=%d fo=%d pm=%d scanline=%" PRId32 "\n",
@@ -58,11 +69,17 @@ tiff_init(FILE *fp, char *filename, unsigned int page,
 		h->fillorder,h->photometric,
 		(uint32_t)TIFFScanlineSize(h->tif));
 
-    if (PHOTOMETRIC_PALETTE   == h->photometric  ||
-	PHOTOMETRIC_YCBCR     == h->photometric  ||
-	PHOTOMETRIC_SEPARATED == h->photometric  ||
-	TIFFIsTiled(h->tif)                      ||
-	(1 != h->depth  &&  8 != h->depth)) {
+    if (TIFFIsTiled(h->tif)) {
+	/* libtiff converts, we fetch the tiles needed only */
+	TIFFGetField(h->tif, TIFFTAG_TILEWIDTH,  &h->tw);
+	TIFFGetField(h->tif, TIFFTAG_TILELENGTH, &h->th);
+	if (debug)
+	    fprintf(stderr,"tiff: reading tiles [TIFFReadRGBATile, %" PRId32
+		    "x%" PRId32 "]\n", h->tw, h->th);
+    } else if (PHOTOMETRIC_PALETTE   == h->photometric  ||
+	       PHOTOMETRIC_YCBCR     == h->photometric  ||
+	       PHOTOMETRIC_SEPARATED == h->photometric  ||
+	       (1 != h->depth  &&  8 != h->depth)) {
 	/* for the more difficuilt cases we let libtiff
 	 * do all the hard work.  Drawback is that we lose
 	 * progressive loading and decode everything here */
@@ -74,10 +91,29 @@ tiff_init(FILE *fp, char *filename, unsigned int page,
 	if (debug)
 	    fprintf(stderr,"tiff: reading scanline by scanline\n");
 	h->row = malloc(TIFFScanlineSize(h->tif));
+	if ((thumbnail & LOAD_NATIVE) && 1 == h->nsamples) {
+	    h->native = 1;
+	    if (1 == h->depth) {
+		i->format  = IDA_FMT_MONO;
+		i->cmap[0] = 0xff000000;
+		i->cmap[1] = 0xff000000;
+		if (PHOTOMETRIC_MINISWHITE == h->photometric)
+		    i->cmap[0] = 0xffffffff;
+		if (PHOTOMETRIC_MINISBLACK == h->photometric)
+		    i->cmap[1] = 0xffffffff;
+	    } else {
+		i->format  = IDA_FMT_GRAY;
+	    }
+	}
     }
 
     i->width  = h->width;
     i->height = h->height;
+    h->rect.x2 = h->width;
+    h->rect.y2 = h->height;
+    h->shrink  = 1;
+    if (h->tw)
+	h->tx2 = (h->width + h->tw - 1) / h->tw;
 
     if (TIFFGetField(h->tif, TIFFTAG_RESOLUTIONUNIT,  &h->resunit) &&
 	TIFFGetField(h->tif, TIFFTAG_XRESOLUTION,     &h->xres)    &&
@@ -103,10 +139,36 @@ tiff_init(FILE *fp, char *filename, unsigned int page,
     return NULL;
 }
 
+/* lines of the tile row containing y, tile columns tx1 ... tx2 */
+static uint32*
+tiff_tile_line(struct tiff_state *h, uint32 y)
+{
+    uint32 row = y / h->th;
+    uint32 bw = (h->tx2 - h->tx1) * h->tw;
+    uint32 c, r;
+
+    if (!h->tiles) {
+	h->tile  = malloc(h->tw * h->th * 4);
+	h->tiles = malloc(bw * h->th * 4);
+    } else if (row == h->trow) {
+	goto out;
+    }
+    for (c = h->tx1; c < h->tx2; c++) {
+	if (!TIFFReadRGBATile(h->tif, c * h->tw, row * h->th, h->tile))
+	    memset(h->tile, 0, h->tw * h->th * 4);
+	/* raster origin is the lower left corner */
+	for (r = 0; r < h->th; r++)
+	    memcpy(h->tiles + r * bw + (c - h->tx1) * h->tw,
+		   h->tile + (h->th - r - 1) * h->tw, h->tw * 4);
+    }
+    h->trow = row;
+ out:
+    return h->tiles + (y % h->th) * bw;
+}
+
 static void
-tiff_read(unsigned char *dst, unsigned int line, void *data)
+tiff_read_row(struct tiff_state *h, unsigned char *dst, unsigned int line)
 {
-    struct tiff_state *h = data;
     int s,on,off;
 
     if (h->image) {
@@ -123,6 +185,14 @@ tiff_read(unsigned char *dst, unsigned int line, void *data)
 	    TIFFReadScanline(h->tif, h->row, line, s);
     }
 
+    if (h->native) {
+	if (1 == h->depth)
+	    load_mono(dst,(unsigned char*)(h->row),h->width);
+	else
+	    memcpy(dst,h->row,h->width);
+	return;
+    }
+
     switch (h->nsamples) {
     case 1:
 	if (1 == h->depth) {
@@ -157,6 +227,73 @@ tiff_read(unsigned char *dst, unsigned int line, void *data)
     }
 }
 
+static void
+tiff_read(unsigned char *dst, unsigned int line, void *data)
+{
+    struct tiff_state *h = data;
+    unsigned int x, y = h->rect.y1 + line * h->shrink;
+    uint32 *src;
+
+    if (h->tw) {
+	src = tiff_tile_line(h, y) - h->tx1 * h->tw;
+	for (x = h->rect.x1; x < h->rect.x2; x += h->shrink) {
+	    *(dst++) = TIFFGetR(src[x]);
+	    *(dst++) = TIFFGetG(src[x]);
+	    *(dst++) = TIFFGetB(src[x]);
+	}
+	return;
+    }
+    if (!h->rgb) {
+	tiff_read_row(h, dst, y);
+	return;
+    }
+    while (!h->image && h->next < y)
+	tiff_read_row(h, h->rgb, h->next++);
+    tiff_read_row(h, h->rgb, y);
+    h->next = y + 1;
+    for (x = h->rect.x1; x < h->rect.x2; x += h->shrink, dst += 3)
+	memcpy(dst, h->rgb + 3 * x, 3);
+}
+
+static int
+tiff_region(void *data, struct ida_image_info *i,
+	    struct ida_rect *rect, unsigned int *shrink)
+{
+    struct tiff_state *h = data;
+
+    if (h->tiles || h->rgb)
+	return -1;
+    if (rect->x2 > h->width)
+	rect->x2 = h->width;
+    if (rect->y2 > h->height)
+	rect->y2 = h->height;
+    if (rect->x1 >= rect->x2 || rect->y1 >= rect->y2)
+	return -1;
+    if (*shrink < 1)
+	*shrink = 1;
+
+    h->rect   = *rect;
+    h->shrink = *shrink;
+    h->native = 0;  /* cropping works on rgb lines */
+    i->format = IDA_FMT_RGB;
+    if (h->tw) {
+	h->tx1 = rect->x1 / h->tw;
+	h->tx2 = (rect->x2 + h->tw - 1) / h->tw;
+    } else {
+	uint32 rps = h->height;
+
+	TIFFGetField(h->tif, TIFFTAG_ROWSPERSTRIP, &rps);
+	h->rgb  = malloc(h->width * 3);
+	h->next = rect->y1 - rect->y1 % rps;
+    }
+    i->width  = (rect->x2 - rect->x1 + h->shrink - 1) / h->shrink;
+    i->height = (rect->y2 - rect->y1 + h->shrink - 1) / h->shrink;
+    i->thumbnail   = 1;
+    i->real_width  = h->width;
+    i->real_height = h->height;
+    return 0;
+}
+
 static void
 tiff_done(void *data)
 {
@@ -167,6 +304,12 @@ tiff_done(void *data)
 	free(h->row);
     if (h->image)
 	free(h->image);
+    if (h->tile)
+	free(h->tile);
+    if (h->tiles)
+	free(h->tiles);
+    if (h->rgb)
+	free(h->rgb);
     free(h);
 }
 
@@ -177,6 +320,7 @@ static struct ida_loader tiff1_loader = {
     name:  "libtiff",
     init:  tiff_init,
     read:  tiff_read,
+    region: tiff_region,
     done:  tiff_done,
 };
 static struct ida_loader tiff2_loader = {
@@ -186,6 +330,7 @@ static struct ida_loader tiff2_loader = {
     name:  "libtiff",
     init:  tiff_init,
     read:  tiff_read,
+    region: tiff_region,
     done:  tiff_done,
 };
 
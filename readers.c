@@ -3,6 +3,9 @@
 #include <stddef.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 #include "readers.h"
 #include "byteorder.h"
@@ -80,6 +83,27 @@ void load_rgba(unsigned char *dst, unsigned char *src, int width)
     }
 }
 
+/* msb first packed bits (pbm, tiff, ...) to IDA_FMT_MONO, works inplace */
+void load_mono(unsigned char *dst, unsigned char *src, int width)
+{
+    int i;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    unsigned char b;
+
+    /* pixman wants the first pixel in the lsb */
+    for (i = 0; i < (width + 7) >> 3; i++) {
+	b = src[i];
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+	dst[i] = b;
+    }
+#else
+    i = (width + 7) >> 3;
+    memmove(dst, src, i);
+#endif
+}
+
 /* ----------------------------------------------------------------------- */
 
 int load_add_extra(struct ida_image_info *info, enum ida_extype type,
@@ -130,43 +154,412 @@ int load_free_extras(struct ida_image_info *info)
 
 /* ----------------------------------------------------------------------- */
 
-void ida_image_alloc(struct ida_image *img)
+/*
+ * Out-of-core images.  Large images get their pixels in a sparse,
+ * unlinked temp file which is mmap'ed, so the kernel can page them in
+ * and out as needed instead of the image competing with everything
+ * else for RAM.  Lines are contiguous as usual, the pixman image wraps
+ * the mapping, so everything else works unmodified.  The mapping is
+ * handled in bands of IDA_BAND_LINES, ida_image_release() tells the
+ * kernel which ones are cold and can be dropped from memory.
+ * Off by default, applications opt in by setting ida_image_mmap_min.
+ */
+size_t ida_image_mmap_min;
+
+/* owned by the pixman image, see ida_store_destroy() */
+struct ida_store {
+    uint8_t           *map;      /* mmap'ed temp file, or NULL */
+    size_t            size;
+    uint8_t           *pool;     /* pool buffer, or NULL */
+    size_t            psize;
+    pixman_indexed_t  *indexed;  /* compact formats */
+};
+
+static void ida_pool_put(uint8_t *base, size_t size);
+
+static void ida_store_destroy(pixman_image_t *image, void *data)
 {
-    assert(img->p == NULL);
-    img->p = pixman_image_create_bits(
+    struct ida_store *store = data;
+
+    if (store->map)
+	munmap(store->map, store->size);
+    if (store->pool)
+	ida_pool_put(store->pool, store->psize);
+    free(store->indexed);
+    free(store);
+}
+
+static int ida_map_file(size_t size)
+{
+    char path[256];
+    const char *dir;
+    int fd;
+
+    dir = getenv("TMPDIR");
+    if (NULL == dir)
+	dir = "/var/tmp"; /* disk backed, unlike /tmp quite often */
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (-1 == fd)
+#endif
+    {
+	snprintf(path, sizeof(path), "%s/ida-XXXXXX", dir);
+	fd = mkstemp(path);
+	if (-1 == fd)
+	    return -1;
+	unlink(path);
+    }
+    if (-1 == ftruncate(fd, size)) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static uint8_t *ida_map_pixels(size_t size)
+{
+    uint8_t *map;
+    int fd;
+
+    fd = ida_map_file(size);
+    if (-1 == fd)
+	return NULL;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+	return NULL;
+    return map;
+}
+
+int ida_image_mapped(struct ida_image *img)
+{
+    struct ida_store *store;
+
+    if (img->stage || !img->p)
+	return 0;
+    store = pixman_image_get_destroy_data(img->p);
+    return store && store->map;
+}
+
+/* hint: lines y1 ... y2-1 are not needed for a while */
+void ida_image_release(struct ida_image *img, unsigned int y1,
+		       unsigned int y2)
+{
+    struct ida_store *store;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start, end;
+    uint32_t stride;
+
+    if (!ida_image_mapped(img))
+	return;
+    store = pixman_image_get_destroy_data(img->p);
+    stride = pixman_image_get_stride(img->p);
+
+    /* whole pages only, they might be shared with neighbour lines */
+    start = ((size_t)stride * y1 + page - 1) & ~(page - 1);
+    end   = (y2 >= img->i.height) ? store->size : (size_t)stride * y2;
+    end  &= ~(page - 1);
+    if (start < end)
+	madvise(store->map + start, end - start, MADV_DONTNEED);
+}
+
+/* line y is complete, drop finished bands when writing sequentially */
+void ida_image_line_done(struct ida_image *img, unsigned int y)
+{
+    if ((y + 1) % IDA_BAND_LINES && y + 1 != img->i.height)
+	return;
+    ida_image_release(img, y - y % IDA_BAND_LINES, y + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Buffer pool.  Slideshows tend to load images of the same size over
+ * and over.  Instead of unmapping the pixels of evicted images and
+ * faulting in (and clearing) fresh ones for the next image the buffers
+ * are kept in a small pool and handed out again.  Sizes are rounded up
+ * to classes (four to eight per power of two) so near-equal sizes
+ * match too.  Large buffers are hinted for transparent hugepages.
+ */
+#define IDA_POOL_MIN  (256 * 1024)
+#define IDA_POOL_HUGE (2 * 1024 * 1024)
+
+struct ida_buf {
+    struct list_head  list;
+    uint8_t           *base;
+    size_t            size;
+};
+
+size_t ida_pool_max;
+static LIST_HEAD(ida_pool);
+static struct ida_pool_stats ida_pool_st;
+
+static size_t ida_pool_class(size_t size)
+{
+    size_t step = sysconf(_SC_PAGESIZE);
+
+    while (step * 8 <= size)
+	step *= 2;
+    return (size + step - 1) & ~(step - 1);
+}
+
+static uint8_t *ida_pool_get(size_t size)
+{
+    struct list_head *item;
+    struct ida_buf *buf;
+    uint8_t *base;
+
+    list_for_each(item, &ida_pool) {
+	buf = list_entry(item, struct ida_buf, list);
+	if (buf->size != size)
+	    continue;
+	list_del(&buf->list);
+	base = buf->base;
+	ida_pool_st.idle -= size;
+	ida_pool_st.hits++;
+	free(buf);
+	return base;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == base)
+	return NULL;
+#ifdef MADV_HUGEPAGE
+    if (size >= IDA_POOL_HUGE)
+	madvise(base, size, MADV_HUGEPAGE);
+#endif
+    ida_pool_st.misses++;
+    return base;
+}
+
+static void ida_pool_put(uint8_t *base, size_t size)
+{
+    struct ida_buf *buf;
+
+    if (size <= ida_pool_max) {
+	buf = malloc(sizeof(*buf));
+	buf->base = base;
+	buf->size = size;
+	list_add(&buf->list, &ida_pool);
+	ida_pool_st.idle += size;
+    } else {
+	munmap(base, size);
+	ida_pool_st.dropped++;
+    }
+
+    /* over the limit: drop least recently used */
+    while (ida_pool_st.idle > ida_pool_max) {
+	buf = list_entry(ida_pool.prev, struct ida_buf, list);
+	list_del(&buf->list);
+	munmap(buf->base, buf->size);
+	ida_pool_st.idle -= buf->size;
+	ida_pool_st.dropped++;
+	free(buf);
+    }
+}
+
+void ida_pool_get_stats(struct ida_pool_stats *stats)
+{
+    *stats = ida_pool_st;
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Compact formats.  Bilevel scans, grayscale and paletted images are
+ * stored as pixman g1, g8 and c8 images, the palette goes to pixman too.
+ * Compositing converts on the fly, for the visible part only.  Anything
+ * else which looks at the pixels expects rgb, ida_image_scanline() and
+ * friends included.  Callers must ida_image_promote() compact images
+ * first, the ops, writers and the viewer do that on entry.  Ops which
+ * can handle compact images (resize) set ida_op->native and use
+ * ida_image_rgb_scanline(), which converts single lines without
+ * touching the image.
+ */
+static const struct {
+    pixman_format_code_t  pixman;
+    uint32_t              bits;
+} ida_formats[] = {
 #if __BYTE_ORDER == __LITTLE_ENDIAN
-        PIXMAN_b8g8r8,
+    [ IDA_FMT_RGB     ] = { PIXMAN_b8g8r8, 24 },
 #else
-        PIXMAN_r8g8b8,
+    [ IDA_FMT_RGB     ] = { PIXMAN_r8g8b8, 24 },
 #endif
-        img->i.width, img->i.height, NULL, 0);
+    [ IDA_FMT_GRAY    ] = { PIXMAN_g8,      8 },
+    [ IDA_FMT_MONO    ] = { PIXMAN_g1,      1 },
+    [ IDA_FMT_INDEXED ] = { PIXMAN_c8,      8 },
+};
+
+uint32_t ida_format_bits(enum ida_format format)
+{
+    return ida_formats[format].bits;
 }
 
-uint8_t *ida_image_scanline(struct ida_image *img, int y)
+void ida_image_alloc(struct ida_image *img)
+{
+    enum ida_format format = img->i.format;
+    struct ida_store *store;
+    uint32_t stride, i;
+    uint8_t *bits;
+
+    assert(img->p == NULL);
+    store = malloc(sizeof(*store));
+    memset(store, 0, sizeof(*store));
+    stride = ((img->i.width * ida_formats[format].bits + 31) >> 5) << 2;
+    store->size = (size_t)stride * img->i.height;
+
+    if (ida_image_mmap_min && store->size >= ida_image_mmap_min) {
+	store->map = ida_map_pixels(store->size);
+    } else if (ida_pool_max && store->size >= IDA_POOL_MIN) {
+	store->psize = ida_pool_class(store->size);
+	store->pool = ida_pool_get(store->psize);
+    }
+    bits = store->map ? store->map : store->pool;
+    img->p = pixman_image_create_bits(ida_formats[format].pixman,
+				      img->i.width, img->i.height,
+				      (uint32_t*)bits, bits ? stride : 0);
+    if (NULL == img->p && bits) {
+	if (store->map)
+	    munmap(store->map, store->size);
+	if (store->pool)
+	    ida_pool_put(store->pool, store->psize);
+	store->map  = NULL;
+	store->pool = NULL;
+	img->p = pixman_image_create_bits(ida_formats[format].pixman,
+					  img->i.width, img->i.height,
+					  NULL, 0);
+    }
+    if (debug && store->map)
+	fprintf(stderr, "image %ux%u: mmap'ed temp file, %zd MB\n",
+		img->i.width, img->i.height, store->size >> 20);
+
+    if (IDA_FMT_GRAY == format)
+	for (i = 0; i < 256; i++)
+	    img->i.cmap[i] = 0xff000000 | i * 0x010101;
+    if (IDA_FMT_RGB != format) {
+	store->indexed = malloc(sizeof(*store->indexed));
+	memset(store->indexed, 0, sizeof(*store->indexed));
+	store->indexed->color = (IDA_FMT_INDEXED == format);
+	memcpy(store->indexed->rgba, img->i.cmap, sizeof(img->i.cmap));
+	pixman_image_set_indexed(img->p, store->indexed);
+    }
+
+    if (store->map || store->pool || store->indexed) {
+	pixman_image_set_destroy_function(img->p, ida_store_destroy, store);
+    } else {
+	free(store);
+    }
+}
+
+static uint8_t *ida_stage_scanline(struct ida_stage *s, unsigned int y);
+
+/* line y in the image format, for loaders */
+uint8_t *ida_image_native_scanline(struct ida_image *img, int y)
 {
     uint8_t *scanline;
 
+    if (img->stage)
+	return ida_stage_scanline(img->stage, y);
     assert(img->p != NULL);
     scanline  = (void*)pixman_image_get_data(img->p);
     scanline += pixman_image_get_stride(img->p) * y;
     return scanline;
 }
 
+/* line y as rgb, converted into buf (width * 3 bytes) if needed */
+uint8_t *ida_image_rgb_scanline(struct ida_image *img, int y, uint8_t *buf)
+{
+    uint8_t *src = ida_image_native_scanline(img, y);
+    uint8_t *dst = buf;
+    uint32_t x, c = 0;
+
+    if (img->stage || IDA_FMT_RGB == img->i.format)
+	return src;
+    for (x = 0; x < img->i.width; x++) {
+	switch (img->i.format) {
+	case IDA_FMT_MONO:
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	    c = img->i.cmap[(src[x >> 3] >> (x & 7)) & 1];
+#else
+	    c = img->i.cmap[(src[x >> 3] >> (7 - (x & 7))) & 1];
+#endif
+	    break;
+	default:
+	    c = img->i.cmap[src[x]];
+	    break;
+	}
+	dst[0] = c >> 16;
+	dst[1] = c >> 8;
+	dst[2] = c;
+	dst += 3;
+    }
+    return buf;
+}
+
+/*
+ * Make compact images rgb, for code which can't deal with them.  This
+ * replaces the pixel buffer, so call it before handing out pointers or
+ * references to the image.
+ */
+void ida_image_promote(struct ida_image *img)
+{
+    struct ida_image dst;
+    unsigned int y;
+
+    if (img->stage || IDA_FMT_RGB == img->i.format)
+	return;
+    if (debug)
+	fprintf(stderr, "image %ux%u: promote to rgb\n",
+		img->i.width, img->i.height);
+    memset(&dst,0,sizeof(dst));
+    dst.i = img->i;
+    dst.i.format = IDA_FMT_RGB;
+    ida_image_alloc(&dst);
+    for (y = 0; y < img->i.height; y++) {
+	ida_image_rgb_scanline(img, y, ida_image_native_scanline(&dst, y));
+	ida_image_line_done(&dst, y);
+    }
+    ida_image_free(img);
+    *img = dst;
+}
+
+uint8_t *ida_image_scanline(struct ida_image *img, int y)
+{
+    assert(img->stage || IDA_FMT_RGB == img->i.format);
+    return ida_image_native_scanline(img, y);
+}
+
 uint32_t ida_image_stride(struct ida_image *img)
 {
+    if (img->stage)
+	return (img->i.width * 3 + 3) & ~3;
+    assert(IDA_FMT_RGB == img->i.format);
     return pixman_image_get_stride(img->p);
 }
 
 uint32_t ida_image_bpp(struct ida_image *img)
 {
-    uint32_t bits = PIXMAN_FORMAT_BPP(pixman_image_get_format(img->p));
-    uint32_t bytes = bits / 8;
+    uint32_t bits, bytes;
+
+    if (img->stage)
+	return 3;
+    assert(IDA_FMT_RGB == img->i.format);
+    bits = PIXMAN_FORMAT_BPP(pixman_image_get_format(img->p));
+    bytes = bits / 8;
     assert(bytes * 8 == bits);
     return bytes;
 }
 
+static void ida_stage_free(struct ida_stage *s);
+
 void ida_image_free(struct ida_image *img)
 {
+    if (img->stage) {
+	ida_stage_free(img->stage);
+	img->stage = NULL;
+	return;
+    }
     assert(img->p != NULL);
     pixman_image_unref(img->p);
     img->p = NULL;
@@ -174,6 +567,149 @@ void ida_image_free(struct ida_image *img)
 
 /* ----------------------------------------------------------------------- */
 
+/*
+ * Pipelines.  A virtual image has no pixel buffer, its lines are
+ * produced on demand by a loader or by an op working on another
+ * (possibly virtual) image.  Lines are produced in order, each stage
+ * keeps the last few in a ring, which is enough for ops looking at
+ * the neighbour lines (see ida_op->lines).  So a chain like
+ * load -> crop -> resize -> sharpen only needs memory for a handful
+ * of lines per stage, plus whatever the consumer does with the final
+ * output (ida_pipe_finish turns it into a normal image).
+ */
+#define STAGE_LINES 4
+
+struct ida_stage {
+    /* either loader ... */
+    struct ida_loader  *loader;
+    void               *load_data;
+    /* ... or op */
+    struct ida_op      *op;
+    void               *op_data;
+    struct ida_image   src;
+    struct ida_rect    rect;
+
+    /* output ring */
+    unsigned int       next;
+    unsigned int       stride;
+    uint8_t            *ring;
+};
+
+static struct ida_stage *ida_stage_new(struct ida_image *img)
+{
+    struct ida_stage *s;
+
+    s = malloc(sizeof(*s));
+    memset(s,0,sizeof(*s));
+    s->stride = (img->i.width * 3 + 3) & ~3;
+    s->ring = malloc(s->stride * STAGE_LINES);
+    img->p = NULL;
+    img->stage = s;
+    return s;
+}
+
+static uint8_t *ida_stage_scanline(struct ida_stage *s, unsigned int y)
+{
+    uint8_t *line;
+
+    /* streaming only, can't go back further than the ring */
+    assert(y + STAGE_LINES >= s->next);
+    while (s->next <= y) {
+	line = s->ring + (s->next % STAGE_LINES) * s->stride;
+	if (s->loader)
+	    s->loader->read(line, s->next, s->load_data);
+	else
+	    s->op->work(&s->src, &s->rect, line, s->next, s->op_data);
+	s->next++;
+    }
+    return s->ring + (y % STAGE_LINES) * s->stride;
+}
+
+static void ida_stage_free(struct ida_stage *s)
+{
+    if (s->loader)
+	s->loader->done(s->load_data);
+    if (s->op) {
+	s->op->done(s->op_data);
+	ida_image_free(&s->src);
+    }
+    free(s->ring);
+    free(s);
+}
+
+int ida_pipe_load(struct ida_image *img, struct ida_loader *loader,
+		  FILE *fp, char *filename, unsigned int page, int thumbnail)
+{
+    struct ida_stage *s;
+    void *data;
+
+    memset(img,0,sizeof(*img));
+    data = loader->init(fp, filename, page, &img->i, thumbnail);
+    if (NULL == data)
+	return -1;
+    s = ida_stage_new(img);
+    s->loader = loader;
+    s->load_data = data;
+    return 0;
+}
+
+/* takes over src on success */
+int ida_pipe_op(struct ida_image *img, struct ida_image *src,
+		struct ida_rect *rect, struct ida_op *op, void *parm)
+{
+    struct ida_rect full;
+    struct ida_stage *s;
+    void *data;
+
+    if (0 == op->lines)
+	ida_pipe_finish(src);
+    if (!op->native)
+	ida_image_promote(src);
+    if (NULL == rect) {
+	full.x1 = 0;
+	full.x2 = src->i.width;
+	full.y1 = 0;
+	full.y2 = src->i.height;
+	rect = &full;
+    }
+
+    memset(img,0,sizeof(*img));
+    data = op->init(src, rect, &img->i, parm);
+    if (NULL == data)
+	return -1;
+    img->i.format = IDA_FMT_RGB; /* ops produce rgb lines */
+    s = ida_stage_new(img);
+    s->op = op;
+    s->op_data = data;
+    s->src = *src;
+    s->rect = *rect;
+    memset(src,0,sizeof(*src));
+    return 0;
+}
+
+/* compute all lines, turn the virtual image into a normal one */
+void ida_pipe_finish(struct ida_image *img)
+{
+    struct ida_image dst;
+    unsigned int y;
+
+    if (!img->stage)
+	return;
+    memset(&dst,0,sizeof(dst));
+    dst.i = img->i;
+    ida_image_alloc(&dst);
+    for (y = 0; y < img->i.height; y++) {
+	memcpy(ida_image_scanline(&dst, y),
+	       ida_stage_scanline(img->stage, y),
+	       img->i.width * 3);
+	ida_image_line_done(&dst, y);
+    }
+    ida_image_free(img);
+    *img = dst;
+}
+
+/* ----------------------------------------------------------------------- */
+
 LIST_HEAD(loaders);
 
 void load_register(struct ida_loader *loader)
@@ -13,6 +13,14 @@ struct ida_extra {
     struct ida_extra  *next;
 };
 
+/* pixel storage, loaders deliver lines in that format */
+enum ida_format {
+    IDA_FMT_RGB = 0,     /* 24bpp rgb                                */
+    IDA_FMT_GRAY,        /* 8bpp gray                                */
+    IDA_FMT_MONO,        /* 1bpp, bits in pixman order, see load_mono */
+    IDA_FMT_INDEXED,     /* 8bpp, colors in cmap                     */
+};
+
 /* image data and metadata */
 struct ida_image_info {
     unsigned int      width;
@@ -24,17 +32,29 @@ struct ida_image_info {
     int               thumbnail;
     unsigned int      real_width;
     unsigned int      real_height;
+
+    /* compact formats, only with LOAD_NATIVE */
+    enum ida_format   format;
+    uint32_t          cmap[256];   /* 0xffrrggbb, mono + indexed */
 };
 
+struct ida_stage;
 struct ida_image {
     struct ida_image_info  i;
     pixman_image_t         *p;
+    struct ida_stage       *stage;  /* virtual image, see ida_pipe_*() */
 };
 struct ida_rect {
     int x1,y1,x2,y2;
 };
 
 /* load image files */
+#define LOAD_THUMB_EXIF     1   /* thumbnail: embedded one is fine */
+#define LOAD_THUMB_SCALED   2   /* thumbnail: reduced size decode is fine */
+#define LOAD_THUMB_MIN      320 /* ... keeping at least that many pixels */
+#define LOAD_PROGRESSIVE    4   /* caller handles multiple passes */
+#define LOAD_NATIVE         8   /* caller handles compact formats */
+
 struct ida_loader {
     char  *magic;
     int   moff;
@@ -43,11 +63,21 @@ struct ida_loader {
     void* (*init)(FILE *fp, char *filename, unsigned int page,
 		  struct ida_image_info *i, int thumbnail);
     void  (*read)(unsigned char *dst, unsigned int line, void *data);
+    /* optional: after reading all lines, returns 1 if a refined pass
+     * follows (read lines 0 .. height-1 again), 0 when complete */
+    int   (*pass)(void *data);
+    /* optional: decode only the part within rect (full size pixels),
+     * reduced by *shrink (power of two).  Call before the first read.
+     * Updates rect and *shrink to what actually gets decoded and
+     * i->width/height to the size of the lines read. */
+    int   (*region)(void *data, struct ida_image_info *i,
+		    struct ida_rect *rect, unsigned int *shrink);
     void  (*done)(void *data);
     struct list_head list;
 };
 
 /* filter + operations */
+struct op_points;
 struct ida_op {
     char  *name;
     void* (*init)(struct ida_image *src, struct ida_rect *rect,
@@ -55,7 +85,21 @@ struct ida_op {
     void  (*work)(struct ida_image *src, struct ida_rect *rect,
 		  unsigned char *dst, int line,
 		  void *data);
+    /* optional, count lines at once, dst lines are stride bytes apart */
+    void  (*band)(struct ida_image *src, struct ida_rect *rect,
+		  unsigned char *dst, unsigned int stride, int line,
+		  unsigned int count, void *data);
     void  (*done)(void *data);
+    /* point operations only, see struct op_points */
+    void  (*point)(struct op_points *pts, void *parm);
+    /* source lines needed at once, 0 == random access (no streaming) */
+    unsigned int lines;
+    /* pixels outside rect are passed through unchanged */
+    int   in_rect;
+    /* works at any resolution, previews may use a downscaled copy */
+    int   proxy;
+    /* reads compact formats (ida_image_rgb_scanline), no promotion */
+    int   native;
 };
 
 void* op_none_init(struct ida_image *src, struct ida_rect *rect,
@@ -80,6 +124,7 @@ void load_bits_msb(unsigned char *dst, unsigned char *src, int width,
 void load_gray(unsigned char *dst, unsigned char *src, int width);
 void load_graya(unsigned char *dst, unsigned char *src, int width);
 void load_rgba(unsigned char *dst, unsigned char *src, int width);
+void load_mono(unsigned char *dst, unsigned char *src, int width);
 
 int load_add_extra(struct ida_image_info *info, enum ida_extype type,
 		   unsigned char *data, unsigned int size);
@@ -87,12 +132,44 @@ struct ida_extra* load_find_extra(struct ida_image_info *info,
 				  enum ida_extype type);
 int load_free_extras(struct ida_image_info *info);
 
+/* pixels are not cleared, callers must fill all lines */
 void ida_image_alloc(struct ida_image *img);
 uint8_t *ida_image_scanline(struct ida_image *img, int y);
 uint32_t ida_image_stride(struct ida_image *img);
 uint32_t ida_image_bpp(struct ida_image *img);
 void ida_image_free(struct ida_image *img);
 
+/* compact images, scanline/stride/bpp above need promoted (rgb) ones */
+uint32_t ida_format_bits(enum ida_format format);
+void ida_image_promote(struct ida_image *img);
+uint8_t *ida_image_native_scanline(struct ida_image *img, int y);
+uint8_t *ida_image_rgb_scanline(struct ida_image *img, int y, uint8_t *buf);
+
+/* out-of-core images, backed by a mmap'ed temp file, off by default */
+#define IDA_BAND_LINES 64
+extern size_t ida_image_mmap_min;
+int ida_image_mapped(struct ida_image *img);
+void ida_image_release(struct ida_image *img, unsigned int y1,
+		       unsigned int y2);
+void ida_image_line_done(struct ida_image *img, unsigned int y);
+
+/* recycle pixel buffers of freed images, off by default (not thread safe) */
+struct ida_pool_stats {
+    unsigned long  hits;
+    unsigned long  misses;
+    unsigned long  dropped;
+    size_t         idle;     /* bytes */
+};
+extern size_t ida_pool_max;  /* idle bytes to keep */
+void ida_pool_get_stats(struct ida_pool_stats *stats);
+
+/* pipelines: virtual images, lines are computed on demand */
+int ida_pipe_load(struct ida_image *img, struct ida_loader *loader,
+		  FILE *fp, char *filename, unsigned int page, int thumbnail);
+int ida_pipe_op(struct ida_image *img, struct ida_image *src,
+		struct ida_rect *rect, struct ida_op *op, void *parm);
+void ida_pipe_finish(struct ida_image *img);
+
 /* ----------------------------------------------------------------------- */
 
 /* other */
@@ -43,6 +43,30 @@ Atom MIME_IMAGE_TIFF;
 /* ---------------------------------------------------------------------- */
 /* send data (drags, copy)                                                */
 
+#define SEL_CHUNK  (64 * 1024)  /* larger transfers go incremental */
+
+/* image data, cached per target while the selection is owned */
+struct sel_enc {
+    struct list_head  list;
+    Atom              target;
+    char              *data;     /* encoded image, NULL for ppm */
+    size_t            size;
+    char              head[32];  /* ppm header */
+    unsigned int      hlen;
+};
+
+/*
+ * incremental transfer in progress, one per requestor + property
+ * (several clients can fetch the same target at the same time)
+ */
+struct sel_xfer {
+    struct list_head  list;
+    Window            requestor;
+    Atom              property;
+    Atom              target;
+    size_t            pos;
+};
+
 struct sel_data {
     struct list_head  list;
     Atom              atom;
@@ -51,6 +75,8 @@ struct sel_data {
     char              *filename;
     Pixmap            icon_pixmap;
     Widget            icon_widget;
+    struct list_head  encs;
+    struct list_head  xfers;
 };
 static struct list_head selections;
 
@@ -117,6 +143,8 @@ static void
 sel_free(Atom selection)
 {
     struct sel_data   *sel;
+    struct sel_enc    *enc;
+    struct sel_xfer   *xfer;
 
     sel = sel_find(selection);
     if (NULL == sel)
@@ -133,6 +161,17 @@ sel_free(Atom selection)
 	XFreePixmap(dpy,sel->pixmap);
     if (sel->img.p)
 	ida_image_free(&sel->img);
+    while (!list_empty(&sel->encs)) {
+	enc = list_entry(sel->encs.next, struct sel_enc, list);
+	list_del(&enc->list);
+	free(enc->data);
+	free(enc);
+    }
+    while (!list_empty(&sel->xfers)) {
+	xfer = list_entry(sel->xfers.next, struct sel_xfer, list);
+	list_del(&xfer->list);
+	free(xfer);
+    }
 
     list_del(&sel->list);
     free(sel);
@@ -148,6 +187,8 @@ sel_init(Atom selection)
     memset(sel,0,sizeof(*sel));
 
     sel->atom = selection;
+    INIT_LIST_HEAD(&sel->encs);
+    INIT_LIST_HEAD(&sel->xfers);
     sel->img.i = ida->img.i;
     sel->img.p = pixman_image_ref(ida->img.p);
 
@@ -155,14 +196,155 @@ sel_init(Atom selection)
     return sel;
 }
 
+static struct ida_writer*
+sel_writer(char *ext)
+{
+    struct list_head *item;
+    struct ida_writer *wr;
+
+    list_for_each(item,&writers) {
+	wr = list_entry(item, struct ida_writer, list);
+	if (wr->ext[0] && 0 == strcmp(wr->ext[0],ext))
+	    return wr;
+    }
+    return NULL;
+}
+
+/*
+ * Encode into memory (once per target).  ppm isn't encoded at all,
+ * the data is copied straight from the image when sending.  jpeg and
+ * png are encoded completely on the first request, the writers have
+ * no incremental interface.
+ */
+static struct sel_enc*
+sel_encode(struct sel_data *sel, Atom target)
+{
+    struct list_head *item;
+    struct ida_writer *wr = NULL;
+    struct sel_enc *enc;
+    FILE *fp;
+
+    list_for_each(item,&sel->encs) {
+	enc = list_entry(item, struct sel_enc, list);
+	if (enc->target == target)
+	    return enc;
+    }
+
+    enc = malloc(sizeof(*enc));
+    memset(enc,0,sizeof(*enc));
+    enc->target = target;
+    if (target == MIME_IMAGE_PPM) {
+	enc->hlen = sprintf(enc->head,"P6\n%u %u\n255\n",
+			    sel->img.i.width, sel->img.i.height);
+	enc->size = enc->hlen + sel->img.i.width * sel->img.i.height * 3;
+    } else {
+	if (target == MIME_IMAGE_JPEG)
+	    wr = &jpeg_writer;
+	if (target == MIME_IMAGE_PNG)
+	    wr = sel_writer("png");
+	if (NULL == wr)
+	    goto oops;
+	fp = open_memstream(&enc->data,&enc->size);
+	if (NULL == fp)
+	    goto oops;
+	if (-1 == wr->write(fp,&sel->img)) {
+	    fclose(fp);
+	    free(enc->data);
+	    goto oops;
+	}
+	fclose(fp);
+	if (debug)
+	    fprintf(stderr,"conv: encoded %s, %zd bytes\n",
+		    wr->label, enc->size);
+    }
+    list_add_tail(&enc->list,&sel->encs);
+    return enc;
+
+ oops:
+    free(enc);
+    return NULL;
+}
+
+static void
+sel_copy(struct sel_data *sel, struct sel_enc *enc,
+	 char *dst, size_t off, size_t len)
+{
+    size_t bpl = sel->img.i.width * 3;
+    size_t n, y, x;
+
+    if (enc->data) {
+	memcpy(dst, enc->data + off, len);
+	return;
+    }
+
+    /* ppm: header, then the image lines */
+    while (len) {
+	if (off < enc->hlen) {
+	    n = enc->hlen - off;
+	    if (n > len)
+		n = len;
+	    memcpy(dst, enc->head + off, n);
+	} else {
+	    y = (off - enc->hlen) / bpl;
+	    x = (off - enc->hlen) % bpl;
+	    n = bpl - x;
+	    if (n > len)
+		n = len;
+	    memcpy(dst, ida_image_scanline(&sel->img, y) + x, n);
+	}
+	dst += n;
+	off += n;
+	len -= n;
+    }
+}
+
+/* find the transfer state, a fresh request (re)starts at zero */
+static struct sel_xfer*
+sel_xfer(struct sel_data *sel, XmConvertCallbackStruct *ccs)
+{
+    XSelectionRequestEvent *req = NULL;
+    struct list_head *item;
+    struct sel_xfer *xfer;
+    Window requestor = None;
+    Atom property = None;
+
+    if (ccs->event && SelectionRequest == ccs->event->type) {
+	req = &ccs->event->xselectionrequest;
+	requestor = req->requestor;
+	property  = req->property;
+    }
+    list_for_each(item,&sel->xfers) {
+	xfer = list_entry(item, struct sel_xfer, list);
+	if (xfer->requestor == requestor &&
+	    xfer->property  == property &&
+	    xfer->target    == ccs->target)
+	    goto found;
+    }
+    xfer = malloc(sizeof(*xfer));
+    memset(xfer,0,sizeof(*xfer));
+    xfer->requestor = requestor;
+    xfer->property  = property;
+    xfer->target    = ccs->target;
+    list_add_tail(&xfer->list,&sel->xfers);
+ found:
+    if (!(ccs->flags & XmCONVERTING_PARTIAL))
+	xfer->pos = 0;
+    return xfer;
+}
+
 static void
-sel_tmpfile(struct sel_data *sel, struct ida_writer *wr)
+sel_tmpfile(struct sel_data *sel)
 {
     static char *base = "ida";
+    struct sel_enc *enc;
     char *tmpdir;
     FILE *fp;
     int fd;
 
+    enc = sel_encode(sel, MIME_IMAGE_JPEG);
+    if (NULL == enc)
+	return;
+
     tmpdir = getenv("TMPDIR");
     if (NULL == tmpdir)
 	tmpdir="/tmp";
@@ -170,7 +352,7 @@ sel_tmpfile(struct sel_data *sel, struct ida_writer *wr)
     sprintf(sel->filename,"%s/%s-XXXXXX",tmpdir,base);
     fd = mkstemp(sel->filename);
     fp = fdopen(fd,"w");
-    wr->write(fp,&sel->img);
+    fwrite(enc->data,enc->size,1,fp);
     fclose(fp);
 }
 
@@ -196,7 +378,10 @@ selection_convert(Widget widget, XtPointer ignore, XtPointer call_data)
     unsigned long *ldata;
     unsigned char *cdata;
     struct sel_data *sel;
+    struct sel_enc *enc;
+    struct sel_xfer *xfer;
     char *filename;
+    size_t len;
     int n;
 
     if (debug) {
@@ -213,10 +398,13 @@ selection_convert(Widget widget, XtPointer ignore, XtPointer call_data)
 	(ccs->target == _MOTIF_DEFERRED_CLIPBOARD_TARGETS) ||
 	(ccs->target == _MOTIF_EXPORT_TARGETS)) {
 	n = 0;
-	ldata = (Atom*)XtMalloc(sizeof(Atom)*12);
+	ldata = (Atom*)XtMalloc(sizeof(Atom)*16);
 	if (ccs->target != _MOTIF_CLIPBOARD_TARGETS) {
 	    ldata[n++] = XA_TARGETS;
 	    ldata[n++] = MIME_IMAGE_PPM;
+	    ldata[n++] = MIME_IMAGE_JPEG;
+	    if (sel_writer("png"))
+		ldata[n++] = MIME_IMAGE_PNG;
 	    ldata[n++] = XA_PIXMAP;
 	    ldata[n++] = XA_FOREGROUND;
 	    ldata[n++] = XA_BACKGROUND;
@@ -304,18 +492,33 @@ selection_convert(Widget widget, XtPointer ignore, XtPointer call_data)
 	ccs->format = 32;
 	ccs->status = XmCONVERT_DONE;
 
-    } else if (ccs->target == MIME_IMAGE_PPM) {
-	/* xfer image data directly */
-	cdata = XtMalloc(sel->img.i.width * sel->img.i.height * 3 + 32);
-	n = sprintf(cdata,"P6\n%u %u\n255\n",
-		    sel->img.i.width, sel->img.i.height);
-	memcpy(cdata+n, pixman_image_get_data(sel->img.p),
-               sel->img.i.width*sel->img.i.height*3);
+    } else if (ccs->target == MIME_IMAGE_PPM  ||
+	       ccs->target == MIME_IMAGE_JPEG ||
+	       ccs->target == MIME_IMAGE_PNG) {
+	/* xfer image data from memory, in chunks (INCR) if large */
+	enc = sel_encode(sel, ccs->target);
+	if (NULL == enc) {
+	    ccs->status = XmCONVERT_REFUSE;
+	    return;
+	}
+	xfer = sel_xfer(sel, ccs);
+	len = enc->size - xfer->pos;
+	if (len > SEL_CHUNK)
+	    len = SEL_CHUNK;
+	cdata = XtMalloc(len ? len : 1);
+	sel_copy(sel, enc, cdata, xfer->pos, len);
+	xfer->pos += len;
 	ccs->value  = cdata;
-	ccs->length = n + sel->img.i.width * sel->img.i.height * 3;
-	ccs->type   = MIME_IMAGE_PPM;
+	ccs->length = len;
+	ccs->type   = ccs->target;
 	ccs->format = 8;
-	ccs->status = XmCONVERT_DONE;
+	if (xfer->pos < enc->size) {
+	    ccs->status = XmCONVERT_MORE;
+	} else {
+	    ccs->status = XmCONVERT_DONE;
+	    list_del(&xfer->list);
+	    free(xfer);
+	}
 
     } else if (ccs->target == XA_FILE_NAME       ||
 	       ccs->target == XA_FILE            ||
@@ -324,7 +527,11 @@ selection_convert(Widget widget, XtPointer ignore, XtPointer call_data)
 	       ccs->target == _NETSCAPE_URL) {
 	/* xfer image via tmp file */
 	if (NULL == sel->filename)
-	    sel_tmpfile(sel,&jpeg_writer);
+	    sel_tmpfile(sel);
+	if (NULL == sel->filename) {
+	    ccs->status = XmCONVERT_REFUSE;
+	    return;
+	}
 	if (ccs->target == MIME_TEXT_URI_LIST ||
 	    ccs->target == _NETSCAPE_URL) {
 	    /* filename => url */
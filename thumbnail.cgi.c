@@ -3,11 +3,23 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <libexif/exif-data.h>
 
+#include "list.h"
+#include "jpegscan.h"
+#include "genthumbnail.h"
+
 /* -------------------------------------------------------------------------- */
 
 static const char *shellhelp = 
@@ -35,10 +47,247 @@ static const char *description =
     "deliver thumbnails for any JPEG image below below your document root which\n"
     "it is allowed to open by unix file permissions.\n"
     "\n"
+    "Images without exif thumbnail get one generated on the fly.\n"
+    "\n"
     "(c) 2004 Gerd Hoffmann <gerd@kraxel.org> [SUSE Labs]\n"
     "\n";
 
+static const char *serverhelp =
+    "It can also run as persistent http server, keeping the thumbnails\n"
+    "cached in memory:\n"
+    "\n"
+    "    thumbnail.cgi -d <docroot> -l [host:]port   (tcp, default host: localhost)\n"
+    "    thumbnail.cgi -d <docroot> -u <path>        (unix socket)\n"
+    "\n"
+    "    -m <mb>   cache size (default: 64)\n"
+    "\n";
+
+/* -------------------------------------------------------------------------- */
+/* thumbnail cache                                                            */
+
+#define THUMB_MAX     (256 * 1024)
+#define THUMB_HASH    1024
+
+struct thumb {
+    struct list_head  lru;
+    struct list_head  hash;
+    char              *path;
+    dev_t             dev;
+    ino_t             ino;
+    off_t             size;
+    struct timespec   mtime;
+    unsigned char     *data;
+    unsigned int      len;
+};
+
+static LIST_HEAD(thumb_lru);
+static struct list_head thumb_hash[THUMB_HASH];
+static pthread_mutex_t thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t thumb_bytes;
+static size_t thumb_limit = 64 * 1024 * 1024;
+
+/*
+ * Thumbnails being created right now.  Requests for the same file
+ * wait for the result instead of decoding the image once more, and
+ * the number of decodes running in parallel is limited to the number
+ * of cpus (thumb_gen), so a burst of requests can't eat all memory.
+ */
+struct thumb_pending {
+    struct list_head  list;
+    const char        *path;
+};
+
+static LIST_HEAD(thumb_pending);
+static pthread_cond_t thumb_done = PTHREAD_COND_INITIALIZER;
+static sem_t thumb_gen;
+
+static void thumb_init(void)
+{
+    long cpus;
+    int i;
+
+    for (i = 0; i < THUMB_HASH; i++)
+	INIT_LIST_HEAD(&thumb_hash[i]);
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    sem_init(&thumb_gen, 0, cpus > 0 ? cpus : 1);
+}
+
+static struct list_head *thumb_bucket(const char *path)
+{
+    unsigned int h = 5381;
+
+    while (*path)
+	h = h * 33 + (unsigned char)*(path++);
+    return &thumb_hash[h % THUMB_HASH];
+}
+
+static void thumb_free(struct thumb *t)
+{
+    list_del(&t->lru);
+    list_del(&t->hash);
+    thumb_bytes -= t->len;
+    free(t->path);
+    free(t->data);
+    free(t);
+}
+
+/* returns a malloced copy of the cached thumbnail */
+static unsigned char *thumb_cache_get(const char *path, struct stat *st,
+				      unsigned int *len)
+{
+    struct list_head *item;
+    struct thumb *t;
+    unsigned char *data = NULL;
+
+    pthread_mutex_lock(&thumb_lock);
+    list_for_each(item, thumb_bucket(path)) {
+	t = list_entry(item, struct thumb, hash);
+	if (t->dev  != st->st_dev  ||
+	    t->ino  != st->st_ino  ||
+	    t->size != st->st_size ||
+	    t->mtime.tv_sec  != st->st_mtim.tv_sec  ||
+	    t->mtime.tv_nsec != st->st_mtim.tv_nsec ||
+	    0 != strcmp(t->path, path))
+	    continue;
+	list_del(&t->lru);
+	list_add(&t->lru, &thumb_lru);
+	data = malloc(t->len);
+	memcpy(data, t->data, t->len);
+	*len = t->len;
+	break;
+    }
+    pthread_mutex_unlock(&thumb_lock);
+    return data;
+}
+
+static void thumb_cache_put(const char *path, struct stat *st,
+			    unsigned char *data, unsigned int len)
+{
+    struct list_head *item, *safe, *bucket;
+    struct thumb *t;
+
+    if (len > thumb_limit)
+	return;
+    pthread_mutex_lock(&thumb_lock);
+
+    /* drop stale entries for this file */
+    bucket = thumb_bucket(path);
+    list_for_each_safe(item, safe, bucket) {
+	t = list_entry(item, struct thumb, hash);
+	if (0 == strcmp(t->path, path))
+	    thumb_free(t);
+    }
+
+    /* make room */
+    while (thumb_bytes + len > thumb_limit && !list_empty(&thumb_lru))
+	thumb_free(list_entry(thumb_lru.prev, struct thumb, lru));
+
+    t = malloc(sizeof(*t));
+    t->path  = strdup(path);
+    t->dev   = st->st_dev;
+    t->ino   = st->st_ino;
+    t->size  = st->st_size;
+    t->mtime = st->st_mtim;
+    t->data  = malloc(len);
+    t->len   = len;
+    memcpy(t->data, data, len);
+    list_add(&t->lru, &thumb_lru);
+    list_add(&t->hash, bucket);
+    thumb_bytes += len;
+    pthread_mutex_unlock(&thumb_lock);
+}
+
+/*
+ * Get the thumbnail for a file: from the cache, from the exif data,
+ * or create one.  Returns a malloced buffer, or NULL with http status
+ * code and message filled in.
+ */
+static unsigned char *thumb_create(const char *filename, unsigned int *len,
+				   int *code, char **msg)
+{
+    struct jpeg_scan scan;
+    unsigned char *data;
+    int size;
+
+    if (0 != jpeg_scan_file(filename, &scan)) {
+	*code = 500;
+	*msg  = "not a jpeg image";
+	return NULL;
+    }
+    if (scan.thumb_size >= 2 &&
+	scan.app1[scan.thumb_offset]   == 0xff &&
+	scan.app1[scan.thumb_offset+1] == 0xd8) {
+	/* exif thumbnail */
+	*len = scan.thumb_size;
+	data = malloc(*len);
+	memcpy(data, scan.app1 + scan.thumb_offset, *len);
+    } else {
+	/* none present, create one */
+	data = malloc(THUMB_MAX);
+	while (-1 == sem_wait(&thumb_gen) && errno == EINTR)
+	    /* again */;
+	size = create_thumbnail((char*)filename, data, THUMB_MAX);
+	sem_post(&thumb_gen);
+	if (size <= 0) {
+	    free(data);
+	    jpeg_scan_free(&scan);
+	    *code = 500;
+	    *msg  = "can't create thumbnail";
+	    return NULL;
+	}
+	*len = size;
+    }
+    jpeg_scan_free(&scan);
+    return data;
+}
+
+static unsigned char *thumb_get(const char *filename, struct stat *st,
+				unsigned int *len, int *code, char **msg)
+{
+    struct thumb_pending pending, *p;
+    struct list_head *item;
+    unsigned char *data;
+
+ again:
+    data = thumb_cache_get(filename, st, len);
+    if (data)
+	return data;
+
+    pthread_mutex_lock(&thumb_lock);
+    list_for_each(item, &thumb_pending) {
+	p = list_entry(item, struct thumb_pending, list);
+	if (0 == strcmp(p->path, filename)) {
+	    /* someone else is at it, look again when done */
+	    pthread_cond_wait(&thumb_done, &thumb_lock);
+	    pthread_mutex_unlock(&thumb_lock);
+	    goto again;
+	}
+    }
+    pending.path = filename;
+    list_add(&pending.list, &thumb_pending);
+    pthread_mutex_unlock(&thumb_lock);
+
+    data = thumb_create(filename, len, code, msg);
+    if (data)
+	thumb_cache_put(filename, st, data, *len);
+
+    pthread_mutex_lock(&thumb_lock);
+    list_del(&pending.list);
+    pthread_cond_broadcast(&thumb_done);
+    pthread_mutex_unlock(&thumb_lock);
+    return data;
+}
+
+static void thumb_mtime(struct stat *st, char *mtime, size_t size)
+{
+    struct tm tm;
+
+    gmtime_r(&st->st_mtime, &tm);
+    strftime(mtime,size,"%a, %d %b %Y %H:%M:%S GMT",&tm);
+}
+
 /* -------------------------------------------------------------------------- */
+/* cgi mode                                                                   */
 
 static void panic(int code, char *message)
 {
@@ -56,13 +305,14 @@ static void dump_thumbnail(char *filename)
     char *cached;
     char mtime[64];
     struct stat st;
-    struct tm *tm;
-    ExifData *ed = NULL;
+    unsigned char *data;
+    unsigned int len;
+    int code;
+    char *msg;
 
     if (-1 == stat(filename,&st))
 	panic(404,"can't stat file");
-    tm = gmtime(&st.st_mtime);
-    strftime(mtime,sizeof(mtime),"%a, %d %b %Y %H:%M:%S GMT",tm);
+    thumb_mtime(&st,mtime,sizeof(mtime));
     cached = getenv("HTTP_IF_MODIFIED_SINCE");
     if (NULL != cached && 0 == strcmp(cached,mtime)) {
 	/* shortcut -- browser has a up-to-date copy */
@@ -71,24 +321,338 @@ static void dump_thumbnail(char *filename)
 	fflush(stdout);
 	return;
     }
-    
-    ed = exif_data_new_from_file(filename);
-    if (!ed)
-	panic(500,"file has no exif data\n");
-    if (!ed->data)
-	panic(500,"no exif thumbnail present");
-    if (ed->data[0] != 0xff || ed->data[1] != 0xd8)
-	panic(500,"exif thumbnail has no jpeg magic");
 
-    
+    data = thumb_get(filename,&st,&len,&code,&msg);
+    if (!data)
+	panic(code,msg);
+
     printf("Status: 200 Thumbnail follows\n"
 	   "Content-Type: image/jpeg\n"
 	   "Content-Length: %d\n"
 	   "Last-modified: %s\n"
 	   "\n",
-	   ed->size,mtime);
-    fwrite(ed->data,ed->size,1,stdout);
+	   len,mtime);
+    fwrite(data,len,1,stdout);
     fflush(stdout);
+    free(data);
+}
+
+/* -------------------------------------------------------------------------- */
+/* server mode (http/1.1, one thread per connection)                          */
+
+#define REQ_MAX       8192
+#define REQ_TIMEOUT   30
+#define CONN_MAX      256    /* more wait in the listen backlog */
+
+static char *server_root;
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int conns;
+
+static void conn_put(void)
+{
+    pthread_mutex_lock(&conn_lock);
+    conns--;
+    pthread_cond_signal(&conn_cond);
+    pthread_mutex_unlock(&conn_lock);
+}
+
+struct conn {
+    int    fd;
+    int    len;
+    char   buf[REQ_MAX + 1];
+};
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *p = data;
+    ssize_t rc;
+
+    while (len) {
+	rc = write(fd, p, len);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0)
+	    return -1;
+	p   += rc;
+	len -= rc;
+    }
+    return 0;
+}
+
+static int http_error(struct conn *c, int code, char *msg, int keep)
+{
+    char reply[512];
+    int len;
+
+    len = snprintf(reply, sizeof(reply),
+		   "HTTP/1.1 %d %s\r\n"
+		   "Content-Type: text/plain\r\n"
+		   "Content-Length: %d\r\n"
+		   "%s"
+		   "\r\n"
+		   "ERROR: %s\n",
+		   code, msg, (int)strlen(msg) + 8,
+		   keep ? "" : "Connection: close\r\n", msg);
+    return write_all(c->fd, reply, len);
+}
+
+static char *http_header(char *hdrs, const char *name)
+{
+    size_t len = strlen(name);
+    char *line;
+
+    for (line = hdrs; line; line = strchr(line, '\n')) {
+	if (*line == '\n')
+	    line++;
+	if (0 == strncasecmp(line, name, len) && line[len] == ':') {
+	    line += len + 1;
+	    while (*line == ' ' || *line == '\t')
+		line++;
+	    return line;
+	}
+    }
+    return NULL;
+}
+
+static int http_header_is(char *hdrs, const char *name, const char *value)
+{
+    char *h = http_header(hdrs, name);
+    size_t len = strlen(value);
+
+    return h && 0 == strncasecmp(h, value, len) &&
+	(h[len] == '\r' || h[len] == '\n' || h[len] == '\0');
+}
+
+static void url_decode(char *str)
+{
+    char *dst = str;
+    unsigned int c;
+
+    for (; *str; str++) {
+	if (*str == '%' && str[1] && str[2] &&
+	    1 == sscanf(str+1, "%2x", &c)) {
+	    *(dst++) = c;
+	    str += 2;
+	} else {
+	    *(dst++) = *str;
+	}
+    }
+    *dst = 0;
+}
+
+/* handle one request, returns 0 if the connection stays open */
+static int http_request(struct conn *c, char *req)
+{
+    char filename[1024], mtime[64], etag[64], reply[512];
+    char *method, *path, *version, *hdrs, *h, *inm, *ims;
+    unsigned char *data;
+    unsigned int len;
+    struct stat st;
+    int keep, head, code, hlen, rc;
+    char *msg;
+
+    /* request line */
+    hdrs = strchr(req, '\n');
+    if (hdrs)
+	*(hdrs++) = 0;
+    method  = strtok_r(req, " \r", &h);
+    path    = strtok_r(NULL, " \r", &h);
+    version = strtok_r(NULL, " \r", &h);
+    if (!method || !path || !version || !hdrs) {
+	http_error(c, 400, "Bad Request", 0);
+	return -1;
+    }
+    if (0 == strcmp(version, "HTTP/1.1"))
+	keep = !http_header_is(hdrs, "Connection", "close");
+    else
+	keep = http_header_is(hdrs, "Connection", "keep-alive");
+    head = (0 == strcmp(method, "HEAD"));
+    if (!head && 0 != strcmp(method, "GET")) {
+	http_error(c, 405, "Method Not Allowed", 0);
+	return -1;
+    }
+
+    if (NULL != (h = strchr(path, '?')))
+	*h = 0;
+    url_decode(path);
+    if (NULL != strstr(path, ".."))
+	return http_error(c, 403, "Forbidden", keep) || !keep;
+    snprintf(filename, sizeof(filename), "%s/%s", server_root, path);
+    if (-1 == stat(filename, &st) || !S_ISREG(st.st_mode))
+	return http_error(c, 404, "Not Found", keep) || !keep;
+
+    /* conditional requests are answered from the inode only */
+    thumb_mtime(&st, mtime, sizeof(mtime));
+    snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx.%lx\"",
+	     (unsigned long)st.st_ino, (unsigned long)st.st_size,
+	     (unsigned long)st.st_mtim.tv_sec,
+	     (unsigned long)st.st_mtim.tv_nsec);
+    inm = http_header(hdrs, "If-None-Match");
+    ims = http_header(hdrs, "If-Modified-Since");
+    if (( inm && 0 == strncmp(inm, etag, strlen(etag))) ||
+	(!inm && ims && 0 == strncmp(ims, mtime, strlen(mtime)))) {
+	hlen = snprintf(reply, sizeof(reply),
+			"HTTP/1.1 304 Not Modified\r\n"
+			"Last-Modified: %s\r\n"
+			"ETag: %s\r\n"
+			"%s"
+			"\r\n",
+			mtime, etag, keep ? "" : "Connection: close\r\n");
+	return write_all(c->fd, reply, hlen) || !keep;
+    }
+
+    data = thumb_get(filename, &st, &len, &code, &msg);
+    if (!data)
+	return http_error(c, code, msg, keep) || !keep;
+    hlen = snprintf(reply, sizeof(reply),
+		    "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: image/jpeg\r\n"
+		    "Content-Length: %u\r\n"
+		    "Last-Modified: %s\r\n"
+		    "ETag: %s\r\n"
+		    "%s"
+		    "\r\n",
+		    len, mtime, etag, keep ? "" : "Connection: close\r\n");
+    rc = write_all(c->fd, reply, hlen);
+    if (0 == rc && !head)
+	rc = write_all(c->fd, data, len);
+    free(data);
+    return rc || !keep;
+}
+
+static void *http_conn(void *arg)
+{
+    struct conn *c = arg;
+    char *end;
+    ssize_t rc;
+    int used;
+
+    for (;;) {
+	/* need the complete request header */
+	c->buf[c->len] = 0;
+	end = strstr(c->buf, "\r\n\r\n");
+	if (!end) {
+	    if (c->len == REQ_MAX) {
+		http_error(c, 431, "Request Header Fields Too Large", 0);
+		break;
+	    }
+	    rc = read(c->fd, c->buf + c->len, REQ_MAX - c->len);
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    if (rc <= 0)
+		break;
+	    c->len += rc;
+	    continue;
+	}
+	end[2] = 0;
+	used = end + 4 - c->buf;
+	if (0 != http_request(c, c->buf))
+	    break;
+
+	/* keep pipelined requests */
+	memmove(c->buf, c->buf + used, c->len - used);
+	c->len -= used;
+    }
+
+    close(c->fd);
+    free(c);
+    conn_put();
+    return NULL;
+}
+
+static int server_listen(char *tcp, char *unixpath)
+{
+    struct addrinfo ask, *res, *ai;
+    struct sockaddr_un un;
+    char host[256], *port;
+    int fd = -1, opt = 1;
+
+    if (unixpath) {
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	snprintf(un.sun_path, sizeof(un.sun_path), "%s", unixpath);
+	unlink(unixpath);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (-1 == fd || -1 == bind(fd, (struct sockaddr*)&un, sizeof(un))) {
+	    fprintf(stderr, "bind %s: %s\n", unixpath, strerror(errno));
+	    exit(1);
+	}
+    } else {
+	snprintf(host, sizeof(host), "%s", tcp);
+	port = strrchr(host, ':');
+	if (port) {
+	    *(port++) = 0;
+	} else {
+	    port = tcp;
+	    strcpy(host, "localhost");
+	}
+	memset(&ask, 0, sizeof(ask));
+	ask.ai_flags    = AI_PASSIVE;
+	ask.ai_socktype = SOCK_STREAM;
+	if (0 != getaddrinfo(host[0] ? host : NULL, port, &ask, &res)) {
+	    fprintf(stderr, "getaddrinfo %s: failed\n", tcp);
+	    exit(1);
+	}
+	for (ai = res; NULL != ai; ai = ai->ai_next) {
+	    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	    if (-1 == fd)
+		continue;
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	    if (0 == bind(fd, ai->ai_addr, ai->ai_addrlen))
+		break;
+	    close(fd);
+	    fd = -1;
+	}
+	freeaddrinfo(res);
+	if (-1 == fd) {
+	    fprintf(stderr, "bind %s: %s\n", tcp, strerror(errno));
+	    exit(1);
+	}
+    }
+    if (-1 == listen(fd, 64)) {
+	fprintf(stderr, "listen: %s\n", strerror(errno));
+	exit(1);
+    }
+    return fd;
+}
+
+static void server_run(int sock)
+{
+    struct timeval tv = { .tv_sec = REQ_TIMEOUT };
+    pthread_attr_t attr;
+    pthread_t tid;
+    struct conn *c;
+    int fd;
+
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+	pthread_mutex_lock(&conn_lock);
+	while (conns >= CONN_MAX)
+	    pthread_cond_wait(&conn_cond, &conn_lock);
+	conns++;
+	pthread_mutex_unlock(&conn_lock);
+
+	fd = accept(sock, NULL, NULL);
+	if (-1 == fd) {
+	    if (errno != EINTR && errno != ECONNABORTED)
+		fprintf(stderr, "accept: %s\n", strerror(errno));
+	    conn_put();
+	    continue;
+	}
+	/* idle keep-alive connections go away after a while */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	c = malloc(sizeof(*c));
+	c->fd  = fd;
+	c->len = 0;
+	if (0 != pthread_create(&tid, &attr, http_conn, c)) {
+	    close(fd);
+	    free(c);
+	    conn_put();
+	}
+    }
 }
 
 /* -------------------------------------------------------------------------- */
@@ -98,11 +662,42 @@ int main(int argc, char *argv[])
     char filename[1024];
     char *document_root;
     char *path_info;
-    
+    char *tcp = NULL;
+    char *unixpath = NULL;
+    int c;
+
+    thumb_init();
     if (NULL == getenv("GATEWAY_INTERFACE")) {
-	fprintf(stderr,"%s", shellhelp);
-	fprintf(stderr,description,"$DOCUMENT_ROOT");
-	exit(1);
+	for (;;) {
+	    c = getopt(argc, argv, "hd:l:u:m:");
+	    if (c == -1)
+		break;
+	    switch (c) {
+	    case 'd':
+		server_root = optarg;
+		break;
+	    case 'l':
+		tcp = optarg;
+		break;
+	    case 'u':
+		unixpath = optarg;
+		break;
+	    case 'm':
+		thumb_limit = (size_t)atoi(optarg) * 1024 * 1024;
+		break;
+	    default:
+		server_root = NULL;
+		break;
+	    }
+	}
+	if (NULL == server_root || (NULL == tcp && NULL == unixpath)) {
+	    fprintf(stderr,"%s", shellhelp);
+	    fprintf(stderr,description,"$DOCUMENT_ROOT");
+	    fprintf(stderr,"%s", serverhelp);
+	    exit(1);
+	}
+	server_run(server_listen(tcp, unixpath));
+	return 0;
     }
 
     document_root = getenv("DOCUMENT_ROOT");
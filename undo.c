@@ -0,0 +1,434 @@
+/*
+ * undo/redo history for the ida viewer
+ *
+ * A saved image is an array of strips, STRIP_LINES lines each.  The
+ * history takes over the image it is handed and the strips point
+ * into its pixels, so saving copies nothing.  When the image derived
+ * from it is saved too the older level is rebased: strips outside
+ * the region the op modified are linked to the newer ones, the few
+ * modified ones get a copy of their own, and the older image is
+ * released.  Strips are refcounted and only ever changed in place,
+ * keeping their pixels, so links stay valid.  Undo and redo hand the
+ * restored image out by reference, the next push takes it back.  The
+ * memory used is capped, oldest undo levels are dropped first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pixman.h>
+
+#include "list.h"
+#include "readers.h"
+#include "undo.h"
+
+#define STRIP_LINES  32
+
+/* an image taken over by the history */
+struct ida_backing {
+    unsigned int          refcnt;
+    size_t                size;
+    struct ida_image      img;
+};
+
+struct ida_strip {
+    unsigned int          refcnt;
+    unsigned int          lines;
+    unsigned int          stride;
+    unsigned char         *data;   /* points into b ... */
+    struct ida_backing    *b;
+    size_t                size;    /* ... or is malloced, size bytes ... */
+    struct ida_strip      *link;   /* ... or the same pixels are there */
+};
+
+struct ida_hist_level {
+    struct list_head      list;
+    struct ida_image_info i;
+    unsigned int          nstrips;
+    struct ida_strip      **strips;
+    struct ida_backing    *b;      /* not rebased yet, strips are in b */
+    unsigned int          dirty1;  /* strips differing from the */
+    unsigned int          dirty2;  /* image derived from this one */
+};
+
+struct ida_history {
+    struct list_head      undo;   /* newest first */
+    struct list_head      redo;   /* newest first */
+    struct list_head      shown;  /* restored w/o copy, comes back soon */
+    unsigned int          nundo;
+    size_t                bytes;
+    size_t                limit;
+};
+
+/* ----------------------------------------------------------------------- */
+
+static void backing_put(struct ida_history *h, struct ida_backing *b)
+{
+    if (--b->refcnt)
+	return;
+    h->bytes -= b->size;
+    ida_image_free(&b->img);
+    free(b);
+}
+
+static void strip_put(struct ida_history *h, struct ida_strip *s)
+{
+    if (--s->refcnt)
+	return;
+    if (s->link) {
+	strip_put(h, s->link);
+    } else if (s->b) {
+	backing_put(h, s->b);
+    } else {
+	h->bytes -= s->size;
+	free(s->data);
+    }
+    free(s);
+}
+
+static struct ida_strip *strip_pixels(struct ida_strip *s)
+{
+    while (s->link)
+	s = s->link;
+    return s;
+}
+
+static void level_free(struct ida_history *h, struct ida_hist_level *l)
+{
+    unsigned int n;
+
+    list_del(&l->list);
+    for (n = 0; n < l->nstrips; n++)
+	strip_put(h, l->strips[n]);
+    if (l->b)
+	backing_put(h, l->b);
+    free(l->strips);
+    free(l);
+}
+
+static struct ida_hist_level *level_first(struct list_head *head)
+{
+    if (list_empty(head))
+	return NULL;
+    return list_entry(head->next, struct ida_hist_level, list);
+}
+
+static void level_dirty(struct ida_hist_level *l, struct ida_rect *dirty)
+{
+    l->dirty1 = 0;
+    l->dirty2 = l->nstrips;
+    if (dirty && dirty->y1 < dirty->y2) {
+	l->dirty1 = dirty->y1 / STRIP_LINES;
+	l->dirty2 = (dirty->y2 + STRIP_LINES - 1) / STRIP_LINES;
+	if (l->dirty2 > l->nstrips)
+	    l->dirty2 = l->nstrips;
+    }
+}
+
+/* take over img (clears img->p) */
+static struct ida_backing*
+backing_new(struct ida_history *h, struct ida_image *img)
+{
+    struct ida_backing *b;
+
+    b = malloc(sizeof(*b));
+    b->refcnt = 1;
+    b->size = (size_t)ida_image_stride(img) * img->i.height;
+    b->img = *img;
+    img->p = NULL;
+    h->bytes += b->size;
+    return b;
+}
+
+/* point strips into b, the pixels there must match */
+static void level_attach(struct ida_history *h, struct ida_hist_level *l,
+			 struct ida_backing *b)
+{
+    struct ida_strip *s, old;
+    unsigned int n;
+
+    for (n = 0; n < l->nstrips; n++) {
+	s = l->strips[n];
+	old = *s;
+	s->stride = ida_image_stride(&b->img);
+	s->data = ida_image_scanline(&b->img, n * STRIP_LINES);
+	s->b = b;
+	s->size = 0;
+	s->link = NULL;
+	b->refcnt++;
+	if (old.link) {
+	    strip_put(h, old.link);
+	} else if (old.b) {
+	    backing_put(h, old.b);
+	} else {
+	    h->bytes -= old.size;
+	    free(old.data);
+	}
+    }
+    l->b = b;
+}
+
+/* take over img (clears img->p), dirty: what the next op changes */
+static struct ida_hist_level*
+level_adopt(struct ida_history *h, struct ida_image *img,
+	    struct ida_rect *dirty)
+{
+    struct ida_hist_level *l;
+    struct ida_strip *s;
+    unsigned int n;
+
+    l = level_first(&h->shown);
+    if (l && l->b->img.p == img->p) {
+	/* we have that one already */
+	list_del(&l->list);
+	ida_image_free(img);
+	level_dirty(l, dirty);
+	return l;
+    }
+    if (l)
+	level_free(h, l);
+
+    l = malloc(sizeof(*l));
+    memset(l,0,sizeof(*l));
+    l->i = img->i;
+    l->nstrips = (l->i.height + STRIP_LINES - 1) / STRIP_LINES;
+    l->strips = malloc(l->nstrips * sizeof(*l->strips));
+    for (n = 0; n < l->nstrips; n++) {
+	s = malloc(sizeof(*s));
+	memset(s,0,sizeof(*s));
+	s->refcnt = 1;
+	s->lines = l->i.height - n * STRIP_LINES;
+	if (s->lines > STRIP_LINES)
+	    s->lines = STRIP_LINES;
+	l->strips[n] = s;
+    }
+    level_attach(h, l, backing_new(h, img));
+    l->i = l->b->img.i;  /* format may have changed */
+    level_dirty(l, dirty);
+    return l;
+}
+
+/*
+ * next holds the image derived from l.  Rebase l onto it, so l's own
+ * image can go away.  Older levels may link to l's strips, so they
+ * are updated in place.
+ */
+static void level_rebase(struct ida_history *h, struct ida_hist_level *l,
+			 struct ida_hist_level *next)
+{
+    struct ida_backing *b = l->b;
+    struct ida_strip *s;
+    unsigned int n, y, bpl;
+    unsigned char *data;
+
+    if (!b || !next->b)
+	return;
+    if (l->i.width  != next->i.width ||
+	l->i.height != next->i.height)
+	return;
+    if ((l->dirty2 - l->dirty1) * 2 > l->nstrips)
+	/* mostly changed, copying would not save anything */
+	return;
+
+    bpl = l->i.width * 3;
+    for (n = 0; n < l->nstrips; n++) {
+	s = l->strips[n];
+	if (s->b != b)
+	    continue;
+	if (n < l->dirty1 || n >= l->dirty2) {
+	    s->link = strip_pixels(next->strips[n]);
+	    s->link->refcnt++;
+	    s->data = NULL;
+	    s->b = NULL;
+	} else {
+	    data = malloc(s->lines * bpl);
+	    for (y = 0; y < s->lines; y++)
+		memcpy(data + y * bpl, s->data + y * s->stride, bpl);
+	    s->data = data;
+	    s->stride = bpl;
+	    s->b = NULL;
+	    s->size = s->lines * bpl;
+	    h->bytes += s->size;
+	}
+	backing_put(h, b);
+    }
+    l->b = NULL;
+    backing_put(h, b);
+}
+
+/*
+ * restore l into dst.  Unless l still has the image we took over a
+ * new one is assembled from the strips, and l is attached to it.
+ * Either way l and dst share the pixels afterwards.
+ */
+static void level_restore(struct ida_history *h, struct ida_hist_level *l,
+			  struct ida_image *dst)
+{
+    struct ida_image img;
+    struct ida_strip *s;
+    unsigned int n, y, bpl;
+
+    if (!l->b) {
+	memset(&img,0,sizeof(img));
+	img.i = l->i;
+	ida_image_alloc(&img);
+	bpl = l->i.width * 3;
+	for (n = 0; n < l->nstrips; n++) {
+	    s = strip_pixels(l->strips[n]);
+	    for (y = 0; y < s->lines; y++)
+		memcpy(ida_image_scanline(&img, n * STRIP_LINES + y),
+		       s->data + y * s->stride, bpl);
+	}
+	level_attach(h, l, backing_new(h, &img));
+    }
+    memset(dst,0,sizeof(*dst));
+    dst->i = l->i;
+    dst->p = pixman_image_ref(l->b->img.p);
+}
+
+/*
+ * restore l into dst.  It is kept aside, most likely dst comes back
+ * as is with the next push.  prev (holding the image shown so far)
+ * is rebased onto it.
+ */
+static void hist_show(struct ida_history *h, struct ida_hist_level *l,
+		      struct ida_hist_level *prev, struct ida_image *dst)
+{
+    level_restore(h, l, dst);
+    list_del(&l->list);
+    list_add(&l->list, &h->shown);
+    if (prev)
+	level_rebase(h, prev, l);
+}
+
+/* the current first level of head is derived from l (or vice versa) */
+static void hist_add(struct ida_history *h, struct list_head *head,
+		     struct ida_hist_level *l)
+{
+    struct ida_hist_level *prev;
+
+    if (NULL != (prev = level_first(head)))
+	level_rebase(h, prev, l);
+    list_add(&l->list, head);
+}
+
+static void hist_drop_redo(struct ida_history *h)
+{
+    while (!list_empty(&h->redo))
+	level_free(h, level_first(&h->redo));
+}
+
+static size_t hist_bytes(struct ida_history *h)
+{
+    struct ida_hist_level *l = level_first(&h->shown);
+
+    /* the image on screen doesn't count */
+    return h->bytes - (l ? l->b->size : 0);
+}
+
+static void hist_shrink(struct ida_history *h)
+{
+    /* keep one undo level at least, no matter how big */
+    while (hist_bytes(h) > h->limit && h->nundo > 1) {
+	level_free(h, list_entry(h->undo.prev, struct ida_hist_level, list));
+	h->nundo--;
+    }
+    while (hist_bytes(h) > h->limit && !list_empty(&h->redo))
+	level_free(h, list_entry(h->redo.prev, struct ida_hist_level, list));
+}
+
+/* ----------------------------------------------------------------------- */
+
+struct ida_history *hist_init(size_t limit)
+{
+    struct ida_history *h;
+
+    h = malloc(sizeof(*h));
+    memset(h,0,sizeof(*h));
+    INIT_LIST_HEAD(&h->undo);
+    INIT_LIST_HEAD(&h->redo);
+    INIT_LIST_HEAD(&h->shown);
+    h->limit = limit;
+    return h;
+}
+
+void hist_clear(struct ida_history *h)
+{
+    while (!list_empty(&h->undo))
+	level_free(h, level_first(&h->undo));
+    h->nundo = 0;
+    hist_drop_redo(h);
+    while (!list_empty(&h->shown))
+	level_free(h, level_first(&h->shown));
+}
+
+/*
+ * save img as new undo level, before an op derives the next image
+ * from it.  The history takes over img.  dirty is the region the op
+ * modifies (NULL: unknown), pixels outside must be left alone.
+ */
+void hist_push(struct ida_history *h, struct ida_image *img,
+	       struct ida_rect *dirty)
+{
+    hist_drop_redo(h);
+    hist_add(h, &h->undo, level_adopt(h, img, dirty));
+    h->nundo++;
+    hist_shrink(h);
+}
+
+/* move cur to redo (taking it over), restore the last undo level into dst */
+int hist_undo(struct ida_history *h, struct ida_image *cur,
+	      struct ida_image *dst)
+{
+    struct ida_hist_level *l, *r;
+
+    if (NULL == (l = level_first(&h->undo)))
+	return -1;
+    r = level_adopt(h, cur, NULL);
+    r->dirty1 = l->dirty1;
+    r->dirty2 = l->dirty2;
+    hist_add(h, &h->redo, r);
+    hist_show(h, l, r, dst);
+    h->nundo--;
+    return 0;
+}
+
+/* move cur to undo (taking it over), restore the last redo level into dst */
+int hist_redo(struct ida_history *h, struct ida_image *cur,
+	      struct ida_image *dst)
+{
+    struct ida_hist_level *l, *u;
+
+    if (NULL == (l = level_first(&h->redo)))
+	return -1;
+    u = level_adopt(h, cur, NULL);
+    u->dirty1 = l->dirty1;
+    u->dirty2 = l->dirty2;
+    hist_add(h, &h->undo, u);
+    h->nundo++;
+    hist_show(h, l, u, dst);
+    hist_shrink(h);
+    return 0;
+}
+
+/* take the last undo level back into dst, it is gone then */
+int hist_pop(struct ida_history *h, struct ida_image *dst)
+{
+    struct ida_hist_level *l;
+
+    if (NULL == (l = level_first(&h->undo)))
+	return -1;
+    hist_drop_redo(h);
+    while (!list_empty(&h->shown))
+	level_free(h, level_first(&h->shown));
+    hist_show(h, l, NULL, dst);
+    h->nundo--;
+    return 0;
+}
+
+void hist_fini(struct ida_history *h)
+{
+    hist_clear(h);
+    free(h);
+}
@@ -0,0 +1,20 @@
+/*
+ * undo/redo history for the ida viewer
+ *
+ * Images are kept as strips of lines.  The history takes over the
+ * images passed in, strips are refcounted and shared between levels
+ * as long as the pixels are unchanged, so each level costs only the
+ * region an op actually modified.
+ */
+struct ida_history;
+
+struct ida_history *hist_init(size_t limit);
+void hist_clear(struct ida_history *h);
+void hist_push(struct ida_history *h, struct ida_image *img,
+	       struct ida_rect *dirty);
+int hist_undo(struct ida_history *h, struct ida_image *cur,
+	      struct ida_image *dst);
+int hist_redo(struct ida_history *h, struct ida_image *cur,
+	      struct ida_image *dst);
+int hist_pop(struct ida_history *h, struct ida_image *dst);
+void hist_fini(struct ida_history *h);
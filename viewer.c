@@ -2,10 +2,12 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <math.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
@@ -18,6 +20,9 @@
 #include "x11.h"
 #include "readers.h"
 #include "viewer.h"
+#include "zoom.h"
+#include "op.h"
+#include "undo.h"
 #include "hex.h"
 #include "idaconfig.h"
 
@@ -37,6 +42,7 @@
 #define RUBBER_INTERVAL 100
 
 #define PROCESS_LINES    16
+#define BAND_LINES       64  /* ops with a band callback */
 
 Cursor ptrs[POINTER_COUNT];
 
@@ -44,23 +50,16 @@ Cursor ptrs[POINTER_COUNT];
 
 Pixmap image_to_pixmap(struct ida_image *img)
 {
-    unsigned char *src;
     XImage *ximage;
     void *shm;
     Pixmap pix;
     GC gc;
-    unsigned int x,y;
+    unsigned int y;
 
     ximage = x11_create_ximage(app_shell, img->i.width, img->i.height, &shm);
-    for (y = 0; y < img->i.height; y++) {
-	src = ida_image_scanline(img, y);
-        for (x = 0; x < img->i.width; x++, src += 3) {
-            pix = x11_lut_red[src[0]] |
-                x11_lut_green[src[1]] |
-                x11_lut_blue[src[2]];
-            XPutPixel(ximage, x, y, pix);
-	}
-    }
+    for (y = 0; y < img->i.height; y++)
+	x11_rgb_to_ximage(ximage, y, ida_image_scanline(img, y),
+			  img->i.width, 1);
     pix = XCreatePixmap(dpy,XtWindow(app_shell),img->i.width, img->i.height,
 			DefaultDepthOfScreen(XtScreen(app_shell)));
     gc = XCreateGC(dpy, pix, 0, NULL);
@@ -72,84 +71,55 @@ Pixmap image_to_pixmap(struct ida_image *img)
 
 /* ----------------------------------------------------------------------- */
 
+/*
+ * zoom in is done in integer steps (2x, 3x, ...),
+ * zoom out in half steps (2/3, 2/4, 2/5, ...).
+ */
 int viewer_i2s(int zoom, int val)
 {
     if (0 > zoom)
-	return val/(-zoom+1);
+	return val*2/(-zoom+2);
     if (0 < zoom)
 	return val*(zoom+1);
     return val;
 }
 
+int viewer_s2i(int zoom, int val)
+{
+    if (0 > zoom)
+	return val*(-zoom+2)/2;
+    if (0 < zoom)
+	return val/(zoom+1);
+    return val;
+}
+
 /* ----------------------------------------------------------------------- */
 
 static void
 viewer_renderline(struct ida_viewer *ida, char *scanline)
 {
-    unsigned char *src;
-    unsigned long pix;
-    unsigned int x,s,scrline;
-
-    src = scanline;
+    unsigned int x,s,scrline,bpl;
 
     if (0 == ida->zoom) {
 	/* as-is */
-        for (x = 0; x < ida->scrwidth; x++, src += 3) {
-            pix = x11_lut_red[src[0]] |
-                x11_lut_green[src[1]] |
-                x11_lut_blue[src[2]];
-            XPutPixel(ida->ximage, x, ida->line, pix);
-	}
+	x11_rgb_to_ximage(ida->ximage, ida->line, scanline, ida->scrwidth, 1);
 
     } else if (ida->zoom < 0) {
-	/* zoom out */
-	s = -ida->zoom+1;
-	if (s-1 != (ida->line % s))
-	    return;
-	scrline = ida->line/s;
-#if 0
-        /* just drop pixels */
-        for (x = 0; x < ida->scrwidth; x++, src += 3*s) {
-            pix = x11_lut_red[src[0]] |
-                x11_lut_green[src[1]] |
-                x11_lut_blue[src[2]];
-            XPutPixel(ida->ximage, x, scrline, pix);
-        }
-#else
-        /* horizontal interpolation (vertical is much harder ...) */
-        for (x = 0; x < ida->scrwidth; x++, src += 3*s) {
-            int red,green,blue,count,ix;
-            red   = 0;
-            green = 0;
-            blue  = 0;
-            count = 0;
-            for (ix = 0; ix < 3*s; ix += 3) {
-                red   += src[ix+0];
-                green += src[ix+1]; 
-                blue  += src[ix+2]; 
-                count += 1;
-            }
-            pix = x11_lut_red[red/count] |
-                x11_lut_green[green/count] |
-                x11_lut_blue[blue/count];
-            XPutPixel(ida->ximage, x, scrline, pix);
-        }
-#endif
+	/* zoom out: box filter, completes a screen line every few lines */
+	if (zoom_line(ida->zoomout, scanline, ida->line,
+		      ida->rgb_line, &scrline))
+	    x11_rgb_to_ximage(ida->ximage, scrline, ida->rgb_line,
+			      ida->scrwidth, 1);
 
     } else {
-	/* zoom in */
+	/* zoom in: convert one line, copy it for the others */
 	s = ida->zoom+1;
-        for (scrline = ida->line*s; scrline < ida->line*s+s; scrline++) {
-            src = scanline;
-            for (x = 0; x < ida->scrwidth; src += 3) {
-                unsigned int i;
-                pix = x11_lut_red[src[0]] |
-                    x11_lut_green[src[1]] |
-                    x11_lut_blue[src[2]];
-                for (i = 0; i < s; i++, x++)
-                    XPutPixel(ida->ximage, x, scrline, pix);
-            }
-	}
+	scrline = ida->line*s;
+	bpl = ida->ximage->bytes_per_line;
+	x11_rgb_to_ximage(ida->ximage, scrline, scanline, ida->img.i.width, s);
+	for (x = 1; x < s; x++)
+	    memcpy(ida->ximage->data + (scrline+x) * bpl,
+		   ida->ximage->data + scrline * bpl, bpl);
     }
 }
 
@@ -160,87 +130,294 @@ viewer_cleanup(struct ida_viewer *ida)
 {
     if (ida->load_read) {
 	ida->load_done(ida->load_data);
-	ida->load_line = 0;
 	ida->load_read = NULL;
+	ida->load_pass = NULL;
 	ida->load_done = NULL;
 	ida->load_data = NULL;
     }
     if (ida->op_work) {
 	ida->op_done(ida->op_data);
-	ida->op_line = 0;
 	ida->op_work = NULL;
+	ida->op_band = NULL;
 	ida->op_done = NULL;
 	ida->op_data = NULL;
-	if (ida->op_src.p) {
-	    if (ida->undo.p) {
-		fprintf(stderr,"have undo buffer /* shouldn't happen */");
-		ida_image_free(&ida->undo);
+	if (ida->op_src.p)
+	    hist_push(ida->hist, &ida->op_src,
+		      ida->op_in_rect ? &ida->op_rect : NULL);
+    }
+}
+
+/* ----------------------------------------------------------------------- */
+
+/*
+ * Image loading and processing runs in a worker thread.  It fills
+ * ida->img line by line, publishes the number of completed lines in
+ * thread_line and kicks the main thread via pipe.  The main thread
+ * renders the lines available and does all the X11 calls.
+ *
+ * Progressive images are loaded in multiple passes, thread_line keeps
+ * counting then (pass * height + line), so the main thread can notice
+ * a new pass started and render the image again from the top.
+ */
+static void
+viewer_thread_kick(struct ida_viewer *ida)
+{
+    char dummy = 0;
+
+    /* nonblocking, a full pipe has wakeups pending already */
+    if (-1 != ida->thread_pipe[1])
+	write(ida->thread_pipe[1], &dummy, 1);
+}
+
+static void
+viewer_proxy_line(struct ida_viewer *ida, unsigned char *scanline,
+		  unsigned int y)
+{
+    unsigned int dy;
+
+    if (zoom_line(ida->proxy_zoom, scanline, y, ida->proxy_line, &dy))
+	memcpy(ida_image_scanline(&ida->op_proxy, dy), ida->proxy_line,
+	       ida->op_proxy.i.width * 3);
+}
+
+/* proxy for the preview complete, or cancelled */
+static void
+viewer_proxy_done(struct ida_viewer *ida, int cancel)
+{
+    zoom_fini(ida->proxy_zoom);
+    ida->proxy_zoom = NULL;
+    free(ida->proxy_line);
+    ida->proxy_line = NULL;
+    if (cancel)
+	ida_image_free(&ida->op_proxy);
+}
+
+static void*
+viewer_thread(void *arg)
+{
+    struct ida_viewer *ida = arg;
+    unsigned int y, n, base = 0, kicked = 0;
+    char *scanline;
+
+    for (;;) {
+	for (y = 0; y < ida->img.i.height; y += n) {
+	    if (__atomic_load_n(&ida->thread_cancel, __ATOMIC_RELAXED))
+		goto out;
+	    n = 1;
+	    scanline = ida_image_scanline(&ida->img, y);
+	    if (ida->load_read)
+		ida->load_read(scanline,y,ida->load_data);
+	    else if (ida->proxy_zoom)
+		viewer_proxy_line(ida,scanline,y);
+	    else if (ida->op_band) {
+		n = ida->img.i.height - y;
+		if (n > BAND_LINES)
+		    n = BAND_LINES;
+		ida->op_band(&ida->op_src,&ida->op_rect,scanline,
+			     ida_image_stride(&ida->img),y,n,ida->op_data);
+	    } else
+		ida->op_work(&ida->op_src,&ida->op_rect,
+			     scanline,y,ida->op_data);
+	    __atomic_store_n(&ida->thread_line, base+y+n, __ATOMIC_RELEASE);
+	    if (base+y+n - kicked >= PROCESS_LINES) {
+		viewer_thread_kick(ida);
+		kicked = base+y+n;
 	    }
-	    ida->undo = ida->op_src;
-	    memset(&ida->op_src,0,sizeof(ida->op_src));
 	}
+	if (!ida->load_pass || !ida->load_pass(ida->load_data))
+	    break;
+	/* show the complete pass before refining it */
+	viewer_thread_kick(ida);
+	base += ida->img.i.height;
+	kicked = base;
     }
+ out:
+    __atomic_store_n(&ida->thread_done, 1, __ATOMIC_RELEASE);
+    viewer_thread_kick(ida);
+    return NULL;
 }
 
+static void
+viewer_thread_stop(struct ida_viewer *ida, int cancel)
+{
+    if (cancel)
+	__atomic_store_n(&ida->thread_cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(ida->thread, NULL);
+    XtRemoveInput(ida->thread_input);
+    close(ida->thread_pipe[0]);
+    close(ida->thread_pipe[1]);
+    ida->thread_running = 0;
+}
+
+static void
+viewer_thread_join(struct ida_viewer *ida, int cancel)
+{
+    if (!ida->thread_running)
+	return;
+
+    viewer_thread_stop(ida, cancel);
+    if (ida->proxy_zoom)
+	viewer_proxy_done(ida, cancel);
+    else
+	viewer_cleanup(ida);
+}
+
+/* lines of the current pass ready, switches to a newer pass if needed */
+static unsigned int
+viewer_thread_avail(struct ida_viewer *ida)
+{
+    unsigned int avail, pass;
+
+    avail = __atomic_load_n(&ida->thread_line, __ATOMIC_ACQUIRE);
+    pass = avail ? (avail-1) / ida->img.i.height : 0;
+    if (pass > ida->pass) {
+	ida->pass = pass;
+	ida->line = 0;
+    }
+    return avail - ida->pass * ida->img.i.height;
+}
+
+static Boolean viewer_workproc(XtPointer client_data);
+
+static void
+viewer_input(XtPointer client_data, int *src, XtInputId *id)
+{
+    struct ida_viewer *ida = client_data;
+    char buf[64];
+    int done;
+
+    while (read(ida->thread_pipe[0], buf, sizeof(buf)) > 0)
+	/* drain */;
+    done = __atomic_load_n(&ida->thread_done, __ATOMIC_ACQUIRE);
+    viewer_thread_avail(ida);
+    if (done)
+	viewer_thread_join(ida, 0);
+
+    /* (re-) start rendering */
+    if (!ida->wproc && (done || ida->line < ida->img.i.height))
+	ida->wproc = XtAppAddWorkProc(app_context,viewer_workproc,ida);
+}
+
+static void
+viewer_thread_start(struct ida_viewer *ida)
+{
+    if (ida->thread_running)
+	return;
+    if (!ida->load_read && !ida->proxy_zoom &&
+	!(ida->op_work && 0 == ida->op_preview))
+	return;
+
+    ida->thread_line   = 0;
+    ida->thread_cancel = 0;
+    ida->pass          = 0;
+    ida->thread_done   = 0;
+    if (-1 == pipe2(ida->thread_pipe, O_NONBLOCK | O_CLOEXEC)) {
+	fprintf(stderr,"pipe: %s\n",strerror(errno));
+	goto sync;
+    }
+    errno = pthread_create(&ida->thread, NULL, viewer_thread, ida);
+    if (0 != errno) {
+	fprintf(stderr,"pthread_create: %s\n",strerror(errno));
+	close(ida->thread_pipe[0]);
+	close(ida->thread_pipe[1]);
+	goto sync;
+    }
+    ida->thread_input = XtAppAddInput(app_context, ida->thread_pipe[0],
+				      (XtPointer)XtInputReadMask,
+				      viewer_input, ida);
+    ida->thread_running = 1;
+    return;
+
+ sync:
+    /* no thread, do it the slow way */
+    ida->thread_pipe[0] = -1;
+    ida->thread_pipe[1] = -1;
+    viewer_thread(ida);
+    if (ida->proxy_zoom)
+	viewer_proxy_done(ida, 0);
+    else
+	viewer_cleanup(ida);
+}
+
+/* ----------------------------------------------------------------------- */
+
 static Boolean
 viewer_workproc(XtPointer client_data)
 {
     struct ida_viewer *ida = client_data;
-    unsigned int start,end;
+    unsigned int start,end,limit,avail;
+    int y1,y2;
     char *scanline;
 
-    start = ida->line;
-    end   = ida->line + ida->steps;
-    if (end > ida->img.i.height)
-	end = ida->img.i.height;
-
-    /* image loading */
-    if (ida->load_read) {
-	for (ida->line = start; ida->line < end; ida->line++) {
-	    if (ida->load_line > ida->line)
-		continue;
-	    scanline = ida_image_scanline(&ida->img, ida->load_line);
-	    ida->load_read(scanline,ida->load_line,ida->load_data);
-	    ida->load_line++;
-	}
+    if (ida->proxy_zoom) {
+	/* preview waits for the proxy, viewer_input restarts us */
+	ida->wproc = 0;
+	return TRUE;
     }
 
-    /* image processing */
-    if (ida->op_work  &&  0 == ida->op_preview) {
-	for (ida->line = start; ida->line < end; ida->line++) {
-	    if (ida->op_line > ida->line)
-		continue;
-	    scanline = ida_image_scanline(&ida->img, ida->op_line);
-	    ida->op_work(&ida->op_src,&ida->op_rect,
-			scanline,ida->op_line,ida->op_data);
-	    ida->op_line++;
+    limit = ida->img.i.height;
+    if (ida->op_work && ida->op_preview)
+	limit = ida->op_preview_end;
+    avail = 0;
+    if (ida->thread_running)
+	avail = viewer_thread_avail(ida);
+    start = ida->line;
+    end   = ida->line + ida->steps;
+    if (end > limit)
+	end = limit;
+    if (ida->thread_running) {
+	if (end > avail)
+	    end = avail;
+	if (start == end) {
+	    /* wait for the worker, viewer_input restarts us */
+	    ida->wproc = 0;
+	    return TRUE;
 	}
     }
 
     /* image rendering */
-    if (ida->op_work  && ida->op_preview) {
+    if (ida->op_work && ida->op_preview && ida->op_preview_proxy) {
+	/* proxy is screen sized already */
 	for (ida->line = start; ida->line < end; ida->line++) {
-	    ida->op_line = ida->line;
-	    ida->op_work(&ida->img,&ida->op_rect,
+	    ida->op_work(&ida->op_proxy,&ida->op_rect,
 			 ida->preview_line,ida->line,ida->op_data);
-	    viewer_renderline(ida,ida->preview_line);
+	    x11_rgb_to_ximage(ida->ximage, ida->line, ida->preview_line,
+			      ida->scrwidth, 1);
 	}
+	y1 = start;
+	y2 = end;
     } else {
-	for (ida->line = start; ida->line < end; ida->line++) {
-	    scanline = ida_image_scanline(&ida->img, ida->line);
-	    viewer_renderline(ida,scanline);
+	if (ida->op_work && ida->op_preview) {
+	    for (ida->line = start; ida->line < end; ida->line++) {
+		ida->op_work(&ida->img,&ida->op_rect,
+			     ida->preview_line,ida->line,ida->op_data);
+		viewer_renderline(ida,ida->preview_line);
+	    }
+	} else {
+	    for (ida->line = start; ida->line < end; ida->line++) {
+		scanline = ida_image_scanline(&ida->img, ida->line);
+		viewer_renderline(ida,scanline);
+	    }
+	    /* out-of-core images: the ximage has a copy now */
+	    ida_image_release(&ida->img, start, end);
 	}
+	y1 = viewer_i2s(ida->zoom,start);
+	y2 = viewer_i2s(ida->zoom,end);
+	if (ida->zoom < 0 && y1 > 0)
+	    y1--; /* completed by the first line */
     }
 
     /* trigger redraw */
-    XClearArea(XtDisplay(ida->widget), XtWindow(ida->widget),
-	       0, viewer_i2s(ida->zoom,start),
-	       ida->scrwidth, viewer_i2s(ida->zoom,ida->steps), True);
+    if (y2 > y1)
+	XClearArea(XtDisplay(ida->widget), XtWindow(ida->widget),
+		   0, y1, ida->scrwidth, y2 - y1, True);
 
     /* all done ? */
-    if (ida->line == ida->img.i.height) {
-	viewer_cleanup(ida);
+    if (ida->line == limit) {
 	ida->wproc = 0;
+	if (ida->thread_running)
+	    return TRUE; /* finished by viewer_input */
+	viewer_cleanup(ida);
 #if 1
 	if (args.testload)
 	    XtCallActionProc(ida->widget,"Next",NULL,NULL,0);
@@ -253,6 +430,7 @@ viewer_workproc(XtPointer client_data)
 static void viewer_workstart(struct ida_viewer *ida)
 {
     /* (re-) start */
+    viewer_thread_start(ida);
     ida->line  = 0;
     if (!ida->wproc)
 	ida->wproc = XtAppAddWorkProc(app_context,viewer_workproc,ida);
@@ -260,35 +438,18 @@ static void viewer_workstart(struct ida_viewer *ida)
 
 static void viewer_workstop(struct ida_viewer *ida)
 {
-    if (!ida->wproc)
-	return;
-
+    viewer_thread_join(ida, 1);
+    if (ida->wproc) {
+	XtRemoveWorkProc(ida->wproc);
+	ida->wproc = 0;
+    }
+    /* a preview might wait for its proxy, without workproc */
     viewer_cleanup(ida);
-    XtRemoveWorkProc(ida->wproc);
-    ida->wproc = 0;
 }
 
 static void viewer_workfinish(struct ida_viewer *ida)
 {
-    char *scanline;
-
-    if (ida->load_read) {
-	for (ida->line = ida->load_line; ida->line < ida->img.i.height;) {
-	    scanline = ida_image_scanline(&ida->img, ida->line);
-	    ida->load_read(scanline,ida->load_line,ida->load_data);
-	    ida->line++;
-	    ida->load_line++;
-	}
-    }
-    if (ida->op_work && 0 == ida->op_preview) {
-	for (ida->line = ida->op_line; ida->line < ida->img.i.height;) {
-	    scanline = ida_image_scanline(&ida->img, ida->line);
-	    ida->op_work(&ida->op_src,&ida->op_rect,
-			scanline,ida->op_line,ida->op_data);
-	    ida->line++;
-	    ida->op_line++;
-	}
-    }
+    viewer_thread_join(ida, 0);
     viewer_workstop(ida);
 }
 
@@ -297,6 +458,10 @@ static void viewer_workfinish(struct ida_viewer *ida)
 static void
 viewer_new_view(struct ida_viewer *ida)
 {
+    if (ida->op_work && ida->op_preview)
+	viewer_workstop(ida);
+    if (NULL != ida->op_proxy.p)
+	ida_image_free(&ida->op_proxy);
     if (NULL != ida->ximage)
 	x11_destroy_ximage(ida->widget,ida->ximage,ida->ximage_shm);
     if (NULL != ida->rgb_line)
@@ -305,13 +470,17 @@ viewer_new_view(struct ida_viewer *ida)
 	free(ida->dither_line);
     if (NULL != ida->preview_line)
 	free(ida->preview_line);
+    if (NULL != ida->zoomout)
+	zoom_fini(ida->zoomout);
+    ida->zoomout = NULL;
 
     ida->scrwidth  = viewer_i2s(ida->zoom,ida->img.i.width);
     ida->scrheight = viewer_i2s(ida->zoom,ida->img.i.height);
     ida->steps = PROCESS_LINES;
-    if (ida->zoom < 0)
-	while ((ida->steps % (-ida->zoom+1)) != 0)
-	    ida->steps++;
+    if (ida->zoom < 0) {
+	ida->zoomout = zoom_init(ida->img.i.width, 2, -ida->zoom+2);
+	ida->scrwidth = zoom_width(ida->zoomout);
+    }
 
     ida->rgb_line = malloc(ida->scrwidth*3);
     ida->dither_line = malloc(ida->scrwidth);
@@ -481,8 +650,8 @@ viewer_mouse(Widget widget, XtPointer client_data,
 	ida->state = viewer_pos2state(ida,eb->x,eb->y);
 	switch (ida->state) {
 	case POINTER_PICK:
-	    x = viewer_i2s(-ida->zoom,eb->x);
-	    y = viewer_i2s(-ida->zoom,eb->y);
+	    x = viewer_s2i(ida->zoom,eb->x);
+	    y = viewer_s2i(ida->zoom,eb->y);
             pix = ida_image_scanline(&ida->img, y) + x * 3;
 	    ida->pick_cb(x,y,pix,ida->pick_data);
 	    ida->pick_cb = NULL;
@@ -492,24 +661,24 @@ viewer_mouse(Widget widget, XtPointer client_data,
 	    break;
 	case RUBBER_NEW:
 	    ida->mask = 0x33333333;
-	    ida->current.x1 = ida->current.x2 = viewer_i2s(-ida->zoom,eb->x);
-	    ida->current.y1 = ida->current.y2 = viewer_i2s(-ida->zoom,eb->y);
+	    ida->current.x1 = ida->current.x2 = viewer_s2i(ida->zoom,eb->x);
+	    ida->current.y1 = ida->current.y2 = viewer_s2i(ida->zoom,eb->y);
 	    break;
 	case RUBBER_MOVE:
-	    ida->last_x = viewer_i2s(-ida->zoom,eb->x);
-	    ida->last_y = viewer_i2s(-ida->zoom,eb->y);
+	    ida->last_x = viewer_s2i(ida->zoom,eb->x);
+	    ida->last_y = viewer_s2i(ida->zoom,eb->y);
 	    break;
 	case RUBBER_X1:
-	    ida->current.x1 = viewer_i2s(-ida->zoom,eb->x);
+	    ida->current.x1 = viewer_s2i(ida->zoom,eb->x);
 	    break;
 	case RUBBER_Y1:
-	    ida->current.y1 = viewer_i2s(-ida->zoom,eb->y);
+	    ida->current.y1 = viewer_s2i(ida->zoom,eb->y);
 	    break;
 	case RUBBER_X2:
-	    ida->current.x2 = viewer_i2s(-ida->zoom,eb->x);
+	    ida->current.x2 = viewer_s2i(ida->zoom,eb->x);
 	    break;
 	case RUBBER_Y2:
-	    ida->current.y2 = viewer_i2s(-ida->zoom,eb->y);
+	    ida->current.y2 = viewer_s2i(ida->zoom,eb->y);
 	    break;
 	}
 	state = ida->state;
@@ -525,8 +694,8 @@ viewer_mouse(Widget widget, XtPointer client_data,
 	}
 	switch (ida->state) {
 	case RUBBER_NEW:
-	    ida->current.x2 = viewer_i2s(-ida->zoom,em->x);
-	    ida->current.y2 = viewer_i2s(-ida->zoom,em->y);
+	    ida->current.x2 = viewer_s2i(ida->zoom,em->x);
+	    ida->current.y2 = viewer_s2i(ida->zoom,em->y);
 	    if (em->state & ShiftMask) {
 		/* square selection */
 		int xlen,ylen;
@@ -546,8 +715,8 @@ viewer_mouse(Widget widget, XtPointer client_data,
 	    }
 	    break;
 	case RUBBER_MOVE:
-	    x = viewer_i2s(-ida->zoom,em->x);
-	    y = viewer_i2s(-ida->zoom,em->y);
+	    x = viewer_s2i(ida->zoom,em->x);
+	    y = viewer_s2i(ida->zoom,em->y);
 	    ida->current.x1 += (x - ida->last_x);
 	    ida->current.x2 += (x - ida->last_x);
 	    ida->current.y1 += (y - ida->last_y);
@@ -556,16 +725,16 @@ viewer_mouse(Widget widget, XtPointer client_data,
 	    ida->last_y = y;
 	    break;
 	case RUBBER_X1:
-	    ida->current.x1 = viewer_i2s(-ida->zoom,em->x);
+	    ida->current.x1 = viewer_s2i(ida->zoom,em->x);
 	    break;
 	case RUBBER_Y1:
-	    ida->current.y1 = viewer_i2s(-ida->zoom,em->y);
+	    ida->current.y1 = viewer_s2i(ida->zoom,em->y);
 	    break;
 	case RUBBER_X2:
-	    ida->current.x2 = viewer_i2s(-ida->zoom,em->x);
+	    ida->current.x2 = viewer_s2i(ida->zoom,em->x);
 	    break;
 	case RUBBER_Y2:
-	    ida->current.y2 = viewer_i2s(-ida->zoom,em->y);
+	    ida->current.y2 = viewer_s2i(ida->zoom,em->y);
 	    break;
 	}
 	state = ida->state;
@@ -650,69 +819,140 @@ viewer_setzoom(struct ida_viewer *ida, int zoom)
 }
 
 static void
-viewer_op_rect(struct ida_viewer *ida)
+viewer_op_rect(struct ida_viewer *ida, struct ida_rect *rect)
 {
     if (ida->current.x1 == ida->current.x2 &&
 	ida->current.y1 == ida->current.y2) {
 	/* full image */
-	ida->op_rect.x1 = 0;
-	ida->op_rect.x2 = ida->img.i.width;
-	ida->op_rect.y1 = 0;
-	ida->op_rect.y2 = ida->img.i.height;
+	rect->x1 = 0;
+	rect->x2 = ida->img.i.width;
+	rect->y1 = 0;
+	rect->y2 = ida->img.i.height;
 	return;
     } else {
 	/* have selection */
 	if (ida->current.x1 < ida->current.x2) {
-	    ida->op_rect.x1 = ida->current.x1;
-	    ida->op_rect.x2 = ida->current.x2;
+	    rect->x1 = ida->current.x1;
+	    rect->x2 = ida->current.x2;
 	} else {
-	    ida->op_rect.x1 = ida->current.x2;
-	    ida->op_rect.x2 = ida->current.x1;
+	    rect->x1 = ida->current.x2;
+	    rect->x2 = ida->current.x1;
 	}
 	if (ida->current.y1 < ida->current.y2) {
-	    ida->op_rect.y1 = ida->current.y1;
-	    ida->op_rect.y2 = ida->current.y2;
+	    rect->y1 = ida->current.y1;
+	    rect->y2 = ida->current.y2;
 	} else {
-	    ida->op_rect.y1 = ida->current.y2;
-	    ida->op_rect.y2 = ida->current.y1;
+	    rect->y1 = ida->current.y2;
+	    rect->y2 = ida->current.y1;
 	}
     }
 }
 
+/*
+ * Consecutive point ops on the same selection form a run, which is a
+ * single undo step.  Each one is merged into the lookup table of the
+ * run, which then is applied to the image the run started with: if
+ * that pass is still going it is restarted, otherwise the image is
+ * taken back from the history.  So a quick chain of tone adjustments
+ * costs a single pass, and how they are grouped for undo depends on
+ * the sequence of ops only, not on timing.  Any other op, undo/redo
+ * or a new image ends the run.
+ */
+static void
+viewer_run_end(struct ida_viewer *ida)
+{
+    free(ida->op_run);
+    ida->op_run = NULL;
+}
+
+static int
+viewer_fuse_op(struct ida_viewer *ida, struct op_points *pts)
+{
+    struct ida_rect rect;
+    struct ida_image src;
+
+    if (!ida->op_run)
+	return -1;
+    viewer_op_rect(ida, &rect);
+    if (0 != memcmp(&rect, &ida->op_run_rect, sizeof(rect)))
+	return -1;
+    op_points_merge(ida->op_run, pts);
+
+    if (ida->thread_running && !ida->op_preview &&
+	ida->op_work == desc_points.work) {
+	if (debug)
+	    fprintf(stderr,"viewer_fuse_op: merge into running op\n");
+	viewer_thread_stop(ida, 1);
+	memcpy(ida->op_data, ida->op_run, sizeof(*pts));
+	viewer_workstart(ida);
+	return 0;
+    }
+
+    viewer_workfinish(ida);
+    if (-1 == hist_pop(ida->hist, &src))
+	return -1;
+    if (debug)
+	fprintf(stderr,"viewer_fuse_op: merge into finished op\n");
+    ida_image_free(&ida->img);
+    ida->img = src;
+    *pts = *ida->op_run;
+    return 1;
+}
+
 int
 viewer_start_op(struct ida_viewer *ida, struct ida_op *op, void *parm)
 {
+    struct op_points pts;
     struct ida_image dst;
 
+    if (op->point) {
+	/* run as lookup table pass, see op.c */
+	op->point(&pts, parm);
+	switch (viewer_fuse_op(ida, &pts)) {
+	case 0:
+	    return 0;
+	case -1:
+	    /* start a new run */
+	    viewer_run_end(ida);
+	    ida->op_run = malloc(sizeof(pts));
+	    *ida->op_run = pts;
+	    viewer_op_rect(ida, &ida->op_run_rect);
+	    break;
+	}
+	op = &desc_points;
+	parm = &pts;
+    } else {
+	viewer_run_end(ida);
+    }
+
     ptr_busy();
     viewer_workfinish(ida);
     viewer_rubber_off(ida);
 
     /* try init */
-    viewer_op_rect(ida);
+    viewer_op_rect(ida, &ida->op_rect);
     if (debug)
 	fprintf(stderr,"viewer_start_op: init %s(%p)\n",op->name,parm);
     memset(&dst, 0, sizeof(dst));
     ida->op_data = op->init(&ida->img,&ida->op_rect,&dst.i,parm);
     ptr_idle();
-    if (NULL == ida->op_data)
+    if (NULL == ida->op_data) {
+	viewer_run_end(ida);
 	return -1;
+    }
     ida_image_alloc(&dst);
 
     /* prepare background processing */
-    if (ida->undo.p) {
-	ida_image_free(&ida->undo);
-	memset(&ida->undo,0,sizeof(ida->undo));
-    }
     if (ida->op_src.p) {
 	fprintf(stderr,"have op_src buffer /* shouldn't happen */");
 	ida_image_free(&ida->op_src);
     }
     ida->op_src = ida->img;
     ida->img = dst;
-    ida->op_line = 0;
     ida->op_work = op->work;
+    ida->op_band = op->band;
     ida->op_done = op->done;
+    ida->op_in_rect = op->in_rect;
     ida->op_preview = 0;
 
     if (ida->op_src.i.width  != ida->img.i.width ||
@@ -724,22 +964,26 @@ viewer_start_op(struct ida_viewer *ida, struct ida_op *op, void *parm)
     return 0;
 }
 
-int
-viewer_undo(struct ida_viewer *ida)
+static int
+viewer_history(struct ida_viewer *ida, int redo)
 {
-    int resize;
+    struct ida_image prev;
+    int resize, rc;
 
     viewer_workfinish(ida);
-    if (NULL == ida->undo.p)
+    viewer_run_end(ida);
+    if (redo)
+	rc = hist_redo(ida->hist, &ida->img, &prev);
+    else
+	rc = hist_undo(ida->hist, &ida->img, &prev);
+    if (-1 == rc)
 	return -1;
     viewer_rubber_off(ida);
     memset(&ida->current,0,sizeof(ida->current));
 
-    resize = (ida->undo.i.width  != ida->img.i.width ||
-	      ida->undo.i.height != ida->img.i.height);
-    ida_image_free(&ida->img);
-    ida->img = ida->undo;
-    memset(&ida->undo,0,sizeof(ida->undo));
+    resize = (prev.i.width  != ida->img.i.width ||
+	      prev.i.height != ida->img.i.height);
+    ida->img = prev;  /* history took over the old one */
 
     if (resize)
 	viewer_autozoom(ida);
@@ -748,26 +992,131 @@ viewer_undo(struct ida_viewer *ida)
     return 0;
 }
 
+int
+viewer_undo(struct ida_viewer *ida)
+{
+    return viewer_history(ida, 0);
+}
+
+int
+viewer_redo(struct ida_viewer *ida)
+{
+    return viewer_history(ida, 1);
+}
+
+/*
+ * Previews are computed at screen resolution only.  Zoomed out the
+ * op runs on a proxy image (the downscaled view), which the worker
+ * thread builds once per view, the preview waits for it.  Only ops
+ * not depending on the resolution can use it (ida_op->proxy), for
+ * the others (radius, 3x3 kernel) and when not zoomed out only the
+ * image lines visible in the scrolled window are processed.  The
+ * full resolution pass happens when the op is applied
+ * (viewer_start_op).
+ */
+static void
+viewer_preview_proxy(struct ida_viewer *ida)
+{
+    if (NULL != ida->op_proxy.p)
+	return;
+
+    ida->op_proxy.i = ida->img.i;
+    ida->op_proxy.i.width  = ida->scrwidth;
+    ida->op_proxy.i.height = ida->scrheight;
+    ida_image_alloc(&ida->op_proxy);
+    ida->proxy_zoom = zoom_init(ida->img.i.width, 2, -ida->zoom+2);
+    ida->proxy_line = malloc(ida->scrwidth*3);
+}
+
+static void
+viewer_preview_lines(struct ida_viewer *ida,
+		     unsigned int *start, unsigned int *end)
+{
+    Widget clip = XtParent(ida->widget);
+    Dimension height;
+    Position y;
+    int y1,y2;
+
+    /* visible part of the widget (inside the scrolled window clip) */
+    XtVaGetValues(ida->widget, XtNy, &y, NULL);
+    XtVaGetValues(clip, XtNheight, &height, NULL);
+    y1 = -y;
+    y2 = -y + height;
+    if (y1 < 0)
+	y1 = 0;
+    if (y2 > (int)ida->scrheight)
+	y2 = ida->scrheight;
+    if (y2 < y1)
+	y2 = y1;
+
+    if (ida->op_preview_proxy) {
+	*start = y1;
+	*end   = y2;
+    } else if (ida->zoom < 0) {
+	/* whole rows, the box filter is restarted at the first one */
+	*start = zoom_seek(ida->zoomout, y1);
+	*end   = (y2 * (-ida->zoom+2) + 1) / 2;
+	if (*end > ida->img.i.height)
+	    *end = ida->img.i.height;
+    } else {
+	*start = viewer_s2i(ida->zoom,y1);
+	*end   = viewer_s2i(ida->zoom,y2 + ida->zoom);
+	if (*end > ida->img.i.height)
+	    *end = ida->img.i.height;
+    }
+}
+
 int
 viewer_start_preview(struct ida_viewer *ida, struct ida_op *op, void *parm)
 {
+    struct ida_image *src = &ida->img;
     struct ida_image dst;
+    unsigned int start,end,proxy;
 
+    /* cancels a still running preview too */
     viewer_workfinish(ida);
 
     /* try init */
-    viewer_op_rect(ida);
-    ida->op_data = op->init(&ida->img,&ida->op_rect,&dst.i,parm);
-    if (NULL == ida->op_data)
+    viewer_op_rect(ida, &ida->op_rect);
+    proxy = op->proxy && ida->zoom < 0;
+    if (proxy) {
+	viewer_preview_proxy(ida);
+	src = &ida->op_proxy;
+	ida->op_rect.x1 = viewer_i2s(ida->zoom,ida->op_rect.x1);
+	ida->op_rect.x2 = viewer_i2s(ida->zoom,ida->op_rect.x2);
+	ida->op_rect.y1 = viewer_i2s(ida->zoom,ida->op_rect.y1);
+	ida->op_rect.y2 = viewer_i2s(ida->zoom,ida->op_rect.y2);
+	if (ida->op_rect.x2 > src->i.width)
+	    ida->op_rect.x2 = src->i.width;
+	if (ida->op_rect.y2 > src->i.height)
+	    ida->op_rect.y2 = src->i.height;
+    }
+    memset(&dst, 0, sizeof(dst));
+    ida->op_data = op->init(src,&ida->op_rect,&dst.i,parm);
+    if (NULL == ida->op_data) {
+	if (ida->proxy_zoom)
+	    viewer_proxy_done(ida, 1);
 	return -1;
+    }
 
     /* prepare background preview */
-    ida->op_line = 0;
+    ida->op_preview_proxy = proxy;
+    viewer_preview_lines(ida,&start,&end);
     ida->op_work = op->work;
+    ida->op_band = NULL; /* previews render line by line */
     ida->op_done = op->done;
     ida->op_preview = 1;
-
-    viewer_workstart(ida);
+    ida->op_preview_end = end;
+
+    ida->line = start;
+    if (ida->proxy_zoom) {
+	/* init doesn't look at the pixels, they are coming now */
+	viewer_thread_start(ida);
+	if (ida->thread_running)
+	    return 0;
+    }
+    if (!ida->wproc)
+	ida->wproc = XtAppAddWorkProc(app_context,viewer_workproc,ida);
     return 0;
 }
 
@@ -789,7 +1138,7 @@ viewer_loader_start(struct ida_viewer *ida, struct ida_loader *loader,
     /* init loader */
     ptr_busy();
     memset(&info,0,sizeof(info));
-    data = loader->init(fp,filename,page,&info,0);
+    data = loader->init(fp,filename,page,&info,LOAD_PROGRESSIVE);
     ptr_idle();
     if (NULL == data) {
 	fprintf(stderr,"loading %s [%s] FAILED\n",filename,loader->name);
@@ -802,10 +1151,8 @@ viewer_loader_start(struct ida_viewer *ida, struct ida_loader *loader,
     viewer_workstop(ida);
     viewer_rubber_off(ida);
     memset(&ida->current,0,sizeof(ida->current));
-    if (ida->undo.p) {
-	ida_image_free(&ida->undo);
-	memset(&ida->undo,0,sizeof(ida->undo));
-    }
+    hist_clear(ida->hist);
+    viewer_run_end(ida);
     if (NULL != ida->img.p)
         ida_image_free(&ida->img);
     ida->file       = filename;
@@ -813,8 +1160,8 @@ viewer_loader_start(struct ida_viewer *ida, struct ida_loader *loader,
     ida_image_alloc(&ida->img);
 
     /* prepare background loading */
-    ida->load_line = 0;
     ida->load_read = loader->read;
+    ida->load_pass = loader->pass;
     ida->load_done = loader->done;
     ida->load_data = data;
 
@@ -866,13 +1213,12 @@ viewer_setimage(struct ida_viewer *ida, struct ida_image *img, char *name)
     viewer_workstop(ida);
     viewer_rubber_off(ida);
     memset(&ida->current,0,sizeof(ida->current));
-    if (ida->undo.p) {
-	ida_image_free(&ida->undo);
-	memset(&ida->undo,0,sizeof(ida->undo));
-    }
+    hist_clear(ida->hist);
+    viewer_run_end(ida);
 
     if (NULL != ida->img.p)
 	ida_image_free(&ida->img);
+    ida_image_promote(img);
     ida->file       = name;
     ida->img        = *img;
 
@@ -891,6 +1237,7 @@ viewer_init(Widget widget)
     ida = malloc(sizeof(*ida));
     memset(ida,0,sizeof(*ida));
     ida->widget = widget;
+    ida->hist = hist_init((size_t)GET_UNDO_MEM() << 20);
     XtAddEventHandler(widget,ExposureMask,False,viewer_redraw,ida);
     XtAddEventHandler(widget,
 		      ButtonPressMask   |
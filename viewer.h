@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <X11/Intrinsic.h>
 
 #define POINTER_NORMAL    0
@@ -26,12 +27,13 @@ struct ida_viewer {
 
     /* image data */
     struct ida_image img;
-    struct ida_image undo;
+    struct ida_history *hist;
     char             *file;
 
     /* view data */
     int              zoom;
     unsigned int     scrwidth, scrheight;
+    struct ida_zoom  *zoomout;
     XImage           *ximage;
     void             *ximage_shm;
     unsigned char    *rgb_line;
@@ -51,23 +53,44 @@ struct ida_viewer {
     /* workproc state */
     XtWorkProcId     wproc;
     unsigned int     line;
+    unsigned int     pass;
     unsigned int     steps;
 
+    /* worker thread, runs the loader / operation */
+    pthread_t        thread;
+    int              thread_running;
+    int              thread_pipe[2];
+    XtInputId        thread_input;
+    unsigned int     thread_line;
+    int              thread_cancel;
+    int              thread_done;
+
     /* image loader */
-    unsigned int     load_line;
     void             (*load_read)(unsigned char *dst, unsigned int line,
 				  void *data);
+    int              (*load_pass)(void *data);
     void             (*load_done)(void *data);
     void             *load_data;
 
     /* image operation */
     struct ida_image op_src;
     struct ida_rect  op_rect;
-    unsigned int     op_line;
+    int              op_in_rect;
+    struct op_points *op_run;   /* see viewer_fuse_op */
+    struct ida_rect  op_run_rect;
     unsigned int     op_preview;
+    unsigned int     op_preview_proxy;
+    unsigned int     op_preview_end;
+    struct ida_image op_proxy;
+    struct ida_zoom  *proxy_zoom;   /* proxy being built by the worker */
+    unsigned char    *proxy_line;
     void             (*op_work)(struct ida_image *src, struct ida_rect *rect,
 				unsigned char *dst, int line,
 				void *data);
+    void             (*op_band)(struct ida_image *src,
+				struct ida_rect *rect,
+				unsigned char *dst, unsigned int stride,
+				int line, unsigned int count, void *data);
     void             (*op_done)(void *data);
     void             *op_data;
 };
@@ -86,7 +109,9 @@ int viewer_setimage(struct ida_viewer *ida, struct ida_image *img, char *name);
 void viewer_autozoom(struct ida_viewer *ida);
 void viewer_setzoom(struct ida_viewer *ida, int zoom);
 int viewer_i2s(int zoom, int val);
+int viewer_s2i(int zoom, int val);
 int viewer_undo(struct ida_viewer *ida);
+int viewer_redo(struct ida_viewer *ida);
 int viewer_start_op(struct ida_viewer *ida, struct ida_op *op, void *parm);
 int viewer_start_preview(struct ida_viewer *ida, struct ida_op *op,
 			 void *parm);
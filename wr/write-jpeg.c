@@ -65,6 +65,7 @@ jpeg_write(FILE *fp, struct ida_image *img)
     unsigned char *line;
     unsigned int i;
 
+    ida_image_promote(img);
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
     jpeg_stdio_dest(&cinfo, fp);
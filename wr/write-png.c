@@ -3,13 +3,399 @@
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <png.h>
+#include <zlib.h>
 #include <setjmp.h>
 
 #include "readers.h"
 #include "writers.h"
+#include "misc.h"
+
+#include <X11/Xlib.h>
+#include <X11/Intrinsic.h>
+#include <Xm/Xm.h>
+#include <Xm/Text.h>
+#include <Xm/SelectioB.h>
+#include "RegEdit.h"
+#include "ida.h"
 #include "viewer.h"
 
+#define PNG_BLOCK     (512 * 1024)   /* raw bytes per deflate block */
+#define PNG_WINDOW    32768          /* deflate window, block dictionary */
+#define PNG_THREADS   16
+
+static int png_level = 6;
+
+/* ---------------------------------------------------------------------- */
+/* options dialog                                                         */
+
+static Widget png_shell;
+static Widget png_entry;
+
+static void
+png_button_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
+{
+    XmSelectionBoxCallbackStruct *cb = call_data;
+
+    if (XmCR_OK == cb->reason) {
+	png_level = atoi(XmTextGetString(png_entry));
+	if (png_level < 0)
+	    png_level = 0;
+	if (png_level > 9)
+	    png_level = 9;
+	do_save_print();
+    }
+    XtUnmanageChild(png_shell);
+}
+
+static int
+png_conf(Widget parent, struct ida_image *img)
+{
+    char tmp[32];
+
+    if (!png_shell) {
+	/* build dialog */
+	png_shell = XmCreatePromptDialog(parent,"png",NULL,0);
+	XmdRegisterEditres(XtParent(png_shell));
+	XtUnmanageChild(XmSelectionBoxGetChild(png_shell,XmDIALOG_HELP_BUTTON));
+	png_entry = XmSelectionBoxGetChild(png_shell,XmDIALOG_TEXT);
+	XtAddCallback(png_shell,XmNokCallback,png_button_cb,NULL);
+	XtAddCallback(png_shell,XmNcancelCallback,png_button_cb,NULL);
+    }
+    sprintf(tmp,"%d",png_level);
+    XmTextSetString(png_entry,tmp);
+    XtManageChild(png_shell);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* parallel deflate                                                       */
+
+/*
+ * The image is cut into blocks of rows, each block is filtered and
+ * deflated on its own (raw deflate, primed with the preceding 32k of
+ * filtered data as dictionary, terminated by a sync flush).  The
+ * pieces are joined into a single zlib stream with a combined adler32
+ * and written as IDAT chunks, in order, as they complete.
+ */
+
+struct png_block {
+    unsigned int   y1, y2;
+    unsigned char  *data;
+    size_t         size;
+    uLong          adler;
+    int            done;
+};
+
+struct png_par {
+    struct ida_image  *img;
+    unsigned int      bpl;
+    unsigned int      nblocks;
+    unsigned int      nthreads;
+    struct png_block  *blocks;
+    unsigned int      next;      /* next block to compress */
+    unsigned int      written;   /* blocks written to the file */
+    int               error;
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+};
+
+static inline unsigned int
+png_paeth(int a, int b, int c)
+{
+    int p  = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+	return a;
+    if (pb <= pc)
+	return b;
+    return c;
+}
+
+static inline unsigned int
+png_cost(unsigned char *f, unsigned int bpl)
+{
+    unsigned int i, sum = 0;
+
+    for (i = 0; i < bpl; i++)
+	sum += (f[i] < 128) ? f[i] : 256 - f[i];
+    return sum;
+}
+
+static void
+png_filter(unsigned int type, unsigned char *f, unsigned char *cur,
+	   unsigned char *up, unsigned int bpl)
+{
+    unsigned int i;
+
+    f[0] = type;
+    f++;
+    switch (type) {
+    case 1: /* sub */
+	memcpy(f, cur, 3);
+	for (i = 3; i < bpl; i++)
+	    f[i] = cur[i] - cur[i-3];
+	break;
+    case 2: /* up */
+	for (i = 0; i < bpl; i++)
+	    f[i] = cur[i] - up[i];
+	break;
+    case 3: /* average */
+	for (i = 0; i < 3; i++)
+	    f[i] = cur[i] - (up[i] >> 1);
+	for (; i < bpl; i++)
+	    f[i] = cur[i] - ((cur[i-3] + up[i]) >> 1);
+	break;
+    case 4: /* paeth */
+	for (i = 0; i < 3; i++)
+	    f[i] = cur[i] - up[i];
+	for (; i < bpl; i++)
+	    f[i] = cur[i] - png_paeth(cur[i-3], up[i], up[i-3]);
+	break;
+    }
+}
+
+/* filter one row, pick the filter like libpng does (minimum sum) */
+static unsigned char*
+png_filter_row(struct png_par *par, unsigned int y,
+	       unsigned char *buf1, unsigned char *buf2)
+{
+    unsigned int bpl = par->bpl;
+    unsigned char *cur = ida_image_scanline(par->img, y);
+    unsigned char *up = y ? ida_image_scanline(par->img, y-1) : NULL;
+    unsigned char *best, *f;
+    unsigned int type, cost, bcost;
+
+    /* level 0 is about speed only, no filtering */
+    buf1[0] = 0;
+    memcpy(buf1 + 1, cur, bpl);
+    best = buf1;
+    if (0 == png_level)
+	return best;
+
+    bcost = png_cost(best + 1, bpl);
+    for (type = 1; type <= 4; type++) {
+	if (!up && type > 1)
+	    break;
+	f = (best == buf1) ? buf2 : buf1;
+	png_filter(type, f, cur, up, bpl);
+	cost = png_cost(f + 1, bpl);
+	if (cost < bcost) {
+	    bcost = cost;
+	    best = f;
+	}
+    }
+    return best;
+}
+
+static int
+png_deflate_block(struct png_par *par, struct png_block *blk)
+{
+    unsigned int rlen = par->bpl + 1;
+    unsigned char *tmp, *out, *row, *dict;
+    unsigned int y, y0, dlen;
+    size_t max;
+    z_stream z;
+    int last, rc = -1;
+
+    memset(&z, 0, sizeof(z));
+    if (Z_OK != deflateInit2(&z, png_level, Z_DEFLATED, -15, 8,
+			     png_level ? Z_FILTERED : Z_DEFAULT_STRATEGY))
+	return -1;
+    tmp = malloc(rlen);
+    out = malloc(rlen);
+    if (!tmp || !out)
+	goto out;
+    blk->adler = adler32(0, NULL, 0);
+
+    /* dictionary: the filtered rows right before the block */
+    if (blk->y1 && png_level) {
+	y0 = (PNG_WINDOW + rlen - 1) / rlen;
+	y0 = (y0 < blk->y1) ? blk->y1 - y0 : 0;
+	dict = malloc((blk->y1 - y0) * rlen);
+	if (!dict)
+	    goto out;
+	for (y = y0, dlen = 0; y < blk->y1; y++, dlen += rlen)
+	    memcpy(dict + dlen, png_filter_row(par, y, tmp, out), rlen);
+	if (dlen > PNG_WINDOW)
+	    deflateSetDictionary(&z, dict + dlen - PNG_WINDOW, PNG_WINDOW);
+	else
+	    deflateSetDictionary(&z, dict, dlen);
+	free(dict);
+    }
+
+    max = deflateBound(&z, (size_t)(blk->y2 - blk->y1) * rlen) + 16;
+    blk->data = malloc(max);
+    if (!blk->data)
+	goto out;
+    z.next_out  = blk->data;
+    z.avail_out = max;
+    last = (blk->y2 == par->img->i.height);
+    for (y = blk->y1; y < blk->y2; y++) {
+	row = png_filter_row(par, y, tmp, out);
+	blk->adler = adler32(blk->adler, row, rlen);
+	z.next_in  = row;
+	z.avail_in = rlen;
+	switch (deflate(&z, (y+1 < blk->y2) ? Z_NO_FLUSH :
+			last ? Z_FINISH : Z_SYNC_FLUSH)) {
+	case Z_OK:
+	case Z_STREAM_END:
+	case Z_BUF_ERROR:
+	    break;
+	default:
+	    goto out;
+	}
+    }
+    blk->size = max - z.avail_out;
+    if (0 == z.avail_in)
+	rc = 0;
+
+ out:
+    deflateEnd(&z);
+    free(tmp);
+    free(out);
+    return rc;
+}
+
+static void*
+png_deflate_thread(void *arg)
+{
+    struct png_par *par = arg;
+    struct png_block *blk;
+    int rc;
+
+    pthread_mutex_lock(&par->lock);
+    for (;;) {
+	/* don't run too far ahead of the writer */
+	while (par->next < par->nblocks &&
+	       par->next >= par->written + 2 * par->nthreads)
+	    pthread_cond_wait(&par->cond, &par->lock);
+	if (par->next >= par->nblocks)
+	    break;
+	blk = par->blocks + par->next++;
+	pthread_mutex_unlock(&par->lock);
+
+	rc = png_deflate_block(par, blk);
+
+	pthread_mutex_lock(&par->lock);
+	if (0 != rc)
+	    par->error = 1;
+	blk->done = 1;
+	pthread_cond_broadcast(&par->cond);
+    }
+    pthread_mutex_unlock(&par->lock);
+    return NULL;
+}
+
+/* returns 1 if no worker could be started, nothing is written then */
+static int
+png_write_par(png_structp png_ptr, struct ida_image *img,
+	      unsigned int nthreads)
+{
+    struct png_par par;
+    struct png_block *blk;
+    pthread_t tids[PNG_THREADS];
+    unsigned char head[2], tail[4];
+    unsigned int i, rows, hdr;
+    uLong adler;
+
+    memset(&par, 0, sizeof(par));
+    par.img = img;
+    par.bpl = img->i.width * 3;
+    par.nthreads = nthreads;
+    rows = PNG_BLOCK / (par.bpl + 1);
+    if (rows < 1)
+	rows = 1;
+    par.nblocks = (img->i.height + rows - 1) / rows;
+    par.blocks = malloc(par.nblocks * sizeof(*par.blocks));
+    memset(par.blocks, 0, par.nblocks * sizeof(*par.blocks));
+    for (i = 0; i < par.nblocks; i++) {
+	par.blocks[i].y1 = i * rows;
+	par.blocks[i].y2 = (i+1) * rows;
+	if (par.blocks[i].y2 > img->i.height)
+	    par.blocks[i].y2 = img->i.height;
+    }
+    pthread_mutex_init(&par.lock, NULL);
+    pthread_cond_init(&par.cond, NULL);
+    pthread_mutex_lock(&par.lock);
+    for (i = 0; i < nthreads; i++)
+	if (0 != pthread_create(&tids[i], NULL, png_deflate_thread, &par))
+	    break;
+    par.nthreads = nthreads = i;
+    pthread_mutex_unlock(&par.lock);
+    if (0 == nthreads) {
+	/* no workers, caller goes the serial way */
+	pthread_cond_destroy(&par.cond);
+	pthread_mutex_destroy(&par.lock);
+	free(par.blocks);
+	return 1;
+    }
+
+    /* zlib header: 32k window, level hint, check bits */
+    hdr = 0x7800;
+    if (png_level > 6)
+	hdr |= 3 << 6;
+    else if (png_level == 6)
+	hdr |= 2 << 6;
+    else if (png_level > 1)
+	hdr |= 1 << 6;
+    hdr += 31 - hdr % 31;
+    head[0] = hdr >> 8;
+    head[1] = hdr & 0xff;
+
+    /* write blocks in order as they are ready */
+    adler = adler32(0, NULL, 0);
+    for (i = 0; i < par.nblocks; i++) {
+	blk = par.blocks + i;
+	pthread_mutex_lock(&par.lock);
+	while (!blk->done)
+	    pthread_cond_wait(&par.cond, &par.lock);
+	pthread_mutex_unlock(&par.lock);
+
+	adler = adler32_combine(adler, blk->adler,
+				(z_off_t)(blk->y2 - blk->y1) * (par.bpl + 1));
+	if (!par.error) {
+	    png_write_chunk_start(png_ptr, (png_const_bytep)"IDAT",
+				  blk->size + (i == 0 ? 2 : 0) +
+				  (i+1 == par.nblocks ? 4 : 0));
+	    if (i == 0)
+		png_write_chunk_data(png_ptr, head, 2);
+	    png_write_chunk_data(png_ptr, blk->data, blk->size);
+	    if (i+1 == par.nblocks) {
+		tail[0] = adler >> 24;
+		tail[1] = adler >> 16;
+		tail[2] = adler >>  8;
+		tail[3] = adler;
+		png_write_chunk_data(png_ptr, tail, 4);
+	    }
+	    png_write_chunk_end(png_ptr);
+	}
+	free(blk->data);
+	blk->data = NULL;
+
+	pthread_mutex_lock(&par.lock);
+	par.written++;
+	pthread_cond_broadcast(&par.cond);
+	pthread_mutex_unlock(&par.lock);
+    }
+
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tids[i], NULL);
+    pthread_cond_destroy(&par.cond);
+    pthread_mutex_destroy(&par.lock);
+    free(par.blocks);
+    if (par.error)
+	return -1;
+
+    png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+    return 0;
+}
+
 /* ---------------------------------------------------------------------- */
 /* save                                                                   */
 
@@ -20,6 +406,9 @@ png_write(FILE *fp, struct ida_image *img)
     png_infop info_ptr  = NULL;
     png_bytep row;
     unsigned int y;
+    long nthreads;
+
+    ida_image_promote(img); /* before the deflate threads look at it */
     
    /* Create and initialize the png_struct with the desired error handler
     * functions.  If you want to use the default stderr and longjump method,
@@ -49,8 +438,29 @@ png_write(FILE *fp, struct ida_image *img)
 		    PNG_RESOLUTION_METER);
    }
    png_write_info(png_ptr, info_ptr);
-   png_set_packing(png_ptr);
 
+   /*
+    * Large images are deflated in parallel.  Virtual images can only be
+    * read sequentially, they go through libpng.
+    */
+   nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (nthreads > PNG_THREADS)
+       nthreads = PNG_THREADS;
+   if (nthreads > 1 && !img->stage &&
+       (size_t)img->i.width * 3 * img->i.height > 2 * PNG_BLOCK) {
+       switch (png_write_par(png_ptr, img, nthreads)) {
+       case 0:
+	   png_destroy_write_struct(&png_ptr, &info_ptr);
+	   return 0;
+       case 1:
+	   break; /* no threads, write serially */
+       default:
+	   goto oops;
+       }
+   }
+
+   png_set_compression_level(png_ptr, png_level);
+   png_set_packing(png_ptr);
    for (y = 0; y < img->i.height; y++) {
        row = ida_image_scanline(img, y);
        png_write_rows(png_ptr, &row, 1);
@@ -70,6 +480,7 @@ static struct ida_writer png_writer = {
     label:  "PNG",
     ext:    { "png", NULL},
     write:  png_write,
+    conf:   png_conf,
 };
 
 static void __init init_wr(void)
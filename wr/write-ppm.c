@@ -14,6 +14,7 @@
 static int
 ppm_write(FILE *fp, struct ida_image *img)
 {
+    ida_image_promote(img);
     fprintf(fp,"P6\n"
 	    "# written by ida " VERSION "\n"
 	    "# https://www.kraxel.org/blog/linux/fbida/\n"
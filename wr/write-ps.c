@@ -4,6 +4,10 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <jpeglib.h>
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Intrinsic.h>
@@ -42,8 +46,9 @@ static struct PAPER formats[] = {
 };
 
 static const char *header =
-"%%!PS-Adobe-2.0 EPSF-2.0\n"
+"%%!PS-Adobe-3.0 EPSF-3.0\n"
 "%%%%Creator: ida " VERSION " (https://www.kraxel.org/blog/linux/fbida/)\n"
+"%%%%LanguageLevel: %d\n"
 "%%%%Pages: 1\n"
 "%%%%BoundingBox: %d %d %d %d\n"
 "%%%%DocumentFonts: \n"
@@ -62,69 +67,17 @@ static const char *footer =
 "origstate restore\n"
 "%%Trailer\n";
 
-/* taken from xwd2ps, ftp://ftp.x.org/R5contrib/xwd2ps.tar.Z */
-static const char *ColorImage =
-"% define 'colorimage' if it isn't defined\n"
-"%   ('colortogray' and 'mergeprocs' come from xwd2ps\n"
-"%     via xgrab)\n"
-"/colorimage where   % do we know about 'colorimage'?\n"
-"  { pop }           % yes: pop off the 'dict' returned\n"
-"  {                 % no:  define one\n"
-"    /colortogray {  % define an RGB->I function\n"
-"      /rgbdata exch store    % call input 'rgbdata'\n"
-"      rgbdata length 3 idiv\n"
-"      /npixls exch store\n"
-"      /rgbindx 0 store\n"
-"      0 1 npixls 1 sub {\n"
-"        grays exch\n"
-"        rgbdata rgbindx       get 20 mul    % Red\n"
-"        rgbdata rgbindx 1 add get 32 mul    % Green\n"
-"        rgbdata rgbindx 2 add get 12 mul    % Blue\n"
-"        add add 64 idiv      % I = .5G + .31R + .18B\n"
-"        put\n"
-"        /rgbindx rgbindx 3 add store\n"
-"      } for\n"
-"      grays 0 npixls getinterval\n"
-"    } bind def\n"
-"\n"
-"    % Utility procedure for colorimage operator.\n"
-"    % This procedure takes two procedures off the\n"
-"    % stack and merges them into a single procedure.\n"
-"\n"
-"    /mergeprocs { % def\n"
-"      dup length\n"
-"      3 -1 roll\n"
-"      dup\n"
-"      length\n"
-"      dup\n"
-"      5 1 roll\n"
-"      3 -1 roll\n"
-"      add\n"
-"      array cvx\n"
-"      dup\n"
-"      3 -1 roll\n"
-"      0 exch\n"
-"      putinterval\n"
-"      dup\n"
-"      4 2 roll\n"
-"      putinterval\n"
-"    } bind def\n"
-"\n"
-"    /colorimage { % def\n"
-"      pop pop     % remove 'false 3' operands\n"
-"      {colortogray} mergeprocs\n"
-"      image\n"
-"    } bind def\n"
-"  } ifelse          % end of 'false' case\n"
-"\n";
-
-
 /* ---------------------------------------------------------------------- */
 /* save                                                                   */
 
 #define PORTRAIT    0
 #define LANDSCAPE   1
 
+#define ENC_JPEG    0
+#define ENC_FLATE   1
+
+#define JPEG_QUALITY 90
+
 #define DRAW_SIZE   200
 #define DRAW_SCALE  6
 #define DSCALED(x)  (((x)+DRAW_SCALE/2)/DRAW_SCALE)
@@ -138,6 +91,7 @@ static struct ps_options {
     int format;
     int ori;
     int scaling;
+    int enc;
 
     int iwidth,iheight,ires;
     int pwidth,pheight;
@@ -290,6 +244,12 @@ ps_ori_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
     ps_defaults();
 }
 
+static void
+ps_enc_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
+{
+    ps.enc = (intptr_t)clientdata;
+}
+
 static void
 ps_scaling_cb(Widget widget, XtPointer clientdata, XtPointer call_data)
 {
@@ -369,6 +329,20 @@ ps_conf(Widget parent, struct ida_image *img)
 				       menu,NULL);
 	XtAddCallback(push,XmNactivateCallback,ps_ori_cb,(XtPointer)LANDSCAPE);
 
+	/* image data compression */
+	menu = XmCreatePulldownMenu(rc,"encM",NULL,0);
+	XtSetArg(args[0],XmNsubMenuId,menu);
+	opt = XmCreateOptionMenu(rc,"enc",args,1);
+	XtManageChild(opt);
+	push = XtVaCreateManagedWidget("jpeg",xmPushButtonWidgetClass,
+				       menu,NULL);
+	XtAddCallback(push,XmNactivateCallback,ps_enc_cb,(XtPointer)ENC_JPEG);
+#ifdef HAVE_LIBZ
+	push = XtVaCreateManagedWidget("flate",xmPushButtonWidgetClass,
+				       menu,NULL);
+	XtAddCallback(push,XmNactivateCallback,ps_enc_cb,(XtPointer)ENC_FLATE);
+#endif
+
 	ps.scale = XtVaCreateManagedWidget("scale",xmScaleWidgetClass,rc,NULL);
 	XtAddCallback(ps.scale,XmNdragCallback,ps_scaling_cb,NULL);
 	XtAddCallback(ps.scale,XmNvalueChangedCallback,ps_scaling_cb,NULL);
@@ -388,24 +362,176 @@ ps_conf(Widget parent, struct ida_image *img)
     return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* image data encoding                                                    */
+
+/* ASCII85, buffered, written out in large blocks */
+struct ps_a85 {
+    FILE          *fp;
+    uint32_t      tuple;
+    unsigned int  count;
+    unsigned int  col;
+    unsigned int  len;
+    char          buf[65536];
+};
+
+static void
+ps_a85_flush(struct ps_a85 *a)
+{
+    fwrite(a->buf, a->len, 1, a->fp);
+    a->len = 0;
+}
+
+static void
+ps_a85_tuple(struct ps_a85 *a, uint32_t tuple, unsigned int bytes)
+{
+    char out[5];
+    int i;
+
+    if (a->len + 8 > sizeof(a->buf))
+	ps_a85_flush(a);
+    if (4 == bytes && 0 == tuple) {
+	a->buf[a->len++] = 'z';
+	a->col++;
+    } else {
+	for (i = 4; i >= 0; i--) {
+	    out[i] = '!' + tuple % 85;
+	    tuple /= 85;
+	}
+	memcpy(a->buf + a->len, out, bytes + 1);
+	a->len += bytes + 1;
+	a->col += bytes + 1;
+    }
+    if (a->col >= 75) {
+	a->buf[a->len++] = '\n';
+	a->col = 0;
+    }
+}
+
+static void
+ps_a85_put(struct ps_a85 *a, const unsigned char *data, size_t size)
+{
+    /* complete a pending tuple */
+    while (a->count && size) {
+	a->tuple |= (uint32_t)*(data++) << (24 - 8 * a->count);
+	size--;
+	if (4 == ++a->count) {
+	    ps_a85_tuple(a, a->tuple, 4);
+	    a->tuple = 0;
+	    a->count = 0;
+	}
+    }
+    /* bulk */
+    for (; size >= 4; data += 4, size -= 4)
+	ps_a85_tuple(a, ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 |
+			 (uint32_t)data[2] <<  8 | (uint32_t)data[3]), 4);
+    /* keep the rest */
+    while (size--) {
+	a->tuple |= (uint32_t)*(data++) << (24 - 8 * a->count);
+	a->count++;
+    }
+}
+
+static void
+ps_a85_finish(struct ps_a85 *a)
+{
+    if (a->count)
+	ps_a85_tuple(a, a->tuple, a->count);
+    ps_a85_flush(a);
+    fprintf(a->fp, "~>\n");
+}
+
+static int
+ps_data_jpeg(struct ps_a85 *a, struct ida_image *img)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *line;
+    char *data = NULL;
+    size_t size = 0;
+    unsigned int y;
+    FILE *mfp;
+
+    mfp = open_memstream(&data, &size);
+    if (NULL == mfp)
+	return -1;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, mfp);
+    cinfo.image_width  = img->i.width;
+    cinfo.image_height = img->i.height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    for (y = 0; y < img->i.height; y++) {
+	line = ida_image_scanline(img, y);
+	jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    fclose(mfp);
+
+    ps_a85_put(a, (unsigned char*)data, size);
+    free(data);
+    return 0;
+}
+
+#ifdef HAVE_LIBZ
+static int
+ps_data_flate(struct ps_a85 *a, struct ida_image *img)
+{
+    unsigned char out[65536];
+    unsigned char *row, *line;
+    unsigned int x, y, bpl;
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    if (Z_OK != deflateInit(&z, Z_DEFAULT_COMPRESSION))
+	return -1;
+    bpl = img->i.width * 3;
+    row = malloc(bpl + 1);
+
+    for (y = 0; y <= img->i.height; y++) {
+	if (y < img->i.height) {
+	    /* png "sub" predictor */
+	    line = ida_image_scanline(img, y);
+	    row[0] = 1;
+	    memcpy(row + 1, line, 3);
+	    for (x = 3; x < bpl; x++)
+		row[x+1] = line[x] - line[x-3];
+	    z.next_in  = row;
+	    z.avail_in = bpl + 1;
+	}
+	do {
+	    z.next_out  = out;
+	    z.avail_out = sizeof(out);
+	    deflate(&z, (y < img->i.height) ? Z_NO_FLUSH : Z_FINISH);
+	    ps_a85_put(a, out, sizeof(out) - z.avail_out);
+	} while (0 == z.avail_out);
+    }
+
+    deflateEnd(&z);
+    free(row);
+    return 0;
+}
+#endif
+
 static int
 ps_write(FILE *fp, struct ida_image *img)
 {
     unsigned int width,height,xoff,yoff;
-    unsigned int iwidth,iheight;
-    unsigned int x,y;
-    unsigned char *p;
+    struct ps_a85 *a;
+    int rc;
 
+    ida_image_promote(img);
     if (ps.ori == PORTRAIT) {
-	iwidth  = img->i.width;
-	iheight = img->i.height;
 	width   = ps.width;
 	height  = ps.height;
 	xoff    = ps.xcenter - ps.width/2;
 	yoff    = (ps.pheight - ps.ycenter) - ps.height/2;
     } else{
-	iwidth  = img->i.height;
-	iheight = img->i.width;
 	width   = ps.height;
 	height  = ps.width;
 	xoff    = ps.ycenter - ps.height/2;
@@ -414,50 +540,51 @@ ps_write(FILE *fp, struct ida_image *img)
 
     /* PS header */
     fprintf(fp,header, /* includes bbox */
+	    (ps.enc == ENC_FLATE) ? 3 : 2,
 	    xoff,yoff,xoff+width,yoff+height);
-    fprintf(fp,"\n"
-	    "/pix %u string def\n"
-	    "/grays %u string def\n"
-	    "/npixls 0 def\n"
-	    "/rgbindx 0 def\n"
-	    "\n",
-	    img->i.width*3,img->i.width);
-    fwrite(ColorImage,strlen(ColorImage),1,fp);
-
     fprintf(fp,"%u %u translate\n",xoff,yoff);
     fprintf(fp,"%u %u scale\n",width,height);
 
+    /* image dictionary, landscape is rotated by the image matrix */
     fprintf(fp,"\n"
-	    "%u %u 8\n"
-	    "[%u 0 0 -%u 0 %u]\n"
-	    "{currentfile pix readhexstring pop}\n"
-	    "false 3 colorimage\n",
-	    iwidth,iheight,iwidth,iheight,iheight);
+	    "/DeviceRGB setcolorspace\n"
+	    "<<\n"
+	    "  /ImageType 1\n"
+	    "  /Width %u\n"
+	    "  /Height %u\n"
+	    "  /BitsPerComponent 8\n"
+	    "  /Decode [0 1 0 1 0 1]\n",
+	    img->i.width, img->i.height);
+    if (ps.ori == PORTRAIT)
+	fprintf(fp,"  /ImageMatrix [%u 0 0 -%u 0 %u]\n",
+		img->i.width, img->i.height, img->i.height);
+    else
+	fprintf(fp,"  /ImageMatrix [0 %u %u 0 0 0]\n",
+		img->i.height, img->i.width);
+    if (ps.enc == ENC_FLATE)
+	fprintf(fp,"  /DataSource currentfile /ASCII85Decode filter\n"
+		"    << /Predictor 15 /Colors 3 /Columns %u >>"
+		" /FlateDecode filter\n",
+		img->i.width);
+    else
+	fprintf(fp,"  /DataSource currentfile /ASCII85Decode filter"
+		" /DCTDecode filter\n");
+    fprintf(fp,">> image\n");
 
     /* image data + ps footer */
-    if (ps.ori == PORTRAIT) {
-	p = ida_image_scanline(img, 0);
-	for (y = 0; y < img->i.height; y++) {
-	    for (x = 0; x < img->i.width; x++) {
-		if (0 == (x % 10))
-		    fprintf(fp,"\n");
-		fprintf(fp,"%02x%02x%02x ",p[0],p[1],p[2]);
-		p += 3;
-	    }
-	    fprintf(fp,"\n");
-	}
-    } else {
-	for (x = img->i.width-1; x != -1; x--) {
-            p = ida_image_scanline(img, 0) + 3*x;
-	    for (y = 0; y < img->i.height; y++) {
-		if (0 == (y % 10))
-		    fprintf(fp,"\n");
-		fprintf(fp,"%02x%02x%02x ",p[0],p[1],p[2]);
-		p += img->i.width*3;
-	    }
-	    fprintf(fp,"\n");
-	}
-    }
+    a = malloc(sizeof(*a));
+    memset(a, 0, offsetof(struct ps_a85, buf));
+    a->fp = fp;
+#ifdef HAVE_LIBZ
+    if (ps.enc == ENC_FLATE)
+	rc = ps_data_flate(a, img);
+    else
+#endif
+	rc = ps_data_jpeg(a, img);
+    ps_a85_finish(a);
+    free(a);
+    if (0 != rc)
+	return -1;
     fprintf(fp, "%s", footer);
     return 0;
 }
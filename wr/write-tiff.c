@@ -19,6 +19,7 @@ tiff_write(FILE *fp, struct ida_image *img)
     tdata_t       buf;
     unsigned int  y;
 
+    ida_image_promote(img);
     TiffHndl = TIFFFdOpen(fileno(fp),"42.tiff","w");
     if (TiffHndl == NULL)
 	return -1;
@@ -23,6 +23,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -35,6 +37,11 @@
 
 #include "x11.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_X86_SIMD 1
+#endif
+
 extern Display *dpy;
 
 #define PERROR(str)      fprintf(stderr,"%s:%d: %s: %s\n",__FILE__,__LINE__,str,strerror(errno))
@@ -312,3 +319,162 @@ x11_data_to_ximage(unsigned char *data, unsigned char *ximage,
             x11_lut_green[data[i + 1]] |
             x11_lut_blue[data[i + 2]];
 }
+
+/* ------------------------------------------------------------------------ */
+/* rgb scanlines => ximage                                                  */
+
+/*
+ * For 24/32 bpp truecolor visuals with 8 bits per color we can write
+ * the color bytes straight into the ximage data.  Returns the byte
+ * offset (within the pixel) for the given color mask, -1 if not
+ * possible.
+ */
+static int
+x11_mask_offset(XImage *ximage, unsigned long mask)
+{
+    int bytes = ximage->bits_per_pixel / 8;
+    int shift;
+
+    for (shift = 0; shift < bytes * 8; shift += 8)
+	if (mask == (0xffUL << shift))
+	    break;
+    if (shift == bytes * 8)
+	return -1;
+    if (ximage->byte_order == LSBFirst)
+	return shift / 8;
+    else
+	return bytes - 1 - shift / 8;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* r,g,b => b,g,r,0 (little endian xrgb), 16 pixels per loop */
+__attribute__((target("ssse3")))
+static unsigned int
+x11_rgb_to_bgrx_ssse3(uint8_t *dst, uint8_t *rgb, unsigned int width)
+{
+    const __m128i shuf = _mm_setr_epi8(2, 1, 0, -1,  5,  4, 3, -1,
+				       8, 7, 6, -1, 11, 10, 9, -1);
+    __m128i a, b, c;
+    unsigned int x;
+
+    for (x = 0; x + 16 <= width; x += 16, rgb += 48, dst += 64) {
+	a = _mm_loadu_si128((__m128i*)(rgb +  0));
+	b = _mm_loadu_si128((__m128i*)(rgb + 16));
+	c = _mm_loadu_si128((__m128i*)(rgb + 32));
+	_mm_storeu_si128((__m128i*)(dst +  0),
+			 _mm_shuffle_epi8(a, shuf));
+	_mm_storeu_si128((__m128i*)(dst + 16),
+			 _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), shuf));
+	_mm_storeu_si128((__m128i*)(dst + 32),
+			 _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), shuf));
+	_mm_storeu_si128((__m128i*)(dst + 48),
+			 _mm_shuffle_epi8(_mm_srli_si128(c, 4), shuf));
+    }
+    return x;
+}
+
+/* same as above, 8 pixels per loop (reads 4 bytes beyond) */
+__attribute__((target("avx2")))
+static unsigned int
+x11_rgb_to_bgrx_avx2(uint8_t *dst, uint8_t *rgb, unsigned int width)
+{
+    const __m256i shuf = _mm256_setr_epi8(2, 1, 0, -1,  5,  4, 3, -1,
+					  8, 7, 6, -1, 11, 10, 9, -1,
+					  2, 1, 0, -1,  5,  4, 3, -1,
+					  8, 7, 6, -1, 11, 10, 9, -1);
+    __m256i v;
+    unsigned int x;
+
+    for (x = 0; x + 10 <= width; x += 8, rgb += 24, dst += 32) {
+	v = _mm256_castsi128_si256(_mm_loadu_si128((__m128i*)(rgb)));
+	v = _mm256_inserti128_si256(v, _mm_loadu_si128((__m128i*)(rgb + 12)), 1);
+	_mm256_storeu_si256((__m256i*)dst, _mm256_shuffle_epi8(v, shuf));
+    }
+    return x;
+}
+
+#endif
+
+static unsigned int
+x11_rgb_to_bgrx(uint8_t *dst, uint8_t *rgb, unsigned int width)
+{
+    unsigned int x = 0;
+
+#ifdef HAVE_X86_SIMD
+    static int simd = -1;
+
+    if (simd < 0) {
+	__builtin_cpu_init();
+	simd = 0;
+	if (__builtin_cpu_supports("ssse3"))
+	    simd = 1;
+	if (__builtin_cpu_supports("avx2"))
+	    simd = 2;
+    }
+    if (simd == 2)
+	x = x11_rgb_to_bgrx_avx2(dst, rgb, width);
+    else if (simd == 1)
+	x = x11_rgb_to_bgrx_ssse3(dst, rgb, width);
+    dst += x * 4;
+    rgb += x * 3;
+#endif
+    for (; x < width; x++, dst += 4, rgb += 3) {
+	dst[0] = rgb[2];
+	dst[1] = rgb[1];
+	dst[2] = rgb[0];
+	dst[3] = 0;
+    }
+    return x;
+}
+
+/*
+ * Convert a rgb scanline (width pixels) to ximage line y, repeating
+ * each pixel rep times (for zoom in).  Writes directly into the ximage
+ * data for the common truecolor layouts, XPutPixel is the fallback for
+ * everything else.
+ */
+void
+x11_rgb_to_ximage(XImage *ximage, unsigned int y, unsigned char *rgb,
+		  unsigned int width, unsigned int rep)
+{
+    unsigned char *dst, pix[4];
+    unsigned long lpix;
+    int r,g,b,bpp;
+    unsigned int x,i,sx;
+
+    if (width * rep > (unsigned int)ximage->width)
+	width = ximage->width / rep;
+
+    bpp = ximage->bits_per_pixel / 8;
+    if (ximage->depth == 24 && (bpp == 3 || bpp == 4)) {
+	r = x11_mask_offset(ximage, ximage->red_mask);
+	g = x11_mask_offset(ximage, ximage->green_mask);
+	b = x11_mask_offset(ximage, ximage->blue_mask);
+	if (r >= 0 && g >= 0 && b >= 0) {
+	    dst = (unsigned char*)ximage->data + y * ximage->bytes_per_line;
+	    if (bpp == 4 && rep == 1 && r == 2 && g == 1 && b == 0) {
+		x11_rgb_to_bgrx(dst, rgb, width);
+		return;
+	    }
+	    memset(pix, 0, sizeof(pix));
+	    for (x = 0; x < width; x++, rgb += 3) {
+		pix[r] = rgb[0];
+		pix[g] = rgb[1];
+		pix[b] = rgb[2];
+		for (i = 0; i < rep; i++, dst += bpp)
+		    memcpy(dst, pix, bpp);
+	    }
+	    return;
+	}
+    }
+
+    /* generic */
+    for (x = 0, sx = 0; x < width; x++, rgb += 3) {
+	lpix = x11_lut_red[rgb[0]] |
+	    x11_lut_green[rgb[1]] |
+	    x11_lut_blue[rgb[2]];
+	for (i = 0; i < rep; i++, sx++)
+	    XPutPixel(ximage, sx, y, lpix);
+    }
+}
@@ -18,6 +18,9 @@ extern int      have_shmem;
 
 int             x11_color_init(Widget shell);
 
+void            x11_rgb_to_ximage(XImage *ximage, unsigned int y,
+				  unsigned char *rgb,
+				  unsigned int width, unsigned int rep);
 void            x11_data_to_ximage(unsigned char *rgb, unsigned char *ximage,
 				   int x, int y, int sy, int gray);
 XImage         *x11_create_ximage(Widget shell, int width, int height, void **shm);
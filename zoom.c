@@ -0,0 +1,218 @@
+/*
+ * box filter for scaling down images
+ *
+ * Does area averaging with integer weights:  Source pixels are num
+ * units wide, destination pixels are den units wide, the weight of a
+ * source pixel is the size of the overlap.  Each source line is
+ * summed up horizontally first, then added (weighted) to the
+ * accumulator for the current destination line.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include "zoom.h"
+
+struct ida_zoom_px {
+    unsigned int  first;   /* first source pixel */
+    unsigned int  count;   /* number of source pixels */
+    unsigned int  wfirst;  /* weight of first source pixel */
+    unsigned int  wlast;   /* weight of last source pixel */
+};
+
+struct ida_zoom {
+    unsigned int        swidth, dwidth;
+    unsigned int        num, den;
+    struct ida_zoom_px  *px;
+    uint32_t            *hsum;  /* horizontal sums (current line) */
+    uint32_t            *acc;   /* vertical accumulator */
+    uint32_t            div;    /* den * den */
+    int                 fast;   /* hsum fits into int16 */
+    unsigned int        row0;   /* first row emitted, see zoom_seek */
+};
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned int zoom_overlap(unsigned int a1, unsigned int a2,
+				 unsigned int b1, unsigned int b2)
+{
+    unsigned int start = a1 > b1 ? a1 : b1;
+    unsigned int end   = a2 < b2 ? a2 : b2;
+    return end > start ? end - start : 0;
+}
+
+struct ida_zoom *zoom_init(unsigned int width, unsigned int num,
+			   unsigned int den)
+{
+    struct ida_zoom *z;
+    unsigned int x,last;
+
+    if (num >= den || 0 == num)
+	return NULL;
+    z = malloc(sizeof(*z));
+    memset(z,0,sizeof(*z));
+    z->swidth = width;
+    z->dwidth = width * num / den;
+    z->num    = num;
+    z->den    = den;
+    z->div    = den * den;
+    z->fast   = (den * 255 < 32768);
+    if (0 == z->dwidth)
+	z->dwidth = 1;
+
+    z->px   = malloc(z->dwidth * sizeof(*z->px));
+    z->hsum = malloc(z->dwidth * 3 * sizeof(*z->hsum) + 16);
+    z->acc  = malloc(z->dwidth * 3 * sizeof(*z->acc) + 16);
+    memset(z->acc, 0, z->dwidth * 3 * sizeof(*z->acc));
+
+    for (x = 0; x < z->dwidth; x++) {
+	z->px[x].first  = x * den / num;
+	last            = ((x+1) * den - 1) / num;
+	if (last >= width)
+	    last = width-1;
+	z->px[x].count  = last - z->px[x].first + 1;
+	z->px[x].wfirst = zoom_overlap(z->px[x].first * num,
+				       (z->px[x].first+1) * num,
+				       x * den, (x+1) * den);
+	z->px[x].wlast  = zoom_overlap(last * num, (last+1) * num,
+				       x * den, (x+1) * den);
+    }
+    return z;
+}
+
+/*
+ * Start over with destination row dy (instead of 0), returns the
+ * source line to feed first.  That one may straddle the previous row,
+ * which is not emitted then.
+ */
+unsigned int zoom_seek(struct ida_zoom *z, unsigned int dy)
+{
+    memset(z->acc, 0, z->dwidth * 3 * sizeof(*z->acc));
+    z->row0 = dy;
+    return dy * z->den / z->num;
+}
+
+unsigned int zoom_width(struct ida_zoom *z)
+{
+    return z->dwidth;
+}
+
+void zoom_fini(struct ida_zoom *z)
+{
+    free(z->px);
+    free(z->hsum);
+    free(z->acc);
+    free(z);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void zoom_hsum(struct ida_zoom *z, unsigned char *src)
+{
+    struct ida_zoom_px *px = z->px;
+    uint32_t *dst = z->hsum;
+    unsigned char *s;
+    uint32_t red,green,blue;
+    unsigned int x,i;
+
+    for (x = 0; x < z->dwidth; x++, px++, dst += 3) {
+	s = src + px->first * 3;
+	if (1 == px->count) {
+	    dst[0] = px->wfirst * s[0];
+	    dst[1] = px->wfirst * s[1];
+	    dst[2] = px->wfirst * s[2];
+	    continue;
+	}
+
+	/* pixels fully covered */
+	red   = 0;
+	green = 0;
+	blue  = 0;
+	for (i = 1; i+1 < px->count; i++) {
+	    red   += s[i*3+0];
+	    green += s[i*3+1];
+	    blue  += s[i*3+2];
+	}
+	red   *= z->num;
+	green *= z->num;
+	blue  *= z->num;
+
+	/* partially covered (or full, depending on alignment) */
+	i = px->count-1;
+	dst[0] = red   + px->wfirst * s[0] + px->wlast * s[i*3+0];
+	dst[1] = green + px->wfirst * s[1] + px->wlast * s[i*3+1];
+	dst[2] = blue  + px->wfirst * s[2] + px->wlast * s[i*3+2];
+    }
+}
+
+static void zoom_vadd(struct ida_zoom *z, unsigned int weight)
+{
+    unsigned int i = 0, n = z->dwidth * 3;
+
+#ifdef __SSE2__
+    if (z->fast) {
+	/* hsum * weight, as 16x16 => 32 bit multiply-add */
+	__m128i w = _mm_set1_epi32(weight);
+	__m128i a, h;
+	for (; i + 4 <= n; i += 4) {
+	    h = _mm_loadu_si128((__m128i*)(z->hsum + i));
+	    a = _mm_loadu_si128((__m128i*)(z->acc + i));
+	    a = _mm_add_epi32(a, _mm_madd_epi16(h, w));
+	    _mm_storeu_si128((__m128i*)(z->acc + i), a);
+	}
+    }
+#endif
+    for (; i < n; i++)
+	z->acc[i] += z->hsum[i] * weight;
+}
+
+static void zoom_emit(struct ida_zoom *z, unsigned char *dst)
+{
+    uint64_t mul = ((uint64_t)1 << 32) / z->div + 1;
+    unsigned int i, n = z->dwidth * 3;
+
+    for (i = 0; i < n; i++)
+	dst[i] = (((uint64_t)z->acc[i] + z->div / 2) * mul) >> 32;
+    memset(z->acc, 0, n * sizeof(*z->acc));
+}
+
+/*
+ * Add source line y.  Returns 1 when a destination line is complete,
+ * it is written to dst and the line number is stored in *dy.
+ */
+int zoom_line(struct ida_zoom *z, unsigned char *src, unsigned int y,
+	      unsigned char *dst, unsigned int *dy)
+{
+    unsigned int start = y * z->num;
+    unsigned int end   = start + z->num;
+    unsigned int row   = start / z->den;
+    unsigned int split = (row + 1) * z->den;
+    int ready = 0;
+
+    if (0 == y)
+	zoom_seek(z, 0);
+
+    zoom_hsum(z, src);
+    if (end < split) {
+	zoom_vadd(z, z->num);
+    } else {
+	/* line completes the destination row */
+	zoom_vadd(z, split - start);
+	if (row >= z->row0) {
+	    zoom_emit(z, dst);
+	    *dy = row;
+	    ready = 1;
+	} else {
+	    memset(z->acc, 0, z->dwidth * 3 * sizeof(*z->acc));
+	}
+	if (end > split)
+	    zoom_vadd(z, end - split);
+    }
+    return ready;
+}
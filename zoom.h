@@ -0,0 +1,16 @@
+/*
+ * box filter for scaling down images (ida viewer zoom out)
+ *
+ * output size is (input size * num / den), den must be larger than
+ * num.  Feed the source lines in order, starting with line 0, or
+ * with the line zoom_seek() returns.
+ */
+struct ida_zoom;
+
+struct ida_zoom *zoom_init(unsigned int width, unsigned int num,
+			   unsigned int den);
+int zoom_line(struct ida_zoom *z, unsigned char *src, unsigned int y,
+	      unsigned char *dst, unsigned int *dy);
+unsigned int zoom_seek(struct ida_zoom *z, unsigned int dy);
+unsigned int zoom_width(struct ida_zoom *z);
+void zoom_fini(struct ida_zoom *z);